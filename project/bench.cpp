@@ -0,0 +1,409 @@
+/**
+ * FluidSim - a free and open-source interactive fluid flow simulator
+ * Copyright (C) 2015  Damian Jarek <damian.jarek93@gmail.com>
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License along
+ * with this program; if not, write to the Free Software Foundation, Inc.,
+ * 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+ */
+
+//FluidSimBench runs a scripted scenario without the UI and prints the throughput and per-phase timings as JSON,
+//so that the performance of builds can be compared
+
+#include <algorithm>
+#include <chrono>
+#include <cmath>
+#include <cstring>
+#include <iostream>
+#include <memory>
+#include <sstream>
+#include <stdexcept>
+#include <string>
+#include <vector>
+#include "config.h"
+#include "native_simulation.h"
+#include "program.h"
+#include "simulation.h"
+#include "trace.h"
+
+struct BenchConfig {
+	std::vector<std::pair<cl_uint, cl_uint>> sizes {{128, 128}, {256, 256}, {512, 512}}; //inner cells
+	std::vector<cl_uint> solver_iterations {100};
+	std::vector<cl_uint> workgroup_sizes {256};
+	std::vector<FieldStorage> storages {FieldStorage::FLOAT}; //float first, it's the reference of the others' error
+	std::vector<bool> fused_variants {false, true}; //of the OpenCL backend
+	unsigned long steps {200};
+	unsigned long warmup_steps {10};
+	unsigned long profile_steps {20}; //timed per phase after the throughput measurement
+	PressureSolver pressure_solver {PressureSolver::JACOBI};
+	Backend backend {Backend::OPENCL};
+	cl_uint threads {0}; //of the native backend
+	std::string recording_path; //each OpenCL run records the fields into it if set, replacing the previous run's recording
+	cl_uint recording_interval {1};
+	std::shared_ptr<const EventTrace> replay; //replaces the scenario and the settings if set
+	cl_device_type device_type {CL_DEVICE_TYPE_CPU};
+};
+
+struct BenchResult {
+	double seconds {0.0};
+	FrameStats profile; //phase times averaged over the profiled steps
+	ScalarField dye; //at the end of the run
+	cl_ulong checksum_mismatches {0}; //against the replayed trace
+};
+
+static std::vector<cl_uint> parse_list(const std::string& list)
+{
+	std::vector<cl_uint> values;
+	std::istringstream stream{list};
+	std::string value;
+	while (std::getline(stream, value, ',')) {
+		values.push_back(std::stoul(value));
+	}
+	return values;
+}
+
+static std::vector<FieldStorage> parse_storages(const std::string& list)
+{
+	std::vector<FieldStorage> storages;
+	std::istringstream stream{list};
+	std::string storage;
+	while (std::getline(stream, storage, ',')) {
+		storages.push_back(parse_field_storage(storage));
+	}
+	std::sort(storages.begin(), storages.end());
+	storages.erase(std::unique(storages.begin(), storages.end()), storages.end());
+	return storages;
+}
+
+static const char* storage_name(FieldStorage storage)
+{
+	switch (storage) {
+		case FieldStorage::HALF:
+			return "half";
+		case FieldStorage::BFLOAT16:
+			return "bfloat16";
+		default:
+			return "float";
+	}
+}
+
+//The RMS of the difference, the fields are compared over all cells
+static double rms_error(const ScalarField& field, const ScalarField& reference)
+{
+	double sum = 0.0;
+	for (size_t i = 0; i < field.size(); ++i) {
+		const double difference = field[i] - reference[i];
+		sum += difference * difference;
+	}
+	return std::sqrt(sum / field.size());
+}
+
+//Sizes are either N for square grids or WxH
+static std::vector<std::pair<cl_uint, cl_uint>> parse_sizes(const std::string& list)
+{
+	std::vector<std::pair<cl_uint, cl_uint>> sizes;
+	std::istringstream stream{list};
+	std::string size;
+	while (std::getline(stream, size, ',')) {
+		const auto separator = size.find('x');
+		if (separator == std::string::npos) {
+			const cl_uint width = std::stoul(size);
+			sizes.emplace_back(width, width);
+		} else {
+			sizes.emplace_back(std::stoul(size.substr(0, separator)), std::stoul(size.substr(separator + 1)));
+		}
+	}
+	return sizes;
+}
+
+static void print_usage(const char* name)
+{
+	std::cerr << "Usage: " << name << " [--sizes N|WxH,...] [--iterations N,...] [--workgroup-sizes N,...] [--steps N]\n"
+		  << "\t[--warmup N] [--profile-steps N] [--pressure-solver jacobi|sor|blocked|multigrid|cg] [--gpu]\n"
+		  << "\t[--backend opencl|native] [--threads N] [--storage float|half|bfloat16,...] [--record FILE] [--record-interval N]\n"
+		  << "\t[--replay FILE]\n"
+		  << "A replayed trace replaces the scenario, the sizes, the storage and the solver settings,"
+		  << " its checksums are verified in every run\n"
+		  << "The runs with 16-bit storage report the RMS error of the dye against the float run,"
+		  << " which is only made if float is listed" << std::endl;
+}
+
+static bool parse_arguments(int argc, char** argv, BenchConfig& config)
+{
+	for (int i = 1; i < argc; ++i) {
+		const std::string argument {argv[i]};
+		if (argument == "--gpu") {
+			config.device_type = CL_DEVICE_TYPE_GPU;
+			continue;
+		}
+		if (i + 1 == argc) {
+			return false;
+		}
+
+		const std::string value {argv[++i]};
+		if (argument == "--sizes") {
+			config.sizes = parse_sizes(value);
+		} else if (argument == "--iterations") {
+			config.solver_iterations = parse_list(value);
+		} else if (argument == "--workgroup-sizes") {
+			config.workgroup_sizes = parse_list(value);
+		} else if (argument == "--steps") {
+			config.steps = std::stoul(value);
+		} else if (argument == "--warmup") {
+			config.warmup_steps = std::stoul(value);
+		} else if (argument == "--profile-steps") {
+			config.profile_steps = std::stoul(value);
+		} else if (argument == "--pressure-solver") {
+			config.pressure_solver = parse_pressure_solver(value);
+		} else if (argument == "--backend") {
+			config.backend = parse_backend(value);
+		} else if (argument == "--threads") {
+			config.threads = std::stoul(value);
+		} else if (argument == "--storage") {
+			config.storages = parse_storages(value);
+		} else if (argument == "--record") {
+			config.recording_path = value;
+		} else if (argument == "--record-interval") {
+			config.recording_interval = std::stoul(value);
+		} else if (argument == "--replay") {
+			config.replay = std::make_shared<EventTrace>(value);
+		} else {
+			return false;
+		}
+	}
+	// The remaining solver settings of the trace are applied to the simulation of each run
+	if (config.replay) {
+		const auto& settings = config.replay->settings();
+		const auto parameters = settings_parameters(settings);
+		config.sizes = {{parameters.cells_x - 2, parameters.cells_y - 2}};
+		config.storages = {parameters.storage};
+		config.solver_iterations = {static_cast<cl_uint>(std::stoul(settings.at("solver_iterations")))};
+		config.fused_variants = {settings.at("fused_kernels") != "0"};
+	}
+	// The native backend only stores floats and runs the Jacobi solver
+	const bool float_storage_only = config.storages == std::vector<FieldStorage>{FieldStorage::FLOAT};
+	const bool opencl_only_options = not float_storage_only or config.pressure_solver != PressureSolver::JACOBI
+					 or not config.recording_path.empty() or config.replay;
+	return config.steps != 0 and config.recording_interval != 0 and (config.backend == Backend::OPENCL or not opencl_only_options);
+}
+
+//Scripted input standing in for the UI: a force stirring along a circle, with dye dropped where it's applied
+static void push_scenario_events(Channel<Event>& events, cl_uint cells_x, cl_uint cells_y, unsigned long step)
+{
+	const double angle = step * 0.05;
+	const double radius = std::min(cells_x, cells_y) * 0.25;
+	const Point point {static_cast<cl_int>(cells_x / 2 + radius * std::cos(angle)),
+			   static_cast<cl_int>(cells_y / 2 + radius * std::sin(angle))};
+
+	Event force;
+	force.type = Event::Type::APPLY_FORCE;
+	force.point = point;
+	force.value.as_vector = Vector{static_cast<Scalar>(-5 * std::sin(angle)), static_cast<Scalar>(5 * std::cos(angle))};
+	events.push_or_drop(force);
+
+	Event dye;
+	dye.type = Event::Type::ADD_DYE;
+	dye.point = point;
+	dye.value.as_scalar = Scalar{1};
+	events.push_or_drop(dye);
+}
+
+//Runs the scenario on a configured simulation, finish waits for the simulation's queued work
+template<typename SimulationType, typename Finish>
+static BenchResult measure(const BenchConfig& config, SimulationType& simulation, Channel<Event>& events,
+			   const SimulationParameters& parameters, Finish finish)
+{
+	unsigned long step = 0;
+	const auto update = [&] {
+		if (not config.replay) {
+			push_scenario_events(events, parameters.cells_x, parameters.cells_y, step++);
+		}
+		simulation.update();
+	};
+
+	for (unsigned long i = 0; i < config.warmup_steps; ++i) {
+		update();
+	}
+	finish();
+
+	BenchResult result;
+	const auto start = std::chrono::steady_clock::now();
+	for (unsigned long i = 0; i < config.steps; ++i) {
+		update();
+	}
+	finish();
+	result.seconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+
+	// Phase timing synchronizes after every phase, so it's measured separately from the throughput
+	simulation.set_phase_timing(true);
+	for (unsigned long i = 0; i < config.profile_steps; ++i) {
+		update();
+		const auto& stats = simulation.frame_stats();
+		for (size_t phase = 0; phase < phase_count; ++phase) {
+			result.profile.phase_seconds[phase] += stats.phase_seconds[phase] / config.profile_steps;
+		}
+		result.profile.kernel_launches = stats.kernel_launches;
+		result.profile.pressure_iterations = stats.pressure_iterations;
+		result.profile.diffusion_iterations = stats.diffusion_iterations;
+	}
+	simulation.read_dye(result.dye);
+	return result;
+}
+
+static BenchResult run(const BenchConfig& config, cl::CommandQueue& cmd_queue, const cl::Context& context, const cl::Program& program,
+		       const SimulationParameters& parameters, cl_uint solver_iterations, cl_uint workgroup_size, bool fused_kernels)
+{
+	auto frames = Mailbox<PixelField>::make();
+	auto events = Channel<Event>::make();
+	Simulation simulation{cmd_queue, context, parameters, program, frames, events, workgroup_size};
+	simulation.set_pressure_solver(config.pressure_solver);
+	simulation.set_solver_iterations(solver_iterations);
+	simulation.set_fused_kernels(fused_kernels);
+	simulation.set_fold_boundary_conditions(fused_kernels);
+	if (not config.recording_path.empty()) {
+		std::unique_ptr<FieldRecorder> recorder{new FieldRecorder{config.recording_path, parameters.cells_x, parameters.cells_y,
+									 parameters.storage, Simulation::recorded_fields(),
+									 RecordingCodec::DELTA, Simulation::recording_slot_count}};
+		simulation.set_recorder(std::move(recorder), config.recording_interval);
+	}
+	if (config.replay) {
+		simulation.apply_trace_settings(config.replay->settings());
+		simulation.set_replay(config.replay);
+	}
+
+	auto result = measure(config, simulation, *events, parameters, [&] { cmd_queue.finish(); });
+	result.checksum_mismatches = simulation.checksum_mismatches();
+	return result;
+}
+
+//The native backend always runs the fused pipeline and has no work-groups
+static BenchResult run_native(const BenchConfig& config, const SimulationParameters& parameters, cl_uint solver_iterations)
+{
+	auto frames = Mailbox<PixelField>::make();
+	auto events = Channel<Event>::make();
+	NativeSimulation simulation{parameters, frames, events, config.threads};
+	simulation.set_pressure_solver(config.pressure_solver);
+	simulation.set_solver_iterations(solver_iterations);
+
+	return measure(config, simulation, *events, parameters, [] {});
+}
+
+static std::string json_string(const std::string& value)
+{
+	std::string escaped {"\""};
+	for (char character : value) {
+		if (character == '"' or character == '\\') {
+			escaped += '\\';
+		}
+		if (static_cast<unsigned char>(character) >= 0x20) {
+			escaped += character;
+		}
+	}
+	return escaped + "\"";
+}
+
+int main(int argc, char** argv)
+{
+	BenchConfig config;
+	try {
+		if (not parse_arguments(argc, argv, config)) {
+			print_usage(argv[0]);
+			return 1;
+		}
+	} catch (const std::exception& error) {
+		std::cerr << error.what() << std::endl;
+		print_usage(argv[0]);
+		return 1;
+	}
+
+	// The OpenCL platform is only set up for the OpenCL backend, so that the native one runs without a driver
+	const bool native = config.backend == Backend::NATIVE;
+	std::vector<cl::Platform> platforms;
+	std::vector<cl::Device> devices;
+	cl::Context context;
+	cl::CommandQueue cmd_queue;
+	std::unique_ptr<ProgramCache> programs;
+	std::string device_name = "native";
+	if (not native) {
+		cl::Platform::get(&platforms);
+		platforms[0].getDevices(config.device_type, &devices);
+
+		context = cl::Context{devices};
+		cmd_queue = cl::CommandQueue{context, devices[0]};
+		programs.reset(new ProgramCache{context, devices, default_binary_cache_directory()});
+		device_name = devices[0].getInfo<CL_DEVICE_NAME>();
+	}
+
+	std::ostream& out = std::cout;
+	out << "{\n\t\"backend\": " << (native ? "\"native\"" : "\"opencl\"") << ",\n"
+	    << "\t\"device\": " << json_string(device_name) << ",\n"
+	    << "\t\"steps\": " << config.steps << ",\n"
+	    << "\t\"runs\": [";
+
+	// Work-group sizes and unfused kernels only apply to the OpenCL backend, the native runs report a work-group size of 0
+	const std::vector<cl_uint> workgroup_sizes = native ? std::vector<cl_uint>{0} : config.workgroup_sizes;
+	const std::vector<bool> fused_variants = native ? std::vector<bool>{true} : config.fused_variants;
+	bool first_run = true;
+	for (const auto& size : config.sizes) {
+		SimulationParameters parameters = config.replay ? settings_parameters(config.replay->settings()) : SimulationParameters{};
+		parameters.cells_x = size.first + 2;
+		parameters.cells_y = size.second + 2;
+
+		for (const cl_uint solver_iterations : config.solver_iterations) {
+			for (const cl_uint workgroup_size : workgroup_sizes) {
+				for (const bool fused_kernels : fused_variants) {
+					ScalarField reference_dye; //of the float run of this configuration
+					for (const FieldStorage storage : config.storages) {
+						parameters.storage = storage;
+						const auto result = native ? run_native(config, parameters, solver_iterations)
+									   : run(config, cmd_queue, context, programs->get(parameters.cells_x, parameters.cells_y, storage),
+										 parameters, solver_iterations, workgroup_size, fused_kernels);
+						const double steps_per_second = config.steps / result.seconds;
+						if (storage == FieldStorage::FLOAT) {
+							reference_dye = result.dye;
+						}
+
+						out << (first_run ? "\n" : ",\n")
+						    << "\t\t{\n"
+						    << "\t\t\t\"width\": " << size.first << ",\n"
+						    << "\t\t\t\"height\": " << size.second << ",\n"
+						    << "\t\t\t\"solver_iterations\": " << solver_iterations << ",\n"
+						    << "\t\t\t\"workgroup_size\": " << workgroup_size << ",\n"
+						    << "\t\t\t\"fused_kernels\": " << (fused_kernels ? "true" : "false") << ",\n"
+						    << "\t\t\t\"storage\": \"" << storage_name(storage) << "\",\n"
+						    << "\t\t\t\"record_interval\": " << (config.recording_path.empty() ? 0 : config.recording_interval) << ",\n";
+						if (storage != FieldStorage::FLOAT and not reference_dye.empty()) {
+							out << "\t\t\t\"dye_rms_error\": " << rms_error(result.dye, reference_dye) << ",\n";
+						}
+						if (config.replay) {
+							out << "\t\t\t\"checksum_mismatches\": " << result.checksum_mismatches << ",\n";
+						}
+						out << "\t\t\t\"seconds\": " << result.seconds << ",\n"
+						    << "\t\t\t\"steps_per_second\": " << steps_per_second << ",\n"
+						    << "\t\t\t\"cells_per_second\": " << steps_per_second * size.first * size.second << ",\n"
+						    << "\t\t\t\"kernel_launches_per_step\": " << result.profile.kernel_launches << ",\n"
+						    << "\t\t\t\"phase_seconds_per_step\": {";
+						for (size_t phase = 0; phase < phase_count; ++phase) {
+							out << (phase == 0 ? "" : ", ") << json_string(phase_name(static_cast<Phase>(phase)))
+							    << ": " << result.profile.phase_seconds[phase];
+						}
+						out << "}\n\t\t}";
+						first_run = false;
+					}
+				}
+			}
+		}
+	}
+	out << "\n\t]\n}" << std::endl;
+	return 0;
+}
@@ -20,71 +20,167 @@
 #ifndef CHANNEL_H
 #define CHANNEL_H
 
-#include <memory>
-#include <mutex>
+#include <algorithm>
+#include <array>
+#include <atomic>
 #include <deque>
+#include <memory>
 
-template<typename T>
+constexpr size_t cache_line_size = 64;
+
+//Bounded single-producer/single-consumer ring, push and pop are wait-free. The producer only writes tail and
+//the consumer only writes head, they are kept on separate cache lines.
+template<typename T, size_t Capacity = 1024>
 class Channel
 {
-	std::mutex mutex;
-	std::deque<T> items;
+	static_assert(Capacity != 0 and (Capacity & (Capacity - 1)) == 0, "Channel capacity has to be a power of 2");
+
+	std::atomic<size_t> head {0}; //index of the next item to pop
+	char head_padding[cache_line_size - sizeof(std::atomic<size_t>)];
+	std::atomic<size_t> tail {0}; //index of the next free slot
+	std::atomic<size_t> dropped_count {0};
+	char tail_padding[cache_line_size - 2 * sizeof(std::atomic<size_t>)];
+	std::array<T, Capacity> slots;
+
+	T& slot(size_t index)
+	{
+		return slots[index & (Capacity - 1)];
+	}
 public:
 	static std::shared_ptr<Channel> make()
 	{
 		return std::make_shared<Channel>();
 	}
 
+	//Fails if the channel is full, the item is left untouched so that the producer can retry
 	bool try_push(T& item)
 	{
-		std::unique_lock<std::mutex> guard{mutex, std::try_to_lock_t{}};
-		if (not guard.owns_lock()) {
+		const size_t current_tail = tail.load(std::memory_order_relaxed);
+		if (current_tail - head.load(std::memory_order_acquire) == Capacity) {
 			return false;
 		}
-		items.emplace_back(std::move(item));
+		slot(current_tail) = std::move(item);
+		tail.store(current_tail + 1, std::memory_order_release);
 		return true;
 	}
 
+	//For producers which don't retry, the item is discarded and counted as dropped if the channel is full
+	void push_or_drop(T item)
+	{
+		if (not try_push(item)) {
+			dropped_count.fetch_add(1, std::memory_order_relaxed);
+		}
+	}
+
 	bool try_pop(T& item)
 	{
-		std::unique_lock<std::mutex> guard{mutex, std::try_to_lock_t{}};
-		if (not guard.owns_lock()) {
+		const size_t current_head = head.load(std::memory_order_relaxed);
+		if (current_head == tail.load(std::memory_order_acquire)) {
 			return false;
 		}
-		if (not items.empty()) {
-			item = std::move(items.front());
-			items.pop_front();
-			return true;
-		} else {
-			return false;
+		item = std::move(slot(current_head));
+		head.store(current_head + 1, std::memory_order_release);
+		return true;
+	}
+
+	//Pushes items from the front of the deque until the channel is full, pushed items are removed from it.
+	//Returns whether all of them were pushed.
+	bool try_push_all(std::deque<T>& items)
+	{
+		const size_t current_tail = tail.load(std::memory_order_relaxed);
+		const size_t free_slots = Capacity - (current_tail - head.load(std::memory_order_acquire));
+		const size_t count = std::min(free_slots, items.size());
+		for (size_t i = 0; i < count; ++i) {
+			slot(current_tail + i) = std::move(items[i]);
 		}
+		tail.store(current_tail + count, std::memory_order_release);
+		items.erase(items.begin(), items.begin() + count);
+		return items.empty();
 	}
 
-	std::deque<T> try_pop_all()
+	//Appends all available items to the container, returns their count
+	template<typename Container>
+	size_t pop_all(Container& items)
 	{
-		std::unique_lock<std::mutex> guard{mutex, std::try_to_lock_t{}};
-		std::deque<T> ret;
-		if (guard.owns_lock()) {
-			ret = std::move(items);
+		const size_t current_head = head.load(std::memory_order_relaxed);
+		const size_t count = tail.load(std::memory_order_acquire) - current_head;
+		for (size_t i = 0; i < count; ++i) {
+			items.push_back(std::move(slot(current_head + i)));
 		}
-		return ret;
+		head.store(current_head + count, std::memory_order_release);
+		return count;
 	}
 
-	bool try_push_all(std::deque<T>& items)
+	//Number of items discarded by push_or_drop because the channel was full, each counted once
+	size_t dropped() const
 	{
-		std::unique_lock<std::mutex> guard{mutex, std::try_to_lock_t{}};
-		if (guard.owns_lock()) {
-			std::move(items.begin(), items.end(), std::back_inserter(this->items));
-			items.clear();
-			return true;
-		} else {
+		return dropped_count.load(std::memory_order_relaxed);
+	}
+};
+
+template<typename T>
+using Channel_ptr = std::shared_ptr<Channel<T>>;
+
+//Latest-value mailbox for a single producer and a single consumer, implemented as a triple buffer.
+//The producer fills its back buffer and publishes it, the consumer acquires the most recently published
+//buffer as its front buffer. A published value the consumer didn't acquire yet is overwritten by the next one.
+template<typename T>
+class Mailbox
+{
+	static constexpr unsigned index_mask = 3;
+	static constexpr unsigned fresh_bit = 4; //set while the middle buffer holds a value the consumer didn't acquire
+
+	std::array<T, 3> buffers;
+	std::atomic<unsigned> middle {1};
+	std::atomic<size_t> overwritten_count {0};
+	char middle_padding[cache_line_size - sizeof(std::atomic<unsigned>) - sizeof(std::atomic<size_t>)];
+	unsigned back {0}; //owned by the producer
+	char back_padding[cache_line_size - sizeof(unsigned)];
+	unsigned front {2}; //owned by the consumer
+public:
+	static std::shared_ptr<Mailbox> make()
+	{
+		return std::make_shared<Mailbox>();
+	}
+
+	T& back_buffer()
+	{
+		return buffers[back];
+	}
+
+	//Hands the back buffer over to the consumer, the producer gets a new back buffer in exchange
+	void publish()
+	{
+		const unsigned previous = middle.exchange(back | fresh_bit, std::memory_order_acq_rel);
+		if (previous & fresh_bit) {
+			overwritten_count.fetch_add(1, std::memory_order_relaxed);
+		}
+		back = previous & index_mask;
+	}
+
+	//Returns false if nothing was published since the last call, the front buffer is left unchanged then
+	bool acquire_latest()
+	{
+		if (not (middle.load(std::memory_order_relaxed) & fresh_bit)) {
 			return false;
 		}
+		front = middle.exchange(front, std::memory_order_acq_rel) & index_mask;
+		return true;
+	}
 
+	T& front_buffer()
+	{
+		return buffers[front];
+	}
+
+	//Number of published values which were replaced before the consumer acquired them
+	size_t overwritten() const
+	{
+		return overwritten_count.load(std::memory_order_relaxed);
 	}
 };
 
 template<typename T>
-using Channel_ptr = std::shared_ptr<Channel<T>>;
+using Mailbox_ptr = std::shared_ptr<Mailbox<T>>;
 
 #endif //CHANNEL_H
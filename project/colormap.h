@@ -0,0 +1,68 @@
+/**
+ * FluidSim - a free and open-source interactive fluid flow simulator
+ * Copyright (C) 2015  Damian Jarek <damian.jarek93@gmail.com>
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License along
+ * with this program; if not, write to the Free Software Foundation, Inc.,
+ * 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+ */
+
+#ifndef COLORMAP_H
+#define COLORMAP_H
+
+#include <algorithm>
+#include <array>
+#include <cstdint>
+
+//Colormaps are lookup tables of packed ARGB8888 pixels, spread evenly over the displayed range of values.
+//They are applied on the device by the visualization kernels.
+constexpr size_t colormap_size = 256;
+using Colormap = std::array<uint32_t, colormap_size>;
+
+enum class ColormapType {
+	RED_GREEN, //negative values in green, positive ones in red
+	GRAYSCALE,
+	HEAT
+};
+
+inline uint32_t pack_argb(float red, float green, float blue)
+{
+	const auto component = [](float value) {
+		return static_cast<uint32_t>(std::min(std::max(value, 0.0f), 1.0f) * 255.0f);
+	};
+	return 0xFF000000 | component(red) << 16 | component(green) << 8 | component(blue);
+}
+
+inline Colormap make_colormap(ColormapType type)
+{
+	Colormap colormap;
+	for (size_t i = 0; i < colormap_size; ++i) {
+		const float t = 1.0f * i / (colormap_size - 1);
+		switch (type) {
+			case ColormapType::RED_GREEN: {
+				const float value = 2 * t - 1;
+				colormap[i] = value < 0 ? pack_argb(0, -value, 0) : pack_argb(value, 0, 0);
+				break;
+			}
+			case ColormapType::GRAYSCALE:
+				colormap[i] = pack_argb(t, t, t);
+				break;
+			case ColormapType::HEAT:
+				colormap[i] = pack_argb(3 * t, 3 * t - 1, 3 * t - 2);
+				break;
+		}
+	}
+	return colormap;
+}
+
+#endif //COLORMAP_H
@@ -0,0 +1,365 @@
+/**
+ * FluidSim - a free and open-source interactive fluid flow simulator
+ * Copyright (C) 2015  Damian Jarek <damian.jarek93@gmail.com>
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License along
+ * with this program; if not, write to the Free Software Foundation, Inc.,
+ * 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+ */
+
+#include "config.h"
+#include <fstream>
+#include <ostream>
+#include <stdexcept>
+
+static cl_uint parse_uint(const std::string& key, const std::string& value)
+{
+	size_t parsed = 0;
+	const auto result = std::stoul(value, &parsed);
+	if (parsed != value.size()) {
+		throw std::invalid_argument{"invalid value of " + key + ": " + value};
+	}
+	return result;
+}
+
+static Scalar parse_scalar(const std::string& key, const std::string& value)
+{
+	size_t parsed = 0;
+	const auto result = std::stof(value, &parsed);
+	if (parsed != value.size()) {
+		throw std::invalid_argument{"invalid value of " + key + ": " + value};
+	}
+	return result;
+}
+
+static bool parse_bool(const std::string& key, const std::string& value)
+{
+	if (value == "true" or value == "on" or value == "1") {
+		return true;
+	} else if (value == "false" or value == "off" or value == "0") {
+		return false;
+	}
+	throw std::invalid_argument{"invalid value of " + key + ": " + value};
+}
+
+//The size is given in inner cells, the boundary is added to it
+static cl_uint parse_grid_size(const std::string& key, const std::string& value)
+{
+	const auto inner_cells = parse_uint(key, value);
+	if (inner_cells < 4) {
+		throw std::invalid_argument{key + " has to be at least 4"};
+	}
+	return inner_cells + 2;
+}
+
+static std::string trim(const std::string& text)
+{
+	const auto begin = text.find_first_not_of(" \t\r");
+	if (begin == std::string::npos) {
+		return {};
+	}
+	return text.substr(begin, text.find_last_not_of(" \t\r") - begin + 1);
+}
+
+PressureSolver parse_pressure_solver(const std::string& name)
+{
+	if (name == "jacobi") {
+		return PressureSolver::JACOBI;
+	} else if (name == "sor") {
+		return PressureSolver::RED_BLACK_SOR;
+	} else if (name == "blocked") {
+		return PressureSolver::TEMPORALLY_BLOCKED_JACOBI;
+	} else if (name == "multigrid") {
+		return PressureSolver::MULTIGRID;
+	} else if (name == "cg") {
+		return PressureSolver::CONJUGATE_GRADIENT;
+	}
+	throw std::invalid_argument{"unknown pressure solver: " + name};
+}
+
+DiffusionSolver parse_diffusion_solver(const std::string& name)
+{
+	if (name == "jacobi") {
+		return DiffusionSolver::JACOBI;
+	} else if (name == "sor") {
+		return DiffusionSolver::RED_BLACK_SOR;
+	} else if (name == "blocked") {
+		return DiffusionSolver::TEMPORALLY_BLOCKED_JACOBI;
+	}
+	throw std::invalid_argument{"unknown diffusion solver: " + name};
+}
+
+Backend parse_backend(const std::string& name)
+{
+	if (name == "opencl") {
+		return Backend::OPENCL;
+	} else if (name == "native") {
+		return Backend::NATIVE;
+	}
+	throw std::invalid_argument{"unknown backend: " + name};
+}
+
+FieldStorage parse_field_storage(const std::string& name)
+{
+	if (name == "float") {
+		return FieldStorage::FLOAT;
+	} else if (name == "half") {
+		return FieldStorage::HALF;
+	} else if (name == "bfloat16") {
+		return FieldStorage::BFLOAT16;
+	}
+	throw std::invalid_argument{"unknown field storage: " + name};
+}
+
+RecordingCodec parse_recording_codec(const std::string& name)
+{
+	if (name == "raw") {
+		return RecordingCodec::RAW;
+	} else if (name == "delta") {
+		return RecordingCodec::DELTA;
+	}
+	throw std::invalid_argument{"unknown recording codec: " + name};
+}
+
+void set_option(Config& config, std::string key, const std::string& value)
+{
+	for (auto& character : key) {
+		if (character == '-') {
+			character = '_';
+		}
+	}
+
+	config.given_keys.insert(key);
+	auto& simulation = config.simulation;
+	if (key == "width") {
+		simulation.cells_x = parse_grid_size(key, value);
+	} else if (key == "height") {
+		simulation.cells_y = parse_grid_size(key, value);
+	} else if (key == "time_step") {
+		simulation.time_step = parse_scalar(key, value);
+	} else if (key == "dx") {
+		simulation.dx = parse_scalar(key, value);
+	} else if (key == "viscosity") {
+		simulation.viscosity = parse_scalar(key, value);
+	} else if (key == "velocity_dissipation") {
+		simulation.velocity_dissipation = parse_scalar(key, value);
+	} else if (key == "dye_dissipation") {
+		simulation.dye_dissipation = parse_scalar(key, value);
+	} else if (key == "vorticity_scale") {
+		simulation.vorticity_scale = parse_scalar(key, value);
+	} else if (key == "storage") {
+		simulation.storage = parse_field_storage(value);
+	} else if (key == "pressure_solver") {
+		config.pressure_solver = parse_pressure_solver(value);
+	} else if (key == "diffusion_solver") {
+		config.diffusion_solver = parse_diffusion_solver(value);
+	} else if (key == "solver_iterations") {
+		config.solver_iterations = parse_uint(key, value);
+	} else if (key == "sor_relaxation_factor") {
+		config.sor_relaxation_factor = parse_scalar(key, value);
+	} else if (key == "residual_tolerance") {
+		config.residual_tolerance = parse_scalar(key, value);
+	} else if (key == "residual_check_interval") {
+		config.residual_check_interval = parse_uint(key, value);
+	} else if (key == "fused_kernels") {
+		config.fused_kernels = parse_bool(key, value);
+	} else if (key == "fold_boundary_conditions") {
+		config.fold_boundary_conditions = parse_bool(key, value);
+	} else if (key == "workgroup_size") {
+		config.workgroup_size = parse_uint(key, value);
+	} else if (key == "backend") {
+		config.backend = parse_backend(value);
+	} else if (key == "threads") {
+		config.threads = parse_uint(key, value);
+	} else if (key == "device") {
+		if (value == "cpu") {
+			config.device_type = CL_DEVICE_TYPE_CPU;
+		} else if (value == "gpu") {
+			config.device_type = CL_DEVICE_TYPE_GPU;
+		} else {
+			throw std::invalid_argument{"unknown device type: " + value};
+		}
+	} else if (key == "slabs") {
+		config.slabs = parse_uint(key, value);
+		if (config.slabs == 0) {
+			throw std::invalid_argument{"slabs has to be at least 1"};
+		}
+	} else if (key == "halo_rows") {
+		config.halo_rows = parse_uint(key, value);
+	} else if (key == "halo_overlap") {
+		config.halo_overlap = parse_bool(key, value);
+	} else if (key == "partition") {
+		if (value == "equally") {
+			config.partition = DevicePartition::EQUALLY;
+		} else if (value == "numa") {
+			config.partition = DevicePartition::NUMA;
+		} else {
+			throw std::invalid_argument{"unknown device partition: " + value};
+		}
+	} else if (key == "headless") {
+		config.headless_steps = parse_uint(key, value);
+	} else if (key == "profile") {
+		config.profile_prefix = value;
+	} else if (key == "checkpoint") {
+		config.checkpoint_path = value;
+	} else if (key == "checkpoint_interval") {
+		config.checkpoint_interval = parse_uint(key, value);
+	} else if (key == "restart") {
+		config.restart_path = value;
+	} else if (key == "record") {
+		config.recording_path = value;
+	} else if (key == "record_interval") {
+		config.recording_interval = parse_uint(key, value);
+		if (config.recording_interval == 0) {
+			throw std::invalid_argument{"record_interval has to be at least 1"};
+		}
+	} else if (key == "record_codec") {
+		config.recording_codec = parse_recording_codec(value);
+	} else if (key == "record_events") {
+		config.event_trace_path = value;
+	} else if (key == "checksum_interval") {
+		config.checksum_interval = parse_uint(key, value);
+	} else if (key == "replay") {
+		config.replay_path = value;
+	} else if (key == "program_cache") {
+		config.binary_cache_directory = value == "none" ? std::string{} : value;
+	} else {
+		throw std::invalid_argument{"unknown option: " + key};
+	}
+}
+
+void load_config_file(Config& config, const std::string& path)
+{
+	std::ifstream file{path};
+	if (not file) {
+		throw std::invalid_argument{"can't open config file: " + path};
+	}
+
+	std::string line;
+	for (int line_number = 1; std::getline(file, line); ++line_number) {
+		line = trim(line.substr(0, line.find('#')));
+		if (line.empty()) {
+			continue;
+		}
+
+		const auto separator = line.find('=');
+		if (separator == std::string::npos) {
+			throw std::invalid_argument{path + ":" + std::to_string(line_number) + ": expected key = value"};
+		}
+		set_option(config, trim(line.substr(0, separator)), trim(line.substr(separator + 1)));
+	}
+}
+
+void parse_command_line(Config& config, int argc, char** argv)
+{
+	for (int i = 1; i < argc; i += 2) {
+		const std::string argument {argv[i]};
+		if (argument.compare(0, 2, "--") != 0 or i + 1 == argc) {
+			throw std::invalid_argument{"expected --key value, got: " + argument};
+		}
+
+		const auto key = argument.substr(2);
+		if (key == "config") {
+			load_config_file(config, argv[i + 1]);
+		} else {
+			set_option(config, key, argv[i + 1]);
+		}
+	}
+}
+
+void print_config_usage(std::ostream& out, const char* name)
+{
+	out << "Usage: " << name << " [--config FILE] [--key value]...\n"
+	    << "Keys (also accepted in the config file as key = value):\n"
+	    << "\twidth, height             inner cells of the grid\n"
+	    << "\ttime_step, dx, viscosity, velocity_dissipation, dye_dissipation, vorticity_scale\n"
+	    << "\tstorage                   float|half|bfloat16, format of the fields in device memory\n"
+	    << "\tpressure_solver           jacobi|sor|blocked|multigrid|cg\n"
+	    << "\tdiffusion_solver          jacobi|sor|blocked\n"
+	    << "\tsolver_iterations, sor_relaxation_factor, residual_tolerance, residual_check_interval\n"
+	    << "\tfused_kernels, fold_boundary_conditions   true|false\n"
+	    << "\tworkgroup_size, device    cpu|gpu\n"
+	    << "\tbackend                   opencl|native, native runs on the host\n"
+	    << "\tthreads                   of the native backend, 0 uses all hardware threads\n"
+	    << "\tslabs, halo_rows          splits the grid between devices\n"
+	    << "\t                          native and slabs run the jacobi solvers, without residual checks or folding\n"
+	    << "\thalo_overlap              true|false, copies the halo while the inner rows are computed, which\n"
+	    << "\t                          OpenCL doesn't define, so it may give wrong results on some drivers\n"
+	    << "\tpartition                 equally|numa, splits the first device if there are too few\n"
+	    << "\theadless STEPS            runs the updates without the UI\n"
+	    << "\tprofile OUTPUT_PREFIX     profiles the commands, the P key dumps the profile\n"
+	    << "\tcheckpoint FILE           saves a snapshot when the simulation ends\n"
+	    << "\tcheckpoint_interval N     and every N updates in the background, 0 disables the periodic ones\n"
+	    << "\trestart FILE              continues from a snapshot, with its grid and physical parameters\n"
+	    << "\trecord FILE               records the velocity, pressure and dye for offline analysis\n"
+	    << "\trecord_interval N         every N updates\n"
+	    << "\trecord_codec              raw|delta, delta compresses the frames\n"
+	    << "\trecord_events FILE        records the events of every update into a trace\n"
+	    << "\tchecksum_interval N       with checksums of the fields every N updates, 0 disables them\n"
+	    << "\treplay FILE               replays a trace with its settings, without the UI, and verifies its checksums\n"
+	    << "\tprogram_cache DIR|none    directory of the compiled program cache" << std::endl;
+}
+
+void adapt_to_backend(Config& config)
+{
+	if (config.backend != Backend::NATIVE and config.slabs <= 1) {
+		return;
+	}
+	const std::string backend = config.backend == Backend::NATIVE ? "the native backend" : "slabs";
+	if (config.given_keys.count("pressure_solver") == 0) {
+		config.pressure_solver = PressureSolver::JACOBI;
+	}
+	if (config.given_keys.count("residual_tolerance") == 0) {
+		config.residual_tolerance = 0;
+	}
+	if (config.given_keys.count("fold_boundary_conditions") == 0) {
+		config.fold_boundary_conditions = false;
+	}
+
+	if (config.pressure_solver != PressureSolver::JACOBI or config.diffusion_solver != DiffusionSolver::JACOBI) {
+		throw std::invalid_argument{backend + " only runs the jacobi solvers"};
+	}
+	// The relaxation factor and the check interval have no effect without SOR and residual checks
+	if (config.residual_tolerance != 0) {
+		throw std::invalid_argument{backend + " doesn't check the residual, residual_tolerance has to be 0"};
+	}
+	if (config.fold_boundary_conditions) {
+		throw std::invalid_argument{backend + " doesn't fold the boundary conditions"};
+	}
+}
+
+void configure_simulation(const Config& config, Simulation& simulation)
+{
+	simulation.set_pressure_solver(config.pressure_solver);
+	simulation.set_diffusion_solver(config.diffusion_solver);
+	simulation.set_solver_iterations(config.solver_iterations);
+	simulation.set_sor_relaxation_factor(config.sor_relaxation_factor);
+	simulation.set_residual_tolerance(config.residual_tolerance, config.residual_check_interval);
+	simulation.set_fused_kernels(config.fused_kernels);
+	simulation.set_fold_boundary_conditions(config.fold_boundary_conditions);
+}
+
+void configure_simulation(const Config& config, SlabbedSimulation& simulation)
+{
+	simulation.set_pressure_solver(config.pressure_solver);
+	simulation.set_diffusion_solver(config.diffusion_solver);
+	simulation.set_solver_iterations(config.solver_iterations);
+	simulation.set_fused_kernels(config.fused_kernels);
+}
+
+void configure_simulation(const Config& config, NativeSimulation& simulation)
+{
+	simulation.set_pressure_solver(config.pressure_solver);
+	simulation.set_diffusion_solver(config.diffusion_solver);
+	simulation.set_solver_iterations(config.solver_iterations);
+}
@@ -0,0 +1,103 @@
+/**
+ * FluidSim - a free and open-source interactive fluid flow simulator
+ * Copyright (C) 2015  Damian Jarek <damian.jarek93@gmail.com>
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License along
+ * with this program; if not, write to the Free Software Foundation, Inc.,
+ * 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+ */
+
+#ifndef CONFIG_H
+#define CONFIG_H
+
+#include "decomposition.h"
+#include "native_simulation.h"
+#include "program.h"
+#include "simulation.h"
+
+#include <ostream>
+#include <set>
+#include <string>
+
+//Backend computing the simulation
+enum class Backend {
+	OPENCL,
+	NATIVE //multithreaded C++ on the host, see NativeSimulation
+};
+
+//Devices the slabs of a decomposed grid run on, when there are fewer devices than slabs
+enum class DevicePartition {
+	EQUALLY, //sub-devices with equal shares of the first device's compute units
+	NUMA //one sub-device per NUMA node of the first device
+};
+
+//Settings of a FluidSim run, read from a config file and the command line.
+//Both use the same keys: "key = value" lines in the file (# starts a comment) and "--key value" arguments,
+//where dashes in the key may stand for underscores.
+struct Config {
+	SimulationParameters simulation;
+	PressureSolver pressure_solver {PressureSolver::MULTIGRID};
+	DiffusionSolver diffusion_solver {DiffusionSolver::JACOBI};
+	cl_uint solver_iterations {100};
+	Scalar sor_relaxation_factor {1.5};
+	Scalar residual_tolerance {1e-4};
+	cl_uint residual_check_interval {10};
+	bool fused_kernels {true};
+	bool fold_boundary_conditions {true};
+	cl_uint workgroup_size {256};
+	Backend backend {Backend::OPENCL};
+	cl_uint threads {0}; //of the native backend, 0 uses all hardware threads
+	cl_device_type device_type {CL_DEVICE_TYPE_CPU};
+	cl_uint slabs {1}; //the grid is split into horizontal slabs, one per device, if more than 1
+	cl_uint halo_rows {4};
+	bool halo_overlap {false}; //see HaloExchange
+	DevicePartition partition {DevicePartition::EQUALLY};
+	unsigned long headless_steps {0}; //runs the UI if 0
+	std::string profile_prefix; //profiling is disabled if empty
+	std::string checkpoint_path; //checkpoints are disabled if empty
+	cl_uint checkpoint_interval {0};
+	std::string restart_path; //the simulation starts from scratch if empty
+	std::string recording_path; //the fields aren't recorded if empty
+	cl_uint recording_interval {1};
+	RecordingCodec recording_codec {RecordingCodec::DELTA};
+	std::string event_trace_path; //the events aren't recorded if empty
+	cl_uint checksum_interval {100};
+	std::string replay_path; //the events come from the UI if empty
+	std::string binary_cache_directory {default_binary_cache_directory()}; //the cache is disabled if empty
+	std::set<std::string> given_keys; //set by the file or the command line, the others keep their defaults
+};
+
+//All of the functions throw std::invalid_argument for unknown keys and malformed values
+void set_option(Config& config, std::string key, const std::string& value);
+void load_config_file(Config& config, const std::string& path);
+//Arguments are applied in order, "--config FILE" loads the file at its position
+void parse_command_line(Config& config, int argc, char** argv);
+void print_config_usage(std::ostream& out, const char* name);
+//Slabs and the native backend only run the Jacobi solvers, without residual checks or folded boundary conditions.
+//Their defaults are switched to these, other values given for them throw std::invalid_argument.
+void adapt_to_backend(Config& config);
+
+PressureSolver parse_pressure_solver(const std::string& name);
+Backend parse_backend(const std::string& name);
+FieldStorage parse_field_storage(const std::string& name);
+RecordingCodec parse_recording_codec(const std::string& name);
+DiffusionSolver parse_diffusion_solver(const std::string& name);
+
+//Applies the solver settings, which can be changed between updates
+void configure_simulation(const Config& config, Simulation& simulation);
+//Slabbed simulations need a config adapted to them by adapt_to_backend
+void configure_simulation(const Config& config, SlabbedSimulation& simulation);
+//The native backend needs a config adapted to it by adapt_to_backend
+void configure_simulation(const Config& config, NativeSimulation& simulation);
+
+#endif //CONFIG_H
@@ -0,0 +1,364 @@
+/**
+ * FluidSim - a free and open-source interactive fluid flow simulator
+ * Copyright (C) 2015  Damian Jarek <damian.jarek93@gmail.com>
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License along
+ * with this program; if not, write to the Free Software Foundation, Inc.,
+ * 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+ */
+
+#include "decomposition.h"
+#include <algorithm>
+#include <stdexcept>
+#include <string>
+
+Barrier::Barrier(size_t thread_count):
+	thread_count(thread_count)
+{
+}
+
+void Barrier::wait()
+{
+	std::unique_lock<std::mutex> lock{mutex};
+	if (broken) {
+		throw std::runtime_error{"Barrier broken by a failing thread"};
+	}
+
+	const auto current_generation = generation;
+	if (++waiting == thread_count) {
+		waiting = 0;
+		++generation;
+		condition.notify_all();
+		return;
+	}
+
+	condition.wait(lock, [&] { return generation != current_generation or broken; });
+	if (generation == current_generation) {
+		throw std::runtime_error{"Barrier broken by a failing thread"};
+	}
+}
+
+void Barrier::break_barrier()
+{
+	std::lock_guard<std::mutex> lock{mutex};
+	broken = true;
+	condition.notify_all();
+}
+
+std::vector<Slab> split_into_slabs(cl_uint cells_y, size_t slab_count, cl_uint halo_rows)
+{
+	const cl_uint inner_rows = cells_y - 2;
+	if (slab_count == 0 or inner_rows / slab_count < halo_rows) {
+		throw std::invalid_argument{"Can't split " + std::to_string(inner_rows) + " rows into " + std::to_string(slab_count)
+					    + " slabs of at least " + std::to_string(halo_rows) + " rows"};
+	}
+
+	// The first slabs take the remainder, one row each
+	std::vector<Slab> slabs;
+	cl_uint first_row = 1;
+	for (size_t i = 0; i < slab_count; ++i) {
+		Slab slab;
+		slab.first_row = first_row;
+		slab.row_count = inner_rows / slab_count + (i < inner_rows % slab_count ? 1 : 0);
+		slab.lower_pad = i == 0 ? 1 : halo_rows;
+		slab.upper_pad = i == slab_count - 1 ? 1 : halo_rows;
+		slabs.push_back(slab);
+		first_row += slab.row_count;
+	}
+	return slabs;
+}
+
+HaloExchange::HaloExchange(std::vector<Slab> slabs, cl_uint cells_x, cl_uint halo_rows, bool overlap,
+			   const std::vector<cl::CommandQueue>& cmd_queues):
+	slabs(std::move(slabs)),
+	cells_x(cells_x),
+	halo_rows(halo_rows),
+	overlap(overlap),
+	barrier(this->slabs.size()),
+	lower_edges(this->slabs.size()),
+	upper_edges(this->slabs.size()),
+	ready(this->slabs.size()),
+	copied_from_below(this->slabs.size()),
+	copied_from_above(this->slabs.size())
+{
+	// The edges are sized for the largest fields, the vector ones stored as floats
+	const auto context = cmd_queues.front().getInfo<CL_QUEUE_CONTEXT>();
+	const size_t edge_size = halo_rows * cells_x * 2 * sizeof(Scalar);
+	for (size_t i = 0; i < this->slabs.size(); ++i) {
+		if (i != 0) {
+			lower_edges[i] = cl::Buffer{context, CL_MEM_READ_WRITE, edge_size};
+		}
+		if (i != this->slabs.size() - 1) {
+			upper_edges[i] = cl::Buffer{context, CL_MEM_READ_WRITE, edge_size};
+		}
+	}
+	if (overlap) {
+		for (const auto& cmd_queue : cmd_queues) {
+			transfer_queues.emplace_back(context, cmd_queue.getInfo<CL_QUEUE_DEVICE>());
+		}
+	}
+}
+
+void HaloExchange::exchange(size_t slab, cl::CommandQueue& cmd_queue, const cl::Buffer& field, size_t element_size)
+{
+	begin_exchange(slab, cmd_queue, field, element_size);
+	finish_exchange(slab, cmd_queue);
+}
+
+void HaloExchange::begin_exchange(size_t slab, cl::CommandQueue& cmd_queue, const cl::Buffer& field, size_t element_size)
+{
+	// The neighbours' copies only wait for the edges to be staged on the device, not on the host
+	const size_t row_size = cells_x * element_size;
+	const size_t edge_size = halo_rows * row_size;
+	const auto& own = slabs[slab];
+	if (slab != 0) {
+		cmd_queue.enqueueCopyBuffer(field, lower_edges[slab], own.local_row(own.first_row) * row_size, 0, edge_size);
+	}
+	if (slab != slabs.size() - 1) {
+		const cl_uint first_row = own.first_row + own.row_count - halo_rows;
+		cmd_queue.enqueueCopyBuffer(field, upper_edges[slab], own.local_row(first_row) * row_size, 0, edge_size);
+	}
+	cmd_queue.enqueueMarkerWithWaitList(nullptr, &ready[slab]);
+	cmd_queue.flush();
+	barrier.wait();
+
+	auto& queue = overlap ? transfer_queues[slab] : cmd_queue;
+	if (slab != 0) {
+		fill_halo(slab, queue, field, slab - 1, upper_edges[slab - 1], own.first_row - halo_rows, element_size,
+			  copied_from_below[slab]);
+	}
+	if (slab != slabs.size() - 1) {
+		fill_halo(slab, queue, field, slab + 1, lower_edges[slab + 1], own.first_row + own.row_count, element_size,
+			  copied_from_above[slab]);
+	}
+	queue.flush();
+}
+
+void HaloExchange::finish_exchange(size_t slab, cl::CommandQueue& cmd_queue)
+{
+	// The neighbours' copy events only exist once they have all begun the exchange
+	cmd_queue.flush();
+	barrier.wait();
+
+	// The halo is read only after it's filled, and the edges are staged again only after the neighbours copied them
+	std::vector<cl::Event> copies;
+	if (slab != 0) {
+		copies.push_back(copied_from_below[slab]);
+		copies.push_back(copied_from_above[slab - 1]);
+	}
+	if (slab != slabs.size() - 1) {
+		copies.push_back(copied_from_above[slab]);
+		copies.push_back(copied_from_below[slab + 1]);
+	}
+	cmd_queue.enqueueBarrierWithWaitList(&copies);
+}
+
+bool HaloExchange::overlapped() const
+{
+	return overlap;
+}
+
+cl_uint HaloExchange::rows() const
+{
+	return halo_rows;
+}
+
+std::pair<cl_uint, cl_uint> HaloExchange::independent_rows(size_t slab) const
+{
+	// A wall row is the grid's boundary, it's never copied
+	const cl_uint cells_y = slabs[slab].cells_y();
+	const cl_uint first = slab == 0 ? 1 : halo_rows + 1;
+	const cl_uint last = slab == slabs.size() - 1 ? cells_y - 1 : cells_y - halo_rows - 1;
+	return {first, std::max(first, last)};
+}
+
+void HaloExchange::fill_halo(size_t slab, cl::CommandQueue& queue, const cl::Buffer& field, size_t from, const cl::Buffer& edge,
+			     cl_uint first_row, size_t element_size, cl::Event& copy)
+{
+	const size_t row_size = cells_x * element_size;
+	const std::vector<cl::Event> wait_list {ready[from]};
+	queue.enqueueCopyBuffer(edge, field, 0, slabs[slab].local_row(first_row) * row_size, halo_rows * row_size, &wait_list, &copy);
+}
+
+void HaloExchange::abort()
+{
+	barrier.break_barrier();
+}
+
+SlabbedSimulation::SlabbedSimulation(const cl::Context& context,
+				     const std::vector<cl::CommandQueue>& cmd_queues,
+				     const SimulationParameters& parameters,
+				     ProgramCache& programs,
+				     Mailbox_ptr<PixelField> to_ui,
+				     Channel_ptr<Event> events_from_ui,
+				     cl_uint workgroup_size,
+				     cl_uint halo_rows,
+				     bool halo_overlap):
+	parameters(parameters),
+	slabs(split_into_slabs(parameters.cells_y, cmd_queues.size(), halo_rows)),
+	step_start(cmd_queues.size() + 1),
+	step_end(cmd_queues.size() + 1),
+	to_ui(to_ui),
+	events_from_ui(events_from_ui),
+	frame(parameters.cells_x * parameters.cells_y)
+{
+	// The fused vorticity confinement reads the velocity two rows away
+	if (halo_rows < 2) {
+		throw std::invalid_argument{"The halo has to be at least 2 rows deep"};
+	}
+	halo_exchange = std::make_shared<HaloExchange>(slabs, parameters.cells_x, halo_rows, halo_overlap, cmd_queues);
+
+	for (size_t i = 0; i < slabs.size(); ++i) {
+		auto slab_parameters = parameters;
+		slab_parameters.cells_y = slabs[i].cells_y();
+		const auto& program = programs.get(slab_parameters.cells_x, slab_parameters.cells_y, slab_parameters.storage);
+
+		Worker worker;
+		worker.events = Channel<Event>::make();
+		worker.frames = Mailbox<PixelField>::make();
+		worker.simulation.reset(new Simulation{cmd_queues[i], context, slab_parameters, program, worker.frames, worker.events, workgroup_size});
+		worker.simulation->set_halo_exchange(halo_exchange, i);
+		workers.push_back(std::move(worker));
+	}
+	set_emitters(default_emitters(parameters.cells_x, parameters.cells_y));
+
+	for (size_t i = 0; i < workers.size(); ++i) {
+		workers[i].thread = std::thread{&SlabbedSimulation::run_worker, this, i};
+	}
+}
+
+SlabbedSimulation::~SlabbedSimulation()
+{
+	stopping = true;
+	step_start.wait();
+	for (auto& worker : workers) {
+		worker.thread.join();
+	}
+}
+
+void SlabbedSimulation::run_worker(size_t slab)
+{
+	for (;;) {
+		step_start.wait();
+		if (stopping) {
+			return;
+		}
+
+		// A failing slab breaks the exchange, so that the other slabs give up on their update instead of waiting for it
+		try {
+			workers[slab].simulation->update();
+		} catch (...) {
+			std::lock_guard<std::mutex> lock{failure_mutex};
+			if (not failure) {
+				failure = std::current_exception();
+			}
+			halo_exchange->abort();
+		}
+		step_end.wait();
+	}
+}
+
+void SlabbedSimulation::update()
+{
+	dispatch_events();
+	step_start.wait();
+	step_end.wait();
+	if (failure) {
+		std::rethrow_exception(failure);
+	}
+	stitch_frames();
+}
+
+void SlabbedSimulation::dispatch_events()
+{
+	// Every slab gets every event, sources near a seam reach into both slabs
+	events.clear();
+	events_from_ui->pop_all(events);
+	for (size_t i = 0; i < workers.size(); ++i) {
+		for (auto event : events) {
+			event.point.s[1] += slabs[i].local_row_offset();
+			workers[i].events->push_or_drop(event);
+		}
+	}
+}
+
+void SlabbedSimulation::stitch_frames()
+{
+	// The slabs deliver their frames independently, so a stitched frame may mix consecutive updates
+	bool updated = false;
+	const size_t row_size = parameters.cells_x;
+	for (size_t i = 0; i < workers.size(); ++i) {
+		if (not workers[i].frames->acquire_latest()) {
+			continue;
+		}
+
+		// The outer slabs also contribute the wall rows
+		const auto& slab = slabs[i];
+		const cl_uint begin = i == 0 ? 0 : slab.first_row;
+		const cl_uint end = i == slabs.size() - 1 ? parameters.cells_y : slab.first_row + slab.row_count;
+		const auto& slab_frame = workers[i].frames->front_buffer();
+		std::copy(slab_frame.begin() + slab.local_row(begin) * row_size, slab_frame.begin() + slab.local_row(end) * row_size,
+			  frame.begin() + begin * row_size);
+		updated = true;
+	}
+
+	if (updated) {
+		to_ui->back_buffer() = frame;
+		to_ui->publish();
+	}
+}
+
+void SlabbedSimulation::set_pressure_solver(PressureSolver solver)
+{
+	if (solver != PressureSolver::JACOBI) {
+		throw std::invalid_argument{"Slabbed simulations only support the Jacobi pressure solver"};
+	}
+	for (auto& worker : workers) {
+		worker.simulation->set_pressure_solver(solver);
+	}
+}
+
+void SlabbedSimulation::set_diffusion_solver(DiffusionSolver solver)
+{
+	if (solver != DiffusionSolver::JACOBI) {
+		throw std::invalid_argument{"Slabbed simulations only support the Jacobi diffusion solver"};
+	}
+	for (auto& worker : workers) {
+		worker.simulation->set_diffusion_solver(solver);
+	}
+}
+
+void SlabbedSimulation::set_solver_iterations(cl_uint iterations)
+{
+	for (auto& worker : workers) {
+		worker.simulation->set_solver_iterations(iterations);
+	}
+}
+
+void SlabbedSimulation::set_fused_kernels(bool enabled)
+{
+	for (auto& worker : workers) {
+		worker.simulation->set_fused_kernels(enabled);
+	}
+}
+
+void SlabbedSimulation::set_emitters(const std::vector<Event>& emitters)
+{
+	for (size_t i = 0; i < workers.size(); ++i) {
+		auto slab_emitters = emitters;
+		for (auto& emitter : slab_emitters) {
+			emitter.point.s[1] += slabs[i].local_row_offset();
+		}
+		workers[i].simulation->set_emitters(std::move(slab_emitters));
+	}
+}
@@ -0,0 +1,168 @@
+/**
+ * FluidSim - a free and open-source interactive fluid flow simulator
+ * Copyright (C) 2015  Damian Jarek <damian.jarek93@gmail.com>
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License along
+ * with this program; if not, write to the Free Software Foundation, Inc.,
+ * 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+ */
+
+#ifndef DECOMPOSITION_H
+#define DECOMPOSITION_H
+
+#define __CL_ENABLE_EXCEPTIONS
+
+#include <CL/cl.hpp>
+
+#include "channel.h"
+#include "program.h"
+#include "simulation.h"
+
+#include <condition_variable>
+#include <exception>
+#include <memory>
+#include <mutex>
+#include <thread>
+#include <utility>
+#include <vector>
+
+//Reusable barrier of a fixed number of threads. Breaking it wakes up the waiting threads and makes every wait
+//throw, so that a failing thread can't leave the others blocked.
+class Barrier
+{
+	std::mutex mutex;
+	std::condition_variable condition;
+	const size_t thread_count;
+	size_t waiting {0};
+	unsigned long generation {0};
+	bool broken {false};
+public:
+	explicit Barrier(size_t thread_count);
+
+	void wait();
+	void break_barrier();
+};
+
+//Horizontal slab of the grid simulated by one device. Rows are counted in the whole grid, the slab's own grid
+//extends below and above its rows by lower_pad and upper_pad rows, which are either the wall of the grid (1 row)
+//or halo rows copied from the neighbouring slab.
+struct Slab {
+	cl_uint first_row;
+	cl_uint row_count;
+	cl_uint lower_pad;
+	cl_uint upper_pad;
+
+	cl_uint cells_y() const { return lower_pad + row_count + upper_pad; }
+	cl_uint local_row(cl_uint row) const { return row + lower_pad - first_row; }
+	cl_int local_row_offset() const { return static_cast<cl_int>(lower_pad) - static_cast<cl_int>(first_row); }
+};
+
+//Splits the inner rows of a grid between slab_count slabs, each slab has to hold at least halo_rows rows
+std::vector<Slab> split_into_slabs(cl_uint cells_y, size_t slab_count, cl_uint halo_rows);
+
+//Copies the halo rows of a field between neighbouring slabs. Every slab's thread calls exchange, or
+//begin_exchange and finish_exchange, at the same point of its update, with its own copy of the field.
+//Each slab stages its edge rows in buffers of their own, which the neighbours copy into their halos once
+//they are ready, so a field is only ever accessed by its own slab's device. Without overlap the halo is
+//filled on the slab's queue, in order with its kernels. With overlap it's filled on a transfer queue of the
+//slab's device while the slab's queue computes the rows away from the halo. OpenCL leaves the concurrent use
+//of a buffer by two queues undefined, even on one device, so the overlap is opt-in.
+class HaloExchange
+{
+	std::vector<Slab> slabs;
+	cl_uint cells_x;
+	cl_uint halo_rows;
+	bool overlap;
+	Barrier barrier;
+	std::vector<cl::CommandQueue> transfer_queues; //on the device of each slab's queue, with overlap
+	std::vector<cl::Buffer> lower_edges; //each slab's lowest halo_rows rows, for the slab below
+	std::vector<cl::Buffer> upper_edges;
+	std::vector<cl::Event> ready; //the edges are staged
+	std::vector<cl::Event> copied_from_below; //into each slab's lower halo
+	std::vector<cl::Event> copied_from_above;
+public:
+	//The slabs' queues are in the order of the slabs
+	HaloExchange(std::vector<Slab> slabs, cl_uint cells_x, cl_uint halo_rows, bool overlap,
+		     const std::vector<cl::CommandQueue>& cmd_queues);
+
+	void exchange(size_t slab, cl::CommandQueue& cmd_queue, const cl::Buffer& field, size_t element_size);
+	//With overlap, the commands enqueued between begin_exchange and finish_exchange run while the halo is
+	//copied, so they must neither read the halo rows nor write the field
+	void begin_exchange(size_t slab, cl::CommandQueue& cmd_queue, const cl::Buffer& field, size_t element_size);
+	void finish_exchange(size_t slab, cl::CommandQueue& cmd_queue);
+	bool overlapped() const;
+	cl_uint rows() const;
+	//Rows of the slab's grid, [first, second), whose 5-point stencils don't read its halo
+	std::pair<cl_uint, cl_uint> independent_rows(size_t slab) const;
+	void abort();
+private:
+	void fill_halo(size_t slab, cl::CommandQueue& queue, const cl::Buffer& field, size_t from, const cl::Buffer& edge,
+		       cl_uint first_row, size_t element_size, cl::Event& copy);
+};
+
+//Runs a simulation split into horizontal slabs, one per command queue (usually one per device or sub-device).
+//Each slab is a Simulation of its own rows plus the halo, driven by its own thread, the slabs' frames are
+//stitched together for the UI. Only the Jacobi solvers without residual checks are supported, because every
+//slab has to run the same sequence of passes.
+class SlabbedSimulation
+{
+	struct Worker {
+		std::unique_ptr<Simulation> simulation;
+		Channel_ptr<Event> events;
+		Mailbox_ptr<PixelField> frames;
+		std::thread thread;
+	};
+
+	SimulationParameters parameters;
+	std::vector<Slab> slabs;
+	std::shared_ptr<HaloExchange> halo_exchange;
+	std::vector<Worker> workers;
+	Barrier step_start;
+	Barrier step_end;
+	bool stopping {false};
+	std::exception_ptr failure;
+	std::mutex failure_mutex;
+
+	Mailbox_ptr<PixelField> to_ui;
+	Channel_ptr<Event> events_from_ui;
+	std::vector<Event> events;
+	PixelField frame; //stitched from the slabs' latest frames
+public:
+	//The programs are built for the slabs' grid sizes, halo_rows has to be at least 2 (the reach of the
+	//fused vorticity confinement), semi-Lagrangian advection reaching past the halo is clamped to it.
+	//halo_overlap computes the Jacobi iterations' inner rows while the halo is copied, see HaloExchange.
+	SlabbedSimulation(const cl::Context& context,
+			  const std::vector<cl::CommandQueue>& cmd_queues,
+			  const SimulationParameters& parameters,
+			  ProgramCache& programs,
+			  Mailbox_ptr<PixelField> to_ui,
+			  Channel_ptr<Event> events_from_ui,
+			  cl_uint workgroup_size,
+			  cl_uint halo_rows,
+			  bool halo_overlap);
+	~SlabbedSimulation();
+
+	void update();
+	//Throw std::invalid_argument for the solvers which can't run on slabs
+	void set_pressure_solver(PressureSolver solver);
+	void set_diffusion_solver(DiffusionSolver solver);
+	void set_solver_iterations(cl_uint iterations);
+	void set_fused_kernels(bool enabled);
+	void set_emitters(const std::vector<Event>& emitters);
+private:
+	void run_worker(size_t slab);
+	void dispatch_events();
+	void stitch_frames();
+};
+
+#endif //DECOMPOSITION_H
@@ -0,0 +1,38 @@
+/**
+ * FluidSim - a free and open-source interactive fluid flow simulator
+ * Copyright (C) 2015  Damian Jarek <damian.jarek93@gmail.com>
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License along
+ * with this program; if not, write to the Free Software Foundation, Inc.,
+ * 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+ */
+
+#ifndef HASH_H
+#define HASH_H
+
+#include <CL/opencl.h>
+#include <cstddef>
+
+//64-bit FNV-1a, of the program sources for the binary cache and of the fields for the event traces' checksums
+inline cl_ulong fnv1a_hash(const void* data, size_t size)
+{
+	const auto bytes = static_cast<const unsigned char*>(data);
+	cl_ulong result = 0xcbf29ce484222325;
+	for (size_t i = 0; i < size; ++i) {
+		result ^= bytes[i];
+		result *= 0x100000001b3;
+	}
+	return result;
+}
+
+#endif //HASH_H
@@ -22,12 +22,60 @@ typedef Vector VectorField;
 typedef float Scalar;
 typedef int2 Point;
 
+//The fields can be stored in a 16-bit format to halve the memory traffic of the stencils, the arithmetic stays
+//in float. Every access to a field goes through LOAD_* and STORE_*, the reduction buffers and local tiles are floats.
+#if defined(HALF_STORAGE)
+#define GlobalVectorField global half*
+#define GlobalScalarField global half*
+
+#define LOAD_SCALAR(field, index) vload_half((index), (field))
+#define STORE_SCALAR(field, index, value) vstore_half_rte((value), (index), (field))
+#define LOAD_VECTOR(field, index) vload_half2((index), (field))
+#define STORE_VECTOR(field, index, value) vstore_half2_rte((value), (index), (field))
+#elif defined(BFLOAT16_STORAGE)
+#define GlobalVectorField global ushort2*
+#define GlobalScalarField global ushort*
+
+//bfloat16 is the upper half of a float, so it keeps the range of a float with an 8-bit mantissa
+inline Scalar bfloat16_to_float(const ushort value)
+{
+	return as_float((uint)value << 16);
+}
+
+//Rounds to the nearest, ties to even
+inline ushort float_to_bfloat16(const Scalar value)
+{
+	const uint bits = as_uint(value);
+	return (ushort)((bits + 0x7FFF + ((bits >> 16) & 1)) >> 16);
+}
+
+inline Vector bfloat16_to_vector(const ushort2 value)
+{
+	return (Vector)(bfloat16_to_float(value.x), bfloat16_to_float(value.y));
+}
+
+inline ushort2 vector_to_bfloat16(const Vector value)
+{
+	return (ushort2)(float_to_bfloat16(value.x), float_to_bfloat16(value.y));
+}
+
+#define LOAD_SCALAR(field, index) bfloat16_to_float((field)[index])
+#define STORE_SCALAR(field, index, value) ((field)[index] = float_to_bfloat16(value))
+#define LOAD_VECTOR(field, index) bfloat16_to_vector((field)[index])
+#define STORE_VECTOR(field, index, value) ((field)[index] = vector_to_bfloat16(value))
+#else
 #define GlobalVectorField global Vector*
 #define GlobalScalarField global Scalar*
 
+#define LOAD_SCALAR(field, index) ((field)[index])
+#define STORE_SCALAR(field, index, value) ((field)[index] = (value))
+#define LOAD_VECTOR(field, index) ((field)[index])
+#define STORE_VECTOR(field, index, value) ((field)[index] = (value))
+#endif
+
 inline size_t AT(size_t x, size_t y)
 {
-	return y*SIZE + x;
+	return y*SIZE_X + x;
 }
 
 inline size_t AT_POS(Point pos)
@@ -35,12 +83,179 @@ inline size_t AT_POS(Point pos)
 	return AT(pos.x, pos.y);
 }
 
+inline size_t AT_SIZED(size_t x, size_t y, size_t width)
+{
+	return y*width + x;
+}
+
 inline Point getPosition()
 {
 	Point point = {get_global_id(0), get_global_id(1)};
 	return point;
 }
 
+//Inner kernels are launched with an offset of 1 and a global size rounded up to a multiple of the work-group size,
+//so work-items past the last inner cell have to skip their writes
+inline bool is_inner_cell(const Point position)
+{
+	return position.x < SIZE_X - 1 && position.y < SIZE_Y - 1;
+}
+
+//A cell and its 4 direct neighbours, as read by the 5-point stencil kernels
+typedef struct {
+	Scalar center;
+	Scalar left;
+	Scalar right;
+	Scalar top;
+	Scalar bottom;
+} ScalarStencil;
+
+typedef struct {
+	Vector center;
+	Vector left;
+	Vector right;
+	Vector top;
+	Vector bottom;
+} VectorStencil;
+
+//With TILED_STENCILS defined, the stencil kernels first load their work-group's TILE_SIZE x TILE_SIZE cells
+//and a one cell wide halo into local memory, so each cell is fetched from global memory only once per
+//work-group. The kernels have to be launched with TILE_SIZE x TILE_SIZE work-groups.
+#ifdef TILED_STENCILS
+#define TILE_WIDTH (TILE_SIZE + 2)
+#define SCALAR_TILE(name) local Scalar name[TILE_WIDTH * TILE_WIDTH]
+#define VECTOR_TILE(name) local Vector name[TILE_WIDTH * TILE_WIDTH]
+
+//Local coordinates range from -1 to TILE_SIZE, to include the halo
+inline int TILE_AT(int x, int y)
+{
+	return (y + 1) * TILE_WIDTH + x + 1;
+}
+
+//Work-groups covering the last cells may reach past the grid, their reads are clamped to it
+inline size_t AT_CLAMPED(int x, int y)
+{
+	return AT(clamp(x, 0, SIZE_X - 1), clamp(y, 0, SIZE_Y - 1));
+}
+
+inline ScalarStencil load_scalar_stencil(const GlobalScalarField field, local Scalar* tile)
+{
+	const Point position = getPosition();
+	const int x = get_local_id(0);
+	const int y = get_local_id(1);
+
+	tile[TILE_AT(x, y)] = LOAD_SCALAR(field, AT_CLAMPED(position.x, position.y));
+	if (x == 0) {
+		tile[TILE_AT(-1, y)] = LOAD_SCALAR(field, AT_CLAMPED(position.x - 1, position.y));
+	} else if (x == TILE_SIZE - 1) {
+		tile[TILE_AT(TILE_SIZE, y)] = LOAD_SCALAR(field, AT_CLAMPED(position.x + 1, position.y));
+	}
+	if (y == 0) {
+		tile[TILE_AT(x, -1)] = LOAD_SCALAR(field, AT_CLAMPED(position.x, position.y - 1));
+	} else if (y == TILE_SIZE - 1) {
+		tile[TILE_AT(x, TILE_SIZE)] = LOAD_SCALAR(field, AT_CLAMPED(position.x, position.y + 1));
+	}
+	barrier(CLK_LOCAL_MEM_FENCE);
+
+	ScalarStencil stencil;
+	stencil.center = tile[TILE_AT(x, y)];
+	stencil.left = tile[TILE_AT(x - 1, y)];
+	stencil.right = tile[TILE_AT(x + 1, y)];
+	stencil.top = tile[TILE_AT(x, y + 1)];
+	stencil.bottom = tile[TILE_AT(x, y - 1)];
+	return stencil;
+}
+
+inline VectorStencil load_vector_stencil(const GlobalVectorField field, local Vector* tile)
+{
+	const Point position = getPosition();
+	const int x = get_local_id(0);
+	const int y = get_local_id(1);
+
+	tile[TILE_AT(x, y)] = LOAD_VECTOR(field, AT_CLAMPED(position.x, position.y));
+	if (x == 0) {
+		tile[TILE_AT(-1, y)] = LOAD_VECTOR(field, AT_CLAMPED(position.x - 1, position.y));
+	} else if (x == TILE_SIZE - 1) {
+		tile[TILE_AT(TILE_SIZE, y)] = LOAD_VECTOR(field, AT_CLAMPED(position.x + 1, position.y));
+	}
+	if (y == 0) {
+		tile[TILE_AT(x, -1)] = LOAD_VECTOR(field, AT_CLAMPED(position.x, position.y - 1));
+	} else if (y == TILE_SIZE - 1) {
+		tile[TILE_AT(x, TILE_SIZE)] = LOAD_VECTOR(field, AT_CLAMPED(position.x, position.y + 1));
+	}
+	barrier(CLK_LOCAL_MEM_FENCE);
+
+	VectorStencil stencil;
+	stencil.center = tile[TILE_AT(x, y)];
+	stencil.left = tile[TILE_AT(x - 1, y)];
+	stencil.right = tile[TILE_AT(x + 1, y)];
+	stencil.top = tile[TILE_AT(x, y + 1)];
+	stencil.bottom = tile[TILE_AT(x, y - 1)];
+	return stencil;
+}
+#else
+#define SCALAR_TILE(name) local Scalar* name = 0
+#define VECTOR_TILE(name) local Vector* name = 0
+
+inline ScalarStencil load_scalar_stencil(const GlobalScalarField field, local Scalar* tile)
+{
+	const Point position = getPosition();
+
+	ScalarStencil stencil = {0, 0, 0, 0, 0};
+	if (is_inner_cell(position)) {
+		stencil.center = LOAD_SCALAR(field, AT_POS(position));
+		stencil.left = LOAD_SCALAR(field, AT(position.x - 1, position.y));
+		stencil.right = LOAD_SCALAR(field, AT(position.x + 1, position.y));
+		stencil.top = LOAD_SCALAR(field, AT(position.x, position.y + 1));
+		stencil.bottom = LOAD_SCALAR(field, AT(position.x, position.y - 1));
+	}
+	return stencil;
+}
+
+inline VectorStencil load_vector_stencil(const GlobalVectorField field, local Vector* tile)
+{
+	const Point position = getPosition();
+
+	VectorStencil stencil = {{0, 0}, {0, 0}, {0, 0}, {0, 0}, {0, 0}};
+	if (is_inner_cell(position)) {
+		stencil.center = LOAD_VECTOR(field, AT_POS(position));
+		stencil.left = LOAD_VECTOR(field, AT(position.x - 1, position.y));
+		stencil.right = LOAD_VECTOR(field, AT(position.x + 1, position.y));
+		stencil.top = LOAD_VECTOR(field, AT(position.x, position.y + 1));
+		stencil.bottom = LOAD_VECTOR(field, AT(position.x, position.y - 1));
+	}
+	return stencil;
+}
+#endif
+
+inline bool on_boundary(const int x, const int y)
+{
+	return x == 0 || y == 0 || x == SIZE_X - 1 || y == SIZE_Y - 1;
+}
+
+//The folded stencil kernels do not read the boundary cells, a neighbour on the boundary is replaced with
+//boundary_scale times the cell itself (1 for the scalar boundary condition, -1 for the vector one).
+//This lets the solvers skip the boundary kernel between sweeps.
+inline ScalarStencil fold_scalar_boundary(ScalarStencil stencil, const Point position, const Scalar boundary_scale)
+{
+	const Scalar boundary = boundary_scale * stencil.center;
+	stencil.left = on_boundary(position.x - 1, position.y) ? boundary : stencil.left;
+	stencil.right = on_boundary(position.x + 1, position.y) ? boundary : stencil.right;
+	stencil.top = on_boundary(position.x, position.y + 1) ? boundary : stencil.top;
+	stencil.bottom = on_boundary(position.x, position.y - 1) ? boundary : stencil.bottom;
+	return stencil;
+}
+
+inline VectorStencil fold_vector_boundary(VectorStencil stencil, const Point position, const Scalar boundary_scale)
+{
+	const Vector boundary = boundary_scale * stencil.center;
+	stencil.left = on_boundary(position.x - 1, position.y) ? boundary : stencil.left;
+	stencil.right = on_boundary(position.x + 1, position.y) ? boundary : stencil.right;
+	stencil.top = on_boundary(position.x, position.y + 1) ? boundary : stencil.top;
+	stencil.bottom = on_boundary(position.x, position.y - 1) ? boundary : stencil.bottom;
+	return stencil;
+}
+
 inline Scalar lerp_scalar(Scalar s, Scalar e, Scalar t)
 {
 	return s+(e-s)*t;
@@ -52,8 +267,8 @@ inline Scalar blerp_scalar(Scalar c00, Scalar c10, Scalar c01, Scalar c11, Scala
 
 inline Scalar bilinear_interpolation_scalar(const GlobalScalarField field, const Vector position)
 {
-	const int x = min(max((int)floor(position.x), 1), SIZE - 3);
-	const int y = min(max((int)floor(position.y), 1), SIZE - 3);
+	const int x = min(max((int)floor(position.x), 1), SIZE_X - 3);
+	const int y = min(max((int)floor(position.y), 1), SIZE_Y - 3);
 	const int x1 = x;
 	const int x2 = x + 1;
 	const int y1 = y;
@@ -62,18 +277,21 @@ inline Scalar bilinear_interpolation_scalar(const GlobalScalarField field, const
 	float x_pos = (fabs(position.x) - x1) / (x2 - x1);
 	float y_pos = (fabs(position.y) - y1) / (y2 - y1);
 
-	return fabs(blerp_scalar(field[AT(x1, y1)], field[AT(x2, y1)], field[AT(x1, y2)], field[AT(x2, y2)], x_pos, y_pos));
+	return fabs(blerp_scalar(LOAD_SCALAR(field, AT(x1, y1)), LOAD_SCALAR(field, AT(x2, y1)), LOAD_SCALAR(field, AT(x1, y2)), LOAD_SCALAR(field, AT(x2, y2)), x_pos, y_pos));
 }
 
 kernel void advect_scalar(const GlobalScalarField x, const GlobalVectorField u, GlobalScalarField x_out, const Scalar dx_reversed, const Scalar time_step, const Scalar dissipation)
 {
 	const Point position = getPosition();
+	if (!is_inner_cell(position)) {
+		return;
+	}
 
-	const Vector old_position = time_step * dx_reversed * u[AT_POS(position)];
+	const Vector old_position = time_step * dx_reversed * LOAD_VECTOR(u, AT_POS(position));
 	Vector vec_pos = {position.x, position.y};
 	vec_pos -= old_position;
 
-	x_out[AT_POS(position)] = bilinear_interpolation_scalar(x, vec_pos) * dissipation;
+	STORE_SCALAR(x_out, AT_POS(position), bilinear_interpolation_scalar(x, vec_pos) * dissipation);
 }
 
 inline Vector lerp_vector(Vector s, Vector e, Scalar t)
@@ -87,8 +305,8 @@ inline Vector blerp_vector(Vector c00, Vector c10, Vector c01, Vector c11, Scala
 
 inline Vector bilinear_interpolation_vector(const GlobalVectorField field, const Vector position)
 {
-	const int x = min(max((int)floor(position.x), 1), SIZE - 3);
-	const int y = min(max((int)floor(position.y), 1), SIZE - 3);
+	const int x = min(max((int)floor(position.x), 1), SIZE_X - 3);
+	const int y = min(max((int)floor(position.y), 1), SIZE_Y - 3);
 	const int x1 = x;
 	const int x2 = x + 1;
 	const int y1 = y;
@@ -97,18 +315,21 @@ inline Vector bilinear_interpolation_vector(const GlobalVectorField field, const
 	float x_pos = (fabs(position.x) - x1) / (x2 - x1);
 	float y_pos = (fabs(position.y) - y1) / (y2 - y1);
 
-	return blerp_vector(field[AT(x1, y1)], field[AT(x2, y1)], field[AT(x1, y2)], field[AT(x2, y2)], x_pos, y_pos);
+	return blerp_vector(LOAD_VECTOR(field, AT(x1, y1)), LOAD_VECTOR(field, AT(x2, y1)), LOAD_VECTOR(field, AT(x1, y2)), LOAD_VECTOR(field, AT(x2, y2)), x_pos, y_pos);
 }
 
 kernel void advect_vector(const GlobalVectorField x, const GlobalVectorField u, GlobalVectorField x_out, const Scalar dx_reversed, const Scalar time_step, const Vector dissipation)
 {
 	const Point position = getPosition();
+	if (!is_inner_cell(position)) {
+		return;
+	}
 
-	const Vector old_position = time_step * dx_reversed * u[AT_POS(position)];
+	const Vector old_position = time_step * dx_reversed * LOAD_VECTOR(u, AT_POS(position));
 	Vector vec_pos = {position.x, position.y};
 	vec_pos -= old_position;
 
-	x_out[AT_POS(position)] = bilinear_interpolation_vector(x, vec_pos) * dissipation;
+	STORE_VECTOR(x_out, AT_POS(position), bilinear_interpolation_vector(x, vec_pos) * dissipation);
 }
 
 kernel void vector_jacobi_iteration(const GlobalVectorField x, const GlobalVectorField b, GlobalVectorField x_out, const Scalar alpha, const Scalar beta_reciprocal)
@@ -116,12 +337,13 @@ kernel void vector_jacobi_iteration(const GlobalVectorField x, const GlobalVecto
 	const Point position = getPosition();
 	const int index = AT_POS(position);
 
-	const Vector x_left = x[AT(position.x - 1, position.y)];
-	const Vector x_right = x[AT(position.x + 1, position.y)];
-	const Vector x_top = x[AT(position.x, position.y + 1)];
-	const Vector x_bottom = x[AT(position.x, position.y - 1)];
+	VECTOR_TILE(tile);
+	const VectorStencil x_stencil = load_vector_stencil(x, tile);
+	if (!is_inner_cell(position)) {
+		return;
+	}
 
-	x_out[index] = (x_left + x_right + x_top + x_bottom + alpha * b[index]) * beta_reciprocal;
+	STORE_VECTOR(x_out, index, (x_stencil.left + x_stencil.right + x_stencil.top + x_stencil.bottom + alpha * LOAD_VECTOR(b, index)) * beta_reciprocal);
 }
 
 kernel void scalar_jacobi_iteration(const GlobalScalarField x, const GlobalScalarField b, GlobalScalarField x_out, const Scalar alpha, const Scalar beta_reciprocal)
@@ -129,25 +351,462 @@ kernel void scalar_jacobi_iteration(const GlobalScalarField x, const GlobalScala
 	const Point position = getPosition();
 	const int index = AT_POS(position);
 
-	const Scalar x_left = x[AT(position.x - 1, position.y)];
-	const Scalar x_right = x[AT(position.x + 1, position.y)];
-	const Scalar x_top = x[AT(position.x, position.y + 1)];
-	const Scalar x_bottom = x[AT(position.x, position.y - 1)];
+	SCALAR_TILE(tile);
+	const ScalarStencil x_stencil = load_scalar_stencil(x, tile);
+	if (!is_inner_cell(position)) {
+		return;
+	}
 
-	x_out[index] = (x_left + x_right + x_top + x_bottom + alpha * b[index]) * beta_reciprocal;
+	STORE_SCALAR(x_out, index, (x_stencil.left + x_stencil.right + x_stencil.top + x_stencil.bottom + alpha * LOAD_SCALAR(b, index)) * beta_reciprocal);
 }
 
-kernel void divergence(const GlobalVectorField w, GlobalScalarField divergence_w_out, const Scalar halved_reverse_dx)
+kernel void vector_jacobi_iteration_folded(const GlobalVectorField x, const GlobalVectorField b, GlobalVectorField x_out, const Scalar alpha, const Scalar beta_reciprocal, const Scalar boundary_scale)
+{
+	const Point position = getPosition();
+	const int index = AT_POS(position);
+
+	VECTOR_TILE(tile);
+	const VectorStencil x_stencil = fold_vector_boundary(load_vector_stencil(x, tile), position, boundary_scale);
+	if (!is_inner_cell(position)) {
+		return;
+	}
+
+	STORE_VECTOR(x_out, index, (x_stencil.left + x_stencil.right + x_stencil.top + x_stencil.bottom + alpha * LOAD_VECTOR(b, index)) * beta_reciprocal);
+}
+
+kernel void scalar_jacobi_iteration_folded(const GlobalScalarField x, const GlobalScalarField b, GlobalScalarField x_out, const Scalar alpha, const Scalar beta_reciprocal, const Scalar boundary_scale)
+{
+	const Point position = getPosition();
+	const int index = AT_POS(position);
+
+	SCALAR_TILE(tile);
+	const ScalarStencil x_stencil = fold_scalar_boundary(load_scalar_stencil(x, tile), position, boundary_scale);
+	if (!is_inner_cell(position)) {
+		return;
+	}
+
+	STORE_SCALAR(x_out, index, (x_stencil.left + x_stencil.right + x_stencil.top + x_stencil.bottom + alpha * LOAD_SCALAR(b, index)) * beta_reciprocal);
+}
+
+//Temporally blocked Jacobi iterations: each work-group loads a JACOBI_TILE_SIZE x JACOBI_TILE_SIZE tile of cells,
+//performs sweeps iterations on it in local memory and writes back only the cells that are still exact. Every
+//iteration invalidates one more ring of cells at the edge of the tile, so neighbouring tiles overlap by
+//2 * sweeps cells. The boundary condition is applied in local memory after every iteration, the boundary cells
+//copy their inner neighbour multiplied by boundary_scale (1 for scalar fields, -1 for the velocity).
+//The work-groups are JACOBI_BLOCK_SIZE x JACOBI_BLOCK_SIZE, each work-item updates JACOBI_TILE_CELLS x JACOBI_TILE_CELLS
+//cells of the tile, JACOBI_BLOCK_SIZE apart so that neighbouring work-items access neighbouring cells.
+//b is read once per launch.
+
+#define JACOBI_TILE_CELLS (JACOBI_TILE_SIZE / JACOBI_BLOCK_SIZE)
+
+typedef struct {
+	int x; //in the tile
+	int y;
+	int global_x;
+	int global_y;
+	int neighbour_x; //in the tile, the inner neighbour of a boundary cell
+	int neighbour_y;
+	bool in_grid;
+	bool inner;
+	bool tile_edge;
+	bool boundary;
+	bool neighbour_in_tile;
+} BlockedCell;
+
+inline int blocked_origin(const int group, const int sweeps)
+{
+	return group * (JACOBI_TILE_SIZE - 2 * sweeps) + 1 - sweeps;
+}
+
+inline bool in_block_output(const int x, const int y, const int sweeps)
+{
+	return x >= sweeps && y >= sweeps && x < JACOBI_TILE_SIZE - sweeps && y < JACOBI_TILE_SIZE - sweeps;
+}
+
+inline int BLOCK_AT(int x, int y)
+{
+	return y * JACOBI_TILE_SIZE + x;
+}
+
+//Local coordinates of the inner neighbour of a boundary cell, corners are not boundary cells (they are not
+//used by the 5-point stencil)
+inline bool blocked_boundary_neighbour(const int global_x, const int global_y, int* local_x, int* local_y)
+{
+	const bool left_or_right = global_x == 0 || global_x == SIZE_X - 1;
+	const bool top_or_bottom = global_y == 0 || global_y == SIZE_Y - 1;
+	if (left_or_right == top_or_bottom) {
+		return false;
+	}
+
+	if (global_x == 0) {
+		*local_x += 1;
+	} else if (global_x == SIZE_X - 1) {
+		*local_x -= 1;
+	} else if (global_y == 0) {
+		*local_y += 1;
+	} else {
+		*local_y -= 1;
+	}
+	return true;
+}
+
+//The cell'th of the work-item's cells in its work-group's tile
+inline BlockedCell blocked_cell(const int cell, const int sweeps)
+{
+	BlockedCell result;
+	result.x = get_local_id(0) + cell % JACOBI_TILE_CELLS * JACOBI_BLOCK_SIZE;
+	result.y = get_local_id(1) + cell / JACOBI_TILE_CELLS * JACOBI_BLOCK_SIZE;
+	result.global_x = blocked_origin(get_group_id(0), sweeps) + result.x;
+	result.global_y = blocked_origin(get_group_id(1), sweeps) + result.y;
+
+	result.in_grid = result.global_x >= 0 && result.global_y >= 0 && result.global_x < SIZE_X && result.global_y < SIZE_Y;
+	result.inner = result.global_x > 0 && result.global_y > 0 && result.global_x < SIZE_X - 1 && result.global_y < SIZE_Y - 1;
+	result.tile_edge = result.x == 0 || result.y == 0 || result.x == JACOBI_TILE_SIZE - 1 || result.y == JACOBI_TILE_SIZE - 1;
+	result.neighbour_x = result.x;
+	result.neighbour_y = result.y;
+	result.boundary = result.in_grid && blocked_boundary_neighbour(result.global_x, result.global_y, &result.neighbour_x, &result.neighbour_y);
+	result.neighbour_in_tile = result.neighbour_x >= 0 && result.neighbour_y >= 0
+				   && result.neighbour_x < JACOBI_TILE_SIZE && result.neighbour_y < JACOBI_TILE_SIZE;
+	return result;
+}
+
+inline bool blocked_output(const BlockedCell cell, const int sweeps)
+{
+	return (cell.inner && in_block_output(cell.x, cell.y, sweeps)) || (cell.boundary && in_block_output(cell.neighbour_x, cell.neighbour_y, sweeps));
+}
+
+kernel void scalar_jacobi_blocked(const GlobalScalarField x, const GlobalScalarField b, GlobalScalarField x_out, const Scalar alpha, const Scalar beta_reciprocal, const Scalar boundary_scale, const int sweeps)
+{
+	local Scalar tiles[2][JACOBI_TILE_SIZE * JACOBI_TILE_SIZE];
+	Scalar b_values[JACOBI_TILE_CELLS * JACOBI_TILE_CELLS];
+
+	for (int i = 0; i < JACOBI_TILE_CELLS * JACOBI_TILE_CELLS; ++i) {
+		const BlockedCell cell = blocked_cell(i, sweeps);
+		b_values[i] = cell.inner ? LOAD_SCALAR(b, AT(cell.global_x, cell.global_y)) : 0;
+		tiles[0][BLOCK_AT(cell.x, cell.y)] = cell.in_grid ? LOAD_SCALAR(x, AT(cell.global_x, cell.global_y)) : 0;
+	}
+
+	int current = 0;
+	for (int sweep = 0; sweep < sweeps; ++sweep) {
+		barrier(CLK_LOCAL_MEM_FENCE);
+		local Scalar* tile = tiles[current];
+		local Scalar* tile_out = tiles[1 - current];
+
+		for (int i = 0; i < JACOBI_TILE_CELLS * JACOBI_TILE_CELLS; ++i) {
+			const BlockedCell cell = blocked_cell(i, sweeps);
+			Scalar value = tile[BLOCK_AT(cell.x, cell.y)];
+			if (cell.inner && !cell.tile_edge) {
+				value = (tile[BLOCK_AT(cell.x - 1, cell.y)] + tile[BLOCK_AT(cell.x + 1, cell.y)]
+					 + tile[BLOCK_AT(cell.x, cell.y + 1)] + tile[BLOCK_AT(cell.x, cell.y - 1)] + alpha * b_values[i]) * beta_reciprocal;
+			}
+			tile_out[BLOCK_AT(cell.x, cell.y)] = value;
+		}
+
+		barrier(CLK_LOCAL_MEM_FENCE);
+		for (int i = 0; i < JACOBI_TILE_CELLS * JACOBI_TILE_CELLS; ++i) {
+			const BlockedCell cell = blocked_cell(i, sweeps);
+			if (cell.boundary && cell.neighbour_in_tile) {
+				tile_out[BLOCK_AT(cell.x, cell.y)] = boundary_scale * tile_out[BLOCK_AT(cell.neighbour_x, cell.neighbour_y)];
+			}
+		}
+		current = 1 - current;
+	}
+
+	for (int i = 0; i < JACOBI_TILE_CELLS * JACOBI_TILE_CELLS; ++i) {
+		const BlockedCell cell = blocked_cell(i, sweeps);
+		if (blocked_output(cell, sweeps)) {
+			STORE_SCALAR(x_out, AT(cell.global_x, cell.global_y), tiles[current][BLOCK_AT(cell.x, cell.y)]);
+		}
+	}
+}
+
+kernel void vector_jacobi_blocked(const GlobalVectorField x, const GlobalVectorField b, GlobalVectorField x_out, const Scalar alpha, const Scalar beta_reciprocal, const Scalar boundary_scale, const int sweeps)
+{
+	local Vector tiles[2][JACOBI_TILE_SIZE * JACOBI_TILE_SIZE];
+	Vector b_values[JACOBI_TILE_CELLS * JACOBI_TILE_CELLS];
+
+	const Vector zero = {0.0, 0.0};
+	for (int i = 0; i < JACOBI_TILE_CELLS * JACOBI_TILE_CELLS; ++i) {
+		const BlockedCell cell = blocked_cell(i, sweeps);
+		b_values[i] = cell.inner ? LOAD_VECTOR(b, AT(cell.global_x, cell.global_y)) : zero;
+		tiles[0][BLOCK_AT(cell.x, cell.y)] = cell.in_grid ? LOAD_VECTOR(x, AT(cell.global_x, cell.global_y)) : zero;
+	}
+
+	int current = 0;
+	for (int sweep = 0; sweep < sweeps; ++sweep) {
+		barrier(CLK_LOCAL_MEM_FENCE);
+		local Vector* tile = tiles[current];
+		local Vector* tile_out = tiles[1 - current];
+
+		for (int i = 0; i < JACOBI_TILE_CELLS * JACOBI_TILE_CELLS; ++i) {
+			const BlockedCell cell = blocked_cell(i, sweeps);
+			Vector value = tile[BLOCK_AT(cell.x, cell.y)];
+			if (cell.inner && !cell.tile_edge) {
+				value = (tile[BLOCK_AT(cell.x - 1, cell.y)] + tile[BLOCK_AT(cell.x + 1, cell.y)]
+					 + tile[BLOCK_AT(cell.x, cell.y + 1)] + tile[BLOCK_AT(cell.x, cell.y - 1)] + alpha * b_values[i]) * beta_reciprocal;
+			}
+			tile_out[BLOCK_AT(cell.x, cell.y)] = value;
+		}
+
+		barrier(CLK_LOCAL_MEM_FENCE);
+		for (int i = 0; i < JACOBI_TILE_CELLS * JACOBI_TILE_CELLS; ++i) {
+			const BlockedCell cell = blocked_cell(i, sweeps);
+			if (cell.boundary && cell.neighbour_in_tile) {
+				tile_out[BLOCK_AT(cell.x, cell.y)] = boundary_scale * tile_out[BLOCK_AT(cell.neighbour_x, cell.neighbour_y)];
+			}
+		}
+		current = 1 - current;
+	}
+
+	for (int i = 0; i < JACOBI_TILE_CELLS * JACOBI_TILE_CELLS; ++i) {
+		const BlockedCell cell = blocked_cell(i, sweeps);
+		if (blocked_output(cell, sweeps)) {
+			STORE_VECTOR(x_out, AT(cell.global_x, cell.global_y), tiles[current][BLOCK_AT(cell.x, cell.y)]);
+		}
+	}
+}
+
+//Red-black ordered SOR iterations update x in place. Only the cells with (x + y) % 2 == parity are updated,
+//so the work-items are launched over half of each row, with the first row at offset 1
+inline Point getRedBlackPosition(const int parity)
+{
+	const int y = get_global_id(1);
+	Point point = {2 * get_global_id(0) + 1 + ((y + 1 + parity) & 1), y};
+	return point;
+}
+
+kernel void vector_sor_iteration(GlobalVectorField x, const GlobalVectorField b, const Scalar alpha, const Scalar beta_reciprocal, const Scalar omega, const int parity)
+{
+	const Point position = getRedBlackPosition(parity);
+	if (position.x >= SIZE_X - 1) {
+		return;
+	}
+	const int index = AT_POS(position);
+
+	const Vector x_left = LOAD_VECTOR(x, AT(position.x - 1, position.y));
+	const Vector x_right = LOAD_VECTOR(x, AT(position.x + 1, position.y));
+	const Vector x_top = LOAD_VECTOR(x, AT(position.x, position.y + 1));
+	const Vector x_bottom = LOAD_VECTOR(x, AT(position.x, position.y - 1));
+
+	const Vector gauss_seidel = (x_left + x_right + x_top + x_bottom + alpha * LOAD_VECTOR(b, index)) * beta_reciprocal;
+	STORE_VECTOR(x, index, LOAD_VECTOR(x, index) + omega * (gauss_seidel - LOAD_VECTOR(x, index)));
+}
+
+kernel void scalar_sor_iteration(GlobalScalarField x, const GlobalScalarField b, const Scalar alpha, const Scalar beta_reciprocal, const Scalar omega, const int parity)
+{
+	const Point position = getRedBlackPosition(parity);
+	if (position.x >= SIZE_X - 1) {
+		return;
+	}
+	const int index = AT_POS(position);
+
+	const Scalar x_left = LOAD_SCALAR(x, AT(position.x - 1, position.y));
+	const Scalar x_right = LOAD_SCALAR(x, AT(position.x + 1, position.y));
+	const Scalar x_top = LOAD_SCALAR(x, AT(position.x, position.y + 1));
+	const Scalar x_bottom = LOAD_SCALAR(x, AT(position.x, position.y - 1));
+
+	const Scalar gauss_seidel = (x_left + x_right + x_top + x_bottom + alpha * LOAD_SCALAR(b, index)) * beta_reciprocal;
+	STORE_SCALAR(x, index, LOAD_SCALAR(x, index) + omega * (gauss_seidel - LOAD_SCALAR(x, index)));
+}
+
+//Sums the values in scratch across the work-group, the result ends up in scratch[0].
+//The local size has to be a power of 2.
+inline void local_sum(local Scalar* scratch, const uint local_index, const uint local_size)
+{
+	for (uint stride = local_size / 2; stride > 0; stride /= 2) {
+		barrier(CLK_LOCAL_MEM_FENCE);
+		if (local_index < stride) {
+			scratch[local_index] += scratch[local_index + stride];
+		}
+	}
+	barrier(CLK_LOCAL_MEM_FENCE);
+}
+
+inline uint getLocalIndex()
+{
+	return get_local_id(1) * get_local_size(0) + get_local_id(0);
+}
+
+inline uint getGroupIndex()
+{
+	return get_group_id(1) * get_num_groups(0) + get_group_id(0);
+}
+
+//Stores the sum of value over the whole work-group in partial_sums
+inline void store_group_sum(const Scalar value, global Scalar* partial_sums, local Scalar* scratch)
+{
+	const uint local_index = getLocalIndex();
+
+	scratch[local_index] = value;
+	local_sum(scratch, local_index, get_local_size(0) * get_local_size(1));
+
+	if (local_index == 0) {
+		partial_sums[getGroupIndex()] = scratch[0];
+	}
+}
+
+//Residual kernels are launched over a range rounded up to the work-group size as well.
+//The residual is measured as the change a Jacobi iteration would make to x, each work-group
+//stores the sum of its squares in partial_sums
+kernel void scalar_jacobi_residual(const GlobalScalarField x, const GlobalScalarField b, global Scalar* partial_sums, local Scalar* scratch, const Scalar alpha, const Scalar beta_reciprocal)
+{
+	const Point position = getPosition();
+
+	Scalar residual = 0;
+	if (is_inner_cell(position)) {
+		const int index = AT_POS(position);
+
+		const Scalar x_left = LOAD_SCALAR(x, AT(position.x - 1, position.y));
+		const Scalar x_right = LOAD_SCALAR(x, AT(position.x + 1, position.y));
+		const Scalar x_top = LOAD_SCALAR(x, AT(position.x, position.y + 1));
+		const Scalar x_bottom = LOAD_SCALAR(x, AT(position.x, position.y - 1));
+
+		residual = (x_left + x_right + x_top + x_bottom + alpha * LOAD_SCALAR(b, index)) * beta_reciprocal - LOAD_SCALAR(x, index);
+	}
+
+	store_group_sum(residual * residual, partial_sums, scratch);
+}
+
+kernel void vector_jacobi_residual(const GlobalVectorField x, const GlobalVectorField b, global Scalar* partial_sums, local Scalar* scratch, const Scalar alpha, const Scalar beta_reciprocal)
 {
 	const Point position = getPosition();
 
-	const Vector w_left = w[AT(position.x - 1, position.y)];
-	const Vector w_right = w[AT(position.x + 1, position.y)];
-	const Vector w_top = w[AT(position.x, position.y + 1)];
-	const Vector w_bottom = w[AT(position.x, position.y - 1)];
+	Vector residual = {0.0, 0.0};
+	if (is_inner_cell(position)) {
+		const int index = AT_POS(position);
+
+		const Vector x_left = LOAD_VECTOR(x, AT(position.x - 1, position.y));
+		const Vector x_right = LOAD_VECTOR(x, AT(position.x + 1, position.y));
+		const Vector x_top = LOAD_VECTOR(x, AT(position.x, position.y + 1));
+		const Vector x_bottom = LOAD_VECTOR(x, AT(position.x, position.y - 1));
+
+		residual = (x_left + x_right + x_top + x_bottom + alpha * LOAD_VECTOR(b, index)) * beta_reciprocal - LOAD_VECTOR(x, index);
+	}
+
+	store_group_sum(dot(residual, residual), partial_sums, scratch);
+}
+
+//Launched as a single work-group, sums count values into results[result_index]
+kernel void reduce_sum(const global Scalar* values, const uint count, global Scalar* results, local Scalar* scratch, const uint result_index)
+{
+	const uint local_index = get_local_id(0);
+	const uint local_size = get_local_size(0);
+
+	Scalar sum = 0;
+	for (uint i = local_index; i < count; i += local_size) {
+		sum += values[i];
+	}
 
-	divergence_w_out[AT_POS(position)] = halved_reverse_dx * (w_right.x - w_left.x + w_top.y - w_bottom.y);
+	scratch[local_index] = sum;
+	local_sum(scratch, local_index, local_size);
 
+	if (local_index == 0) {
+		results[result_index] = scratch[0];
+	}
+}
+
+//Preconditioned conjugate gradient kernels solve A x = alpha * b for the pressure, where A is the negated
+//5-point Laplacian stencil with 4 on the diagonal. The Neumann boundary condition is folded into the stencil:
+//a neighbour on the boundary has the same value as the cell itself. The preconditioner is the inverse of
+//the diagonal. All kernels use the launch geometry of the residual kernels and store the partial sums of
+//the dot product they need, the scalars of the method stay in the results buffer on the device.
+
+inline Scalar neumann_neighbour(const GlobalScalarField x, const int neighbour_x, const int neighbour_y, const Scalar centre)
+{
+	return on_boundary(neighbour_x, neighbour_y) ? centre : LOAD_SCALAR(x, AT(neighbour_x, neighbour_y));
+}
+
+inline Scalar safe_ratio(const Scalar numerator, const Scalar denominator)
+{
+	return denominator != 0 ? numerator / denominator : 0;
+}
+
+//Starts from x = 0, so r = alpha * b
+kernel void cg_initialize(const GlobalScalarField b, GlobalScalarField r, GlobalScalarField z, GlobalScalarField d, const Scalar alpha, global Scalar* partial_sums, local Scalar* scratch)
+{
+	const Point position = getPosition();
+
+	Scalar r_dot_z = 0;
+	if (is_inner_cell(position)) {
+		const int index = AT_POS(position);
+		const Scalar residual = alpha * LOAD_SCALAR(b, index);
+		const Scalar preconditioned = 0.25f * residual;
+
+		STORE_SCALAR(r, index, residual);
+		STORE_SCALAR(z, index, preconditioned);
+		STORE_SCALAR(d, index, preconditioned);
+		r_dot_z = residual * preconditioned;
+	}
+
+	store_group_sum(r_dot_z, partial_sums, scratch);
+}
+
+kernel void cg_apply_operator(const GlobalScalarField d, GlobalScalarField q, global Scalar* partial_sums, local Scalar* scratch)
+{
+	const Point position = getPosition();
+
+	Scalar d_dot_q = 0;
+	if (is_inner_cell(position)) {
+		const int index = AT_POS(position);
+		const Scalar d_center = LOAD_SCALAR(d, index);
+
+		const Scalar d_left = neumann_neighbour(d, position.x - 1, position.y, d_center);
+		const Scalar d_right = neumann_neighbour(d, position.x + 1, position.y, d_center);
+		const Scalar d_top = neumann_neighbour(d, position.x, position.y + 1, d_center);
+		const Scalar d_bottom = neumann_neighbour(d, position.x, position.y - 1, d_center);
+
+		const Scalar q_center = 4 * d_center - (d_left + d_right + d_top + d_bottom);
+		STORE_SCALAR(q, index, q_center);
+		d_dot_q = d_center * q_center;
+	}
+
+	store_group_sum(d_dot_q, partial_sums, scratch);
+}
+
+kernel void cg_update_solution(GlobalScalarField x, GlobalScalarField r, GlobalScalarField z, const GlobalScalarField d, const GlobalScalarField q,
+			       const global Scalar* results, const uint rho_index, const uint d_dot_q_index, global Scalar* partial_sums, local Scalar* scratch)
+{
+	const Point position = getPosition();
+	const Scalar step = safe_ratio(results[rho_index], results[d_dot_q_index]);
+
+	Scalar r_dot_z = 0;
+	if (is_inner_cell(position)) {
+		const int index = AT_POS(position);
+		STORE_SCALAR(x, index, LOAD_SCALAR(x, index) + step * LOAD_SCALAR(d, index));
+
+		const Scalar residual = LOAD_SCALAR(r, index) - step * LOAD_SCALAR(q, index);
+		const Scalar preconditioned = 0.25f * residual;
+		STORE_SCALAR(r, index, residual);
+		STORE_SCALAR(z, index, preconditioned);
+		r_dot_z = residual * preconditioned;
+	}
+
+	store_group_sum(r_dot_z, partial_sums, scratch);
+}
+
+kernel void cg_update_direction(const GlobalScalarField z, GlobalScalarField d, const global Scalar* results, const uint rho_index, const uint previous_rho_index)
+{
+	const Point position = getPosition();
+	if (!is_inner_cell(position)) {
+		return;
+	}
+
+	const Scalar beta = safe_ratio(results[rho_index], results[previous_rho_index]);
+	const int index = AT_POS(position);
+	STORE_SCALAR(d, index, LOAD_SCALAR(z, index) + beta * LOAD_SCALAR(d, index));
+}
+
+kernel void divergence(const GlobalVectorField w, GlobalScalarField divergence_w_out, const Scalar halved_reverse_dx)
+{
+	const Point position = getPosition();
+
+	VECTOR_TILE(tile);
+	const VectorStencil w_stencil = load_vector_stencil(w, tile);
+	if (!is_inner_cell(position)) {
+		return;
+	}
+
+	STORE_SCALAR(divergence_w_out, AT_POS(position), halved_reverse_dx * (w_stencil.right.x - w_stencil.left.x + w_stencil.top.y - w_stencil.bottom.y));
 }
 
 kernel void gradient(const GlobalScalarField p, GlobalVectorField gradient_p_out, const Scalar halved_reverse_dx)
@@ -155,82 +814,160 @@ kernel void gradient(const GlobalScalarField p, GlobalVectorField gradient_p_out
 	const Point position = getPosition();
 	const int index = AT_POS(position);
 
-	const Scalar p_left = p[AT(position.x - 1, position.y)];
-	const Scalar p_right = p[AT(position.x + 1, position.y)];
-	const Scalar p_top = p[AT(position.x, position.y + 1)];
-	const Scalar p_bottom = p[AT(position.x, position.y - 1)];
+	SCALAR_TILE(tile);
+	const ScalarStencil p_stencil = load_scalar_stencil(p, tile);
+	if (!is_inner_cell(position)) {
+		return;
+	}
 
-	gradient_p_out[index].x = p_right - p_left;
-	gradient_p_out[index].y = p_top - p_bottom;
+	const Vector gradient_p = {p_stencil.right - p_stencil.left, p_stencil.top - p_stencil.bottom};
+	STORE_VECTOR(gradient_p_out, index, gradient_p);
 }
 
 kernel void subtract_gradient_p(const GlobalVectorField w, const GlobalVectorField gradient_p, GlobalVectorField u_out)
 {
 	const Point position = getPosition();
+	if (!is_inner_cell(position)) {
+		return;
+	}
+
 	const int index = AT_POS(position);
 
-	u_out[index] = w[index] - gradient_p[index];
+	STORE_VECTOR(u_out, index, LOAD_VECTOR(w, index) - LOAD_VECTOR(gradient_p, index));
 }
 
-kernel void vector_boundary_condition(GlobalVectorField field, const Point offset)
+//Boundary kernels are launched once over the whole perimeter: the bottom and top edges of SIZE_X - 2 cells,
+//the left and right edges of SIZE_Y - 2 cells, followed by the 4 corners. Returns the boundary cell of the
+//work-item and sets offset to its inner neighbour, corners use their diagonal neighbour.
+inline Point getBoundaryPosition(Point* offset)
 {
-	const Point position = getPosition();
+	const int row_cell_count = SIZE_X - 2;
+	const int column_cell_count = SIZE_Y - 2;
+	int id = get_global_id(0);
+
+	Point position;
+	if (id < 2 * row_cell_count) {
+		const bool top = id >= row_cell_count;
+		position.x = id % row_cell_count + 1;
+		position.y = top ? SIZE_Y - 1 : 0;
+		offset->x = 0; offset->y = top ? -1 : 1;
+		return position;
+	}
+
+	id -= 2 * row_cell_count;
+	if (id < 2 * column_cell_count) {
+		const bool right = id >= column_cell_count;
+		position.x = right ? SIZE_X - 1 : 0;
+		position.y = id % column_cell_count + 1;
+		offset->x = right ? -1 : 1; offset->y = 0;
+		return position;
+	}
+
+	const int corner = id - 2 * column_cell_count;
+	position.x = (corner & 1) ? SIZE_X - 1 : 0;
+	position.y = (corner & 2) ? SIZE_Y - 1 : 0;
+	offset->x = position.x == 0 ? 1 : -1;
+	offset->y = position.y == 0 ? 1 : -1;
+	return position;
+}
+
+kernel void vector_boundary_condition(GlobalVectorField field)
+{
+	Point offset;
+	const Point position = getBoundaryPosition(&offset);
 	const Point position_offset = position + offset;
 
-	field[AT_POS(position)] = -field[AT_POS(position_offset)];
+	STORE_VECTOR(field, AT_POS(position), -LOAD_VECTOR(field, AT_POS(position_offset)));
 }
 
-kernel void scalar_boundary_condition(GlobalScalarField field, const Point offset)
+kernel void scalar_boundary_condition(GlobalScalarField field)
 {
-	const Point position = getPosition();
+	Point offset;
+	const Point position = getBoundaryPosition(&offset);
 	const Point position_offset = position + offset;
 
-	field[AT_POS(position)] = field[AT_POS(position_offset)];
+	STORE_SCALAR(field, AT_POS(position), LOAD_SCALAR(field, AT_POS(position_offset)));
 }
 
-kernel void apply_impulse(GlobalVectorField w, const Point impulse_position, const Vector force, const Scalar impulse_range, const Scalar dt)
+static constant const Vector GRAVITY = {0.0, 0.000};
+
+kernel void apply_gravity(GlobalVectorField w)
 {
 	const Point position = getPosition();
+	if (!is_inner_cell(position)) {
+		return;
+	}
+
+	STORE_VECTOR(w, AT_POS(position), LOAD_VECTOR(w, AT_POS(position)) + GRAVITY);
+}
 
-	int dist_from_impulse_squared = pown((Scalar)(position.x - impulse_position.x), 2) + pown((Scalar)(position.y - impulse_position.y), 2);
+//A point source of force and dye, has the same layout as Source in typedefs.h
+typedef struct {
+	Point position;
+	Vector force;
+	Scalar dye;
+	Scalar range;
+} Source;
 
-	w[AT_POS(position)] += 100 * force * dt * exp(-dist_from_impulse_squared / pown(impulse_range, 2));
+//Gaussian falloff of a source at position, cut off past cutoff_ranges * range, where it's negligible
+inline Scalar source_falloff(const Source source, const Point position, const Scalar cutoff_ranges)
+{
+	const Scalar dx = position.x - source.position.x;
+	const Scalar dy = position.y - source.position.y;
+	const Scalar distance_squared = dx * dx + dy * dy;
+	const Scalar range_squared = source.range * source.range;
+
+	if (distance_squared >= cutoff_ranges * cutoff_ranges * range_squared) {
+		return 0;
+	}
+	return exp(-distance_squared / range_squared);
 }
 
-kernel void apply_gravity(GlobalVectorField w)
+//Source kernels are launched over the bounding box of the cells within reach of any of the sources,
+//each work-item sums the contributions of all sources to its cell
+kernel void apply_force_sources(GlobalVectorField w, global const Source* sources, const uint source_count, const Scalar cutoff_ranges, const Scalar dt)
 {
 	const Point position = getPosition();
-	const Vector gravity = {0.0, 0.000};
-	w[AT_POS(position)] += gravity;
+
+	Vector force = {0, 0};
+	for (uint i = 0; i < source_count; ++i) {
+		force += 100 * sources[i].force * dt * source_falloff(sources[i], position, cutoff_ranges);
+	}
+
+	STORE_VECTOR(w, AT_POS(position), LOAD_VECTOR(w, AT_POS(position)) + force);
 }
 
-kernel void add_dye(GlobalScalarField dye, const Point impulse_position, const Scalar dye_change, const Scalar impulse_range, const Scalar dt)
+kernel void add_dye_sources(GlobalScalarField dye, global const Source* sources, const uint source_count, const Scalar cutoff_ranges, const Scalar dt)
 {
 	const Point position = getPosition();
 
-	int dist_from_impulse_squared = pown((Scalar)(position.x - impulse_position.x), 2) + pown((Scalar)(position.y - impulse_position.y), 2);
+	Scalar dye_change = 0;
+	for (uint i = 0; i < source_count; ++i) {
+		dye_change += sources[i].dye * dt * source_falloff(sources[i], position, cutoff_ranges);
+	}
 
-	dye[AT_POS(position)] += dye_change * dt * exp(-dist_from_impulse_squared / pown(impulse_range, 2));
+	STORE_SCALAR(dye, AT_POS(position), LOAD_SCALAR(dye, AT_POS(position)) + dye_change);
 }
 
-kernel void apply_dye_boundary_conditions(GlobalScalarField dye, const Point offset)
+kernel void apply_dye_boundary_conditions(GlobalScalarField dye)
 {
-	const Point position = getPosition();
+	Point offset;
+	const Point position = getBoundaryPosition(&offset);
 
-	dye[AT_POS(position)] = 0.0;
+	STORE_SCALAR(dye, AT_POS(position), 0.0);
 }
 
 kernel void vorticity(GlobalVectorField w, GlobalScalarField vorticity, Scalar halved_reverse_dx)
 {
 	const Point position = getPosition();
-	const int index = AT_POS(position);
 
-	const Vector w_left = w[AT(position.x - 1, position.y)];
-	const Vector w_right = w[AT(position.x + 1, position.y)];
-	const Vector w_top = w[AT(position.x, position.y + 1)];
-	const Vector w_bottom = w[AT(position.x, position.y - 1)];
+	VECTOR_TILE(tile);
+	const VectorStencil w_stencil = load_vector_stencil(w, tile);
+	if (!is_inner_cell(position)) {
+		return;
+	}
 
-	vorticity[AT_POS(position)] = halved_reverse_dx * ((w_right.y - w_left.y) - (w_top.x - w_bottom.x));
+	STORE_SCALAR(vorticity, AT_POS(position), halved_reverse_dx * ((w_stencil.right.y - w_stencil.left.y) - (w_stencil.top.x - w_stencil.bottom.x)));
 }
 
 static constant const Scalar EPSILON = 2.4414e-4; //2^-12
@@ -241,15 +978,16 @@ kernel void apply_voritcity_force(GlobalScalarField vorticity, GlobalVectorField
 	const Point position = getPosition();
 	const int index = AT_POS(position);
 
-	const Scalar v_left = vorticity[AT(position.x - 1, position.y)];
-	const Scalar v_right = vorticity[AT(position.x + 1, position.y)];
-	const Scalar v_top = vorticity[AT(position.x, position.y + 1)];
-	const Scalar v_bottom = vorticity[AT(position.x, position.y - 1)];
+	SCALAR_TILE(tile);
+	const ScalarStencil v_stencil = load_scalar_stencil(vorticity, tile);
+	if (!is_inner_cell(position)) {
+		return;
+	}
 
-	const Scalar v_center = vorticity[index];
+	const Scalar v_center = v_stencil.center;
 
-	Scalar force_x = fabs(v_top) - fabs(v_bottom);
-	Scalar force_y = fabs(v_right) - fabs(v_left);
+	Scalar force_x = fabs(v_stencil.top) - fabs(v_stencil.bottom);
+	Scalar force_y = fabs(v_stencil.right) - fabs(v_stencil.left);
 
 	Vector force = {force_x, force_y};
 	Scalar mag_squared = max(EPSILON, dot(force, force));
@@ -257,5 +995,220 @@ kernel void apply_voritcity_force(GlobalScalarField vorticity, GlobalVectorField
 
 	force *= vorticity_dx_scale * v_center * (Vector)(1, -1);
 
-	w_out[index] += time_step * force;
+	//w_out doesn't hold the current velocity after the in-place solvers, so the force is added to w
+	STORE_VECTOR(w_out, index, LOAD_VECTOR(w, index) + time_step * force);
+}
+
+
+//Multigrid kernels operate on grids of any size (the row length is passed as an argument), so that the same
+//kernels can be used on every level of the hierarchy, including the finest one
+
+kernel void multigrid_smooth(const GlobalScalarField x, const GlobalScalarField b, GlobalScalarField x_out, const uint width, const Scalar alpha, const Scalar weight)
+{
+	const Point position = getPosition();
+	const size_t index = AT_SIZED(position.x, position.y, width);
+
+	const Scalar x_left = LOAD_SCALAR(x, AT_SIZED(position.x - 1, position.y, width));
+	const Scalar x_right = LOAD_SCALAR(x, AT_SIZED(position.x + 1, position.y, width));
+	const Scalar x_top = LOAD_SCALAR(x, AT_SIZED(position.x, position.y + 1, width));
+	const Scalar x_bottom = LOAD_SCALAR(x, AT_SIZED(position.x, position.y - 1, width));
+
+	const Scalar jacobi = (x_left + x_right + x_top + x_bottom + alpha * LOAD_SCALAR(b, index)) * 0.25f;
+	STORE_SCALAR(x_out, index, mix(LOAD_SCALAR(x, index), jacobi, weight));
+}
+
+kernel void multigrid_residual(const GlobalScalarField x, const GlobalScalarField b, GlobalScalarField residual_out, const uint width, const Scalar reverse_h_squared)
+{
+	const Point position = getPosition();
+	const size_t index = AT_SIZED(position.x, position.y, width);
+
+	const Scalar x_left = LOAD_SCALAR(x, AT_SIZED(position.x - 1, position.y, width));
+	const Scalar x_right = LOAD_SCALAR(x, AT_SIZED(position.x + 1, position.y, width));
+	const Scalar x_top = LOAD_SCALAR(x, AT_SIZED(position.x, position.y + 1, width));
+	const Scalar x_bottom = LOAD_SCALAR(x, AT_SIZED(position.x, position.y - 1, width));
+
+	const Scalar laplacian = (x_left + x_right + x_top + x_bottom - 4 * LOAD_SCALAR(x, index)) * reverse_h_squared;
+	STORE_SCALAR(residual_out, index, LOAD_SCALAR(b, index) - laplacian);
+}
+
+//Each coarse cell covers 2x2 fine cells, the restricted value is their average
+kernel void multigrid_restrict(const GlobalScalarField fine, GlobalScalarField coarse_out, const uint fine_width, const uint coarse_width)
+{
+	const Point position = getPosition();
+	const int fine_x = 2 * position.x - 1;
+	const int fine_y = 2 * position.y - 1;
+
+	const Scalar sum = LOAD_SCALAR(fine, AT_SIZED(fine_x, fine_y, fine_width)) + LOAD_SCALAR(fine, AT_SIZED(fine_x + 1, fine_y, fine_width))
+			 + LOAD_SCALAR(fine, AT_SIZED(fine_x, fine_y + 1, fine_width)) + LOAD_SCALAR(fine, AT_SIZED(fine_x + 1, fine_y + 1, fine_width));
+
+	STORE_SCALAR(coarse_out, AT_SIZED(position.x, position.y, coarse_width), 0.25f * sum);
+}
+
+//Bilinear interpolation of the coarse grid correction, the coarse grid boundary cells (including corners)
+//have to be up to date, because the fine cells next to the boundary interpolate from them
+kernel void multigrid_prolongate(const GlobalScalarField coarse, GlobalScalarField fine_out, const uint coarse_width, const uint fine_width)
+{
+	const Point position = getPosition();
+	const int coarse_x = (position.x + 1) / 2;
+	const int coarse_y = (position.y + 1) / 2;
+	//Odd fine cells lie in the left/bottom half of the coarse cell, so the second closest coarse cell
+	//is the previous one
+	const int neighbour_x = (position.x % 2) ? coarse_x - 1 : coarse_x + 1;
+	const int neighbour_y = (position.y % 2) ? coarse_y - 1 : coarse_y + 1;
+
+	const Scalar correction = 0.5625f * LOAD_SCALAR(coarse, AT_SIZED(coarse_x, coarse_y, coarse_width))
+				+ 0.1875f * LOAD_SCALAR(coarse, AT_SIZED(neighbour_x, coarse_y, coarse_width))
+				+ 0.1875f * LOAD_SCALAR(coarse, AT_SIZED(coarse_x, neighbour_y, coarse_width))
+				+ 0.0625f * LOAD_SCALAR(coarse, AT_SIZED(neighbour_x, neighbour_y, coarse_width));
+
+	STORE_SCALAR(fine_out, AT_SIZED(position.x, position.y, fine_width), LOAD_SCALAR(fine_out, AT_SIZED(position.x, position.y, fine_width)) + correction);
+}
+
+//Launched over the longer of an inner row and an inner column, each work-item updates one cell on each of
+//the four edges
+kernel void multigrid_boundary_condition(GlobalScalarField field, const uint width, const uint height)
+{
+	const int i = get_global_id(0);
+	const int last_x = width - 1;
+	const int last_y = height - 1;
+
+	if (i < last_y) {
+		STORE_SCALAR(field, AT_SIZED(0, i, width), LOAD_SCALAR(field, AT_SIZED(1, i, width)));
+		STORE_SCALAR(field, AT_SIZED(last_x, i, width), LOAD_SCALAR(field, AT_SIZED(last_x - 1, i, width)));
+	}
+	if (i < last_x) {
+		STORE_SCALAR(field, AT_SIZED(i, 0, width), LOAD_SCALAR(field, AT_SIZED(i, 1, width)));
+		STORE_SCALAR(field, AT_SIZED(i, last_y, width), LOAD_SCALAR(field, AT_SIZED(i, last_y - 1, width)));
+	}
+
+	if (i == 1) {
+		STORE_SCALAR(field, AT_SIZED(0, 0, width), LOAD_SCALAR(field, AT_SIZED(1, 1, width)));
+		STORE_SCALAR(field, AT_SIZED(last_x, 0, width), LOAD_SCALAR(field, AT_SIZED(last_x - 1, 1, width)));
+		STORE_SCALAR(field, AT_SIZED(0, last_y, width), LOAD_SCALAR(field, AT_SIZED(1, last_y - 1, width)));
+		STORE_SCALAR(field, AT_SIZED(last_x, last_y, width), LOAD_SCALAR(field, AT_SIZED(last_x - 1, last_y - 1, width)));
+	}
+}
+
+
+//Fused kernels, each one does the work of several of the kernels above in a single pass over the fields
+
+//advect_vector of the velocity, advect_scalar of the dye and apply_gravity, the departure point is shared
+kernel void advect_velocity_and_dye(const GlobalVectorField u, GlobalVectorField w_out, const GlobalScalarField dye, GlobalScalarField dye_out,
+				    const Scalar dx_reversed, const Scalar time_step, const Vector velocity_dissipation, const Scalar dye_dissipation)
+{
+	const Point position = getPosition();
+	if (!is_inner_cell(position)) {
+		return;
+	}
+
+	const int index = AT_POS(position);
+
+	const Vector old_position = time_step * dx_reversed * LOAD_VECTOR(u, index);
+	Vector vec_pos = {position.x, position.y};
+	vec_pos -= old_position;
+
+	STORE_VECTOR(w_out, index, bilinear_interpolation_vector(u, vec_pos) * velocity_dissipation + GRAVITY);
+	STORE_SCALAR(dye_out, index, bilinear_interpolation_scalar(dye, vec_pos) * dye_dissipation);
+}
+
+inline Scalar vorticity_at(const GlobalVectorField w, const int x, const int y, const Scalar halved_reverse_dx)
+{
+	if (x < 1 || y < 1 || x > SIZE_X - 2 || y > SIZE_Y - 2) {
+		return 0;
+	}
+
+	const Vector w_left = LOAD_VECTOR(w, AT(x - 1, y));
+	const Vector w_right = LOAD_VECTOR(w, AT(x + 1, y));
+	const Vector w_top = LOAD_VECTOR(w, AT(x, y + 1));
+	const Vector w_bottom = LOAD_VECTOR(w, AT(x, y - 1));
+
+	return halved_reverse_dx * ((w_right.y - w_left.y) - (w_top.x - w_bottom.x));
+}
+
+//vorticity and apply_voritcity_force, the vorticity of the neighbours is recomputed instead of being stored,
+//it is 0 on the boundary
+kernel void vorticity_confinement(const GlobalVectorField w, GlobalVectorField w_out, const Scalar halved_reverse_dx, const Scalar time_step, const Vector vorticity_dx_scale)
+{
+	const Point position = getPosition();
+	if (!is_inner_cell(position)) {
+		return;
+	}
+
+	const int index = AT_POS(position);
+
+	const Scalar v_center = vorticity_at(w, position.x, position.y, halved_reverse_dx);
+	const Scalar v_left = vorticity_at(w, position.x - 1, position.y, halved_reverse_dx);
+	const Scalar v_right = vorticity_at(w, position.x + 1, position.y, halved_reverse_dx);
+	const Scalar v_top = vorticity_at(w, position.x, position.y + 1, halved_reverse_dx);
+	const Scalar v_bottom = vorticity_at(w, position.x, position.y - 1, halved_reverse_dx);
+
+	Vector force = {fabs(v_top) - fabs(v_bottom), fabs(v_right) - fabs(v_left)};
+	Scalar mag_squared = max(EPSILON, dot(force, force));
+	force *= rsqrt(mag_squared);
+
+	force *= vorticity_dx_scale * v_center * (Vector)(1, -1);
+
+	STORE_VECTOR(w_out, index, LOAD_VECTOR(w, index) + time_step * force);
+}
+
+//gradient and subtract_gradient_p
+kernel void subtract_pressure_gradient(const GlobalVectorField w, const GlobalScalarField p, GlobalVectorField u_out)
+{
+	const Point position = getPosition();
+	const int index = AT_POS(position);
+
+	SCALAR_TILE(tile);
+	const ScalarStencil p_stencil = load_scalar_stencil(p, tile);
+	if (!is_inner_cell(position)) {
+		return;
+	}
+
+	const Vector gradient_p = {p_stencil.right - p_stencil.left, p_stencil.top - p_stencil.bottom};
+
+	STORE_VECTOR(u_out, index, LOAD_VECTOR(w, index) - gradient_p);
+}
+
+
+//Visualization kernels map a field through a colormap of packed ARGB8888 pixels into a display ready frame,
+//values from min to max are spread over the whole colormap. They're launched over all cells, boundary included.
+
+inline uint colormap_lookup(const Scalar value, global const uint* colormap, const uint colormap_size, const Scalar min, const Scalar max)
+{
+	const Scalar last_index = colormap_size - 1;
+	const Scalar index = clamp((value - min) * last_index / (max - min), 0.0f, last_index);
+	return colormap[(uint)(index + 0.5f)];
+}
+
+kernel void visualize_scalar(const GlobalScalarField field, global uint* pixels, global const uint* colormap, const uint colormap_size, const Scalar min, const Scalar max)
+{
+	const Point position = getPosition();
+	const int index = AT_POS(position);
+
+	pixels[index] = colormap_lookup(LOAD_SCALAR(field, index), colormap, colormap_size, min, max);
+}
+
+kernel void visualize_speed(const GlobalVectorField u, global uint* pixels, global const uint* colormap, const uint colormap_size, const Scalar min, const Scalar max)
+{
+	const Point position = getPosition();
+	const int index = AT_POS(position);
+
+	pixels[index] = colormap_lookup(length(LOAD_VECTOR(u, index)), colormap, colormap_size, min, max);
+}
+
+kernel void visualize_vorticity(const GlobalVectorField u, global uint* pixels, global const uint* colormap, const uint colormap_size, const Scalar min, const Scalar max,
+				const Scalar halved_reverse_dx)
+{
+	const Point position = getPosition();
+	const Scalar vorticity = vorticity_at(u, position.x, position.y, halved_reverse_dx);
+
+	pixels[AT_POS(position)] = colormap_lookup(vorticity, colormap, colormap_size, min, max);
+}
+
+//Converts a field to floats for the host, launched over all cells like the visualization kernels
+kernel void unpack_scalar_field(const GlobalScalarField field, global Scalar* out)
+{
+	const Point position = getPosition();
+	const int index = AT_POS(position);
+
+	out[index] = LOAD_SCALAR(field, index);
 }
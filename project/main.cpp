@@ -17,65 +17,228 @@
  * 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
  */
 
+#include <algorithm>
 #include <iostream>
+#include <memory>
+#include <stdexcept>
+#include <string>
 #include <vector>
-#include <fstream>
+#include "config.h"
+#include "decomposition.h"
+#include "native_simulation.h"
+#include "program.h"
 #include "simulation.h"
+#include "snapshot.h"
+#include "trace.h"
 #include "mainwindow.h"
 #include "thread"
 #include "atomic"
 
 std::atomic<bool> running {true};
 
-static auto load_program(const cl::Context& context, const size_t size)
+static void ui_main(Mailbox_ptr<PixelField> frames_to_ui, Channel_ptr<Event> events_from_ui, cl_uint cells_x, cl_uint cells_y)
 {
-	std::ifstream kernels_file("kernels/kernels.cl");
-	std::string kernel_sources {"#define SIZE "};
-	kernel_sources.append(std::to_string(size));
-	std::copy(std::istreambuf_iterator<char>(kernels_file), std::istreambuf_iterator<char>(),
-		  std::back_inserter(kernel_sources));
+	// The longer side of the grid spans the whole window
+	const int window_size = 640;
+	const int window_x = window_size * cells_x / std::max(cells_x, cells_y);
+	const int window_y = window_size * cells_y / std::max(cells_x, cells_y);
 
-	return cl::Program(context, kernel_sources);
-}
-
-static void ui_main(Channel_ptr<ScalarField> dye_field_to_ui, Channel_ptr<Event> events_from_ui, cl_uint dim)
-{
 	SDL_Init(SDL_INIT_EVERYTHING);
-	MainWindow window{640, 640, dim, dye_field_to_ui, events_from_ui};
+	MainWindow window{window_x, window_y, cells_x, cells_y, frames_to_ui, events_from_ui};
 	window.event_loop();
 	SDL_Quit();
 }
 
-int main()
+//Devices of the slabs, the first ones of the platform or sub-devices of the first one if there are too few
+static std::vector<cl::Device> slab_devices(const Config& config, std::vector<cl::Device> devices)
 {
-	auto dye_field_to_ui = Channel<ScalarField>::make();
+	if (devices.size() >= config.slabs) {
+		devices.resize(config.slabs);
+		return devices;
+	}
+
+	std::vector<cl::Device> sub_devices;
+	if (config.partition == DevicePartition::NUMA) {
+		const cl_device_partition_property properties[] {CL_DEVICE_PARTITION_BY_AFFINITY_DOMAIN, CL_DEVICE_AFFINITY_DOMAIN_NUMA, 0};
+		devices[0].createSubDevices(properties, &sub_devices);
+	} else {
+		const cl_uint compute_units = devices[0].getInfo<CL_DEVICE_MAX_COMPUTE_UNITS>() / config.slabs;
+		if (compute_units == 0) {
+			throw std::runtime_error{"The device has fewer compute units than slabs"};
+		}
+		const cl_device_partition_property properties[] {CL_DEVICE_PARTITION_EQUALLY, compute_units, 0};
+		devices[0].createSubDevices(properties, &sub_devices);
+	}
+
+	if (sub_devices.size() < config.slabs) {
+		throw std::runtime_error{"The device can't be split into " + std::to_string(config.slabs) + " sub-devices"};
+	}
+	sub_devices.resize(config.slabs);
+	return sub_devices;
+}
+
+template<typename SimulationType>
+static void run_simulation(SimulationType& simulation, unsigned long headless_steps)
+{
+	if (headless_steps != 0) {
+		for (unsigned long step = 0; step < headless_steps; ++step) {
+			simulation.update();
+		}
+		return;
+	}
+
+	while (running.load(std::memory_order_relaxed)) {
+		simulation.update();
+	}
+}
+
+int main(int argc, char** argv)
+{
+	Config config;
+	std::unique_ptr<Snapshot> restart;
+	std::shared_ptr<const EventTrace> replay;
+	try {
+		parse_command_line(config, argc, argv);
+		// A restarted simulation keeps the grid and the physical parameters it was saved with
+		if (not config.restart_path.empty()) {
+			restart.reset(new Snapshot{config.restart_path});
+			config.simulation = restart->parameters();
+		}
+		// A replay runs headless until the end of the trace, unless the step count is given, with the grid and
+		// the physical parameters it was recorded with
+		if (not config.replay_path.empty()) {
+			replay = std::make_shared<EventTrace>(config.replay_path);
+			const auto recorded = settings_parameters(replay->settings());
+			if (restart and parameter_settings(recorded) != parameter_settings(config.simulation)) {
+				throw std::invalid_argument{"the trace was recorded with other parameters than the snapshot's"};
+			}
+			config.simulation = recorded;
+			const cl_ulong first_step = restart ? restart->step() : 0;
+			if (replay->last_step() <= first_step) {
+				throw std::invalid_argument{"the trace ends before the simulation starts"};
+			}
+			if (config.headless_steps == 0) {
+				config.headless_steps = replay->last_step() - first_step;
+			}
+		}
+		const bool single_device_only = not config.checkpoint_path.empty() or restart or not config.recording_path.empty()
+						or not config.event_trace_path.empty() or replay;
+		if (single_device_only and (config.backend == Backend::NATIVE or config.slabs > 1)) {
+			throw std::invalid_argument{"checkpoints, restarts, recordings and event traces need the opencl backend without slabs"};
+		}
+		if (config.slabs > 1 and not config.profile_prefix.empty()) {
+			throw std::invalid_argument{"profiling isn't supported with slabs"};
+		}
+		if (config.backend == Backend::NATIVE and (config.slabs > 1 or not config.profile_prefix.empty()
+							    or config.simulation.storage != FieldStorage::FLOAT)) {
+			throw std::invalid_argument{"slabs, profiling and 16-bit storage need the opencl backend"};
+		}
+		adapt_to_backend(config);
+	} catch (const std::exception& error) {
+		std::cerr << error.what() << std::endl;
+		print_config_usage(std::cerr, argv[0]);
+		return 1;
+	}
+
+	// Headless runs a fixed number of updates without the UI, e.g. on servers without a display.
+	// Profiling records every command, the profile is dumped with the P key or at the end of a headless run.
+	const bool headless = config.headless_steps != 0;
+	std::shared_ptr<Profiler> profiler;
+	if (not config.profile_prefix.empty()) {
+		profiler = std::make_shared<Profiler>(config.profile_prefix);
+	}
+
+	const auto& parameters = config.simulation;
+	auto frames_to_ui = Mailbox<PixelField>::make();
 	auto events_from_ui = Channel<Event>::make();
-	cl_uint dim = 512 + 2;
-	const auto workgroup_size = std::min(dim - 2, 256u);
-	std::thread ui_thread{ui_main, dye_field_to_ui, events_from_ui, dim};
+	std::thread ui_thread;
+	if (not headless) {
+		ui_thread = std::thread{ui_main, frames_to_ui, events_from_ui, parameters.cells_x, parameters.cells_y};
+	}
+
+	// The native backend doesn't need an OpenCL platform at all
+	if (config.backend == Backend::NATIVE) {
+		NativeSimulation simulation{parameters, frames_to_ui, events_from_ui, config.threads};
+		configure_simulation(config, simulation);
+		run_simulation(simulation, config.headless_steps);
+		if (not headless) {
+			ui_thread.join();
+		}
+		return 0;
+	}
 
 	std::vector<cl::Platform> platforms;
 	std::vector<cl::Device> devices;
+	int exit_code = 0;
 
 	cl::Platform::get(&platforms);
-	platforms[0].getDevices(CL_DEVICE_TYPE_CPU, &devices);
+	platforms[0].getDevices(config.device_type, &devices);
 
-	cl::Context context{devices};
-	cl::CommandQueue cmd_queue{context, devices[0]};
+	if (config.slabs > 1) {
+		// Each slab has its own queue, one context lets the queues copy the halos between the slabs' buffers
+		devices = slab_devices(config, devices);
+		cl::Context context{devices};
+		std::vector<cl::CommandQueue> cmd_queues;
+		for (auto& device : devices) {
+			cmd_queues.emplace_back(context, device);
+		}
 
-	auto program = load_program(context, dim);
-	try {
-		program.build(devices);
-	} catch(...) {
-		std::cout << program.getBuildInfo<CL_PROGRAM_BUILD_LOG>(devices[0]) << std::endl;
-		throw;
-	}
+		ProgramCache programs{context, devices, config.binary_cache_directory};
+		SlabbedSimulation simulation{context, cmd_queues, parameters, programs, frames_to_ui, events_from_ui,
+					     config.workgroup_size, config.halo_rows, config.halo_overlap};
+		configure_simulation(config, simulation);
+		run_simulation(simulation, config.headless_steps);
+		for (auto& cmd_queue : cmd_queues) {
+			cmd_queue.finish();
+		}
+	} else {
+		cl::Context context{devices};
+		cl::CommandQueue cmd_queue{context, devices[0], profiler ? CL_QUEUE_PROFILING_ENABLE : cl_command_queue_properties{0}};
 
-	Simulation simulation{cmd_queue, context, dim, program, dye_field_to_ui, events_from_ui, workgroup_size};
-	while (running.load(std::memory_order_relaxed)) {
-		simulation.update();
+		ProgramCache programs{context, devices, config.binary_cache_directory};
+		const auto& program = programs.get(parameters.cells_x, parameters.cells_y, parameters.storage);
+
+		Simulation simulation{cmd_queue, context, parameters, program, frames_to_ui, events_from_ui, config.workgroup_size};
+		configure_simulation(config, simulation);
+		simulation.set_profiler(profiler);
+		if (restart) {
+			simulation.load_snapshot(*restart);
+			restart.reset();
+		}
+		if (not config.checkpoint_path.empty()) {
+			simulation.set_checkpoints(config.checkpoint_path, config.checkpoint_interval);
+		}
+		if (not config.recording_path.empty()) {
+			std::unique_ptr<FieldRecorder> recorder{new FieldRecorder{config.recording_path, parameters.cells_x, parameters.cells_y,
+										 parameters.storage, Simulation::recorded_fields(),
+										 config.recording_codec, Simulation::recording_slot_count}};
+			simulation.set_recorder(std::move(recorder), config.recording_interval);
+		}
+		if (replay) {
+			simulation.apply_trace_settings(replay->settings());
+			simulation.set_replay(replay);
+		}
+		if (not config.event_trace_path.empty()) {
+			simulation.set_event_recording(std::make_shared<EventTraceWriter>(config.event_trace_path, simulation.trace_settings()),
+						       config.checksum_interval);
+		}
+		run_simulation(simulation, config.headless_steps);
+		if (replay) {
+			std::cerr << "Replayed up to update " << simulation.step() << ", " << simulation.checksum_mismatches()
+				  << " checksum mismatches" << std::endl;
+			exit_code = simulation.checksum_mismatches() == 0 ? 0 : 1;
+		}
+		if (not config.checkpoint_path.empty()) {
+			simulation.save_snapshot(config.checkpoint_path);
+		}
+		cmd_queue.finish();
+		if (profiler and headless) {
+			profiler->dump(std::cerr);
+		}
 	}
 
-	ui_thread.join();
-	return 0;
+	if (not headless) {
+		ui_thread.join();
+	}
+	return exit_code;
 }
@@ -40,30 +40,54 @@ struct DestroyRenderer
 	}
 };
 
+struct DestroyTexture
+{
+	void operator()(SDL_Texture* texture) const {
+		SDL_DestroyTexture(texture);
+	}
+};
+
 class MainWindow
 {
 	std::unique_ptr<SDL_Window, DestroyWindow> window;
 	std::unique_ptr<SDL_Renderer, DestroyRenderer> renderer;
-	uint cells;
-	uint pixels_per_cell;
+	std::unique_ptr<SDL_Texture, DestroyTexture> texture; //one texel per cell, scaled to the window when drawn
+	uint cells_x;
+	uint cells_y;
+	float pixels_per_cell;
 	SDL_Rect boundary_rect;
-	ScalarField field;
-	Channel_ptr<ScalarField> dye_field_to_ui;
+	Mailbox_ptr<PixelField> frames_to_ui;
 	Channel_ptr<Event> events_from_ui;
+	std::deque<Event> unsent_events; //pushed again on the next iteration of the event loop, if the channel was full
 	bool left_mouse_button_pressed {false};
 public:
-	MainWindow(int size_x, int size_y, uint cells, Channel_ptr<ScalarField> dye_field_to_ui, Channel_ptr<Event> events_from_ui):
+	MainWindow(int size_x, int size_y, uint cells_x, uint cells_y, Mailbox_ptr<PixelField> frames_to_ui, Channel_ptr<Event> events_from_ui):
 		window(SDL_CreateWindow("Window", 0, 0, size_x, size_y, SDL_WINDOW_SHOWN/* | SDL_WINDOW_FULLSCREEN*/)),
 		renderer(SDL_CreateRenderer(window.get(), -1, SDL_RENDERER_ACCELERATED | SDL_RENDERER_PRESENTVSYNC)),
-		cells(cells),
-		pixels_per_cell(std::min(size_x, size_y) / cells),
-		dye_field_to_ui(dye_field_to_ui),
+		texture(SDL_CreateTexture(renderer.get(), SDL_PIXELFORMAT_ARGB8888, SDL_TEXTUREACCESS_STREAMING, cells_x, cells_y)),
+		cells_x(cells_x),
+		cells_y(cells_y),
+		pixels_per_cell(std::min(1.0f * size_x / cells_x, 1.0f * size_y / cells_y)),
+		frames_to_ui(frames_to_ui),
 		events_from_ui(events_from_ui)
 	{
-		boundary_rect.w = pixels_per_cell * cells;
-		boundary_rect.h = pixels_per_cell * cells;
+		boundary_rect.w = static_cast<int>(pixels_per_cell * cells_x);
+		boundary_rect.h = static_cast<int>(pixels_per_cell * cells_y);
 		boundary_rect.x = boundary_rect.y = 0;
-		field.resize(cells * cells);
+		frames_to_ui->front_buffer().resize(cells_x * cells_y);
+	}
+
+	void send_event(const Event& simulation_event)
+	{
+		unsent_events.push_back(simulation_event);
+		send_unsent_events();
+	}
+
+	void send_unsent_events()
+	{
+		if (not unsent_events.empty()) {
+			events_from_ui->try_push_all(unsent_events);
+		}
 	}
 
 	void onMouseButtonUp(const SDL_Event& event)
@@ -83,7 +107,7 @@ public:
 						       static_cast<cl_int>(1.0 * event.button.y / pixels_per_cell)};
 			simulation_event.type = Event::Type::ADD_DYE;
 			simulation_event.value.as_scalar = Scalar{1};
-			events_from_ui->try_push(simulation_event);
+			send_event(simulation_event);
 		}
 	}
 
@@ -103,7 +127,17 @@ public:
 									      1.0f * event.motion.yrel / pixels_per_cell);
 
 			simulation_event.type = Event::Type::APPLY_FORCE;
-			events_from_ui->try_push(simulation_event);
+			send_event(simulation_event);
+		}
+	}
+
+	void onKeyDown(const SDL_Event& event)
+	{
+		// The simulation ignores the request unless it was started with profiling
+		if (event.key.keysym.sym == SDLK_p) {
+			Event simulation_event;
+			simulation_event.type = Event::Type::DUMP_PROFILE;
+			send_event(simulation_event);
 		}
 	}
 
@@ -125,6 +159,9 @@ public:
 			case SDL_MOUSEBUTTONDOWN:
 				onMouseButtonDown(event);
 				break;
+			case SDL_KEYDOWN:
+				onKeyDown(event);
+				break;
 			default:
 				break;
 		}
@@ -140,6 +177,7 @@ public:
 					dispatch_event(event);
 				} while(SDL_PollEvent(&event));
 			}
+			send_unsent_events();
 
 			paint();
 		}
@@ -150,41 +188,15 @@ public:
 		auto renderer = this->renderer.get();
 		SDL_SetRenderDrawColor(renderer, 0, 0, 0, 255);
 		SDL_RenderClear(renderer);
-		SDL_SetRenderDrawColor(renderer, 0, 0, 255, 255);
-		SDL_RenderDrawRect(renderer, &boundary_rect);
-		SDL_Rect rect;
-		rect.w = pixels_per_cell;
-		rect.h = pixels_per_cell;
-
-		{
-			std::deque<ScalarField> field_queue = dye_field_to_ui->try_pop_all();
-			ScalarField field;
-			if (not field_queue.empty()) {
-				if (not this->field.empty()) {
-					std::swap(this->field, field_queue.back());
-				}
-				if (not field.empty()) {
-					this->field = std::move(field);
-				}
 
-			}
-		}
-
-		for (uint x = 1; x < cells - 2; ++x) {
-			for (uint y = 1; y < cells - 2; ++y) {
-				rect.x = x * pixels_per_cell;
-				rect.y = y * pixels_per_cell;
-				auto field_val = field[y * cells + x];
-				if (field_val < 0.0) {
-					SDL_SetRenderDrawColor(renderer, 0, std::min(fabs(255 * field[y * cells + x]), 255.0), 0, 255);
-				} else {
-					SDL_SetRenderDrawColor(renderer, std::min(255 * field[y * cells + x], 255.0f), 0, 0, 255);
-				}
-
-				SDL_RenderFillRect(renderer, &rect);
-			}
-		}
+		// Frames come already colored by the simulation
+		frames_to_ui->acquire_latest();
+		const PixelField& frame = frames_to_ui->front_buffer();
+		SDL_UpdateTexture(texture.get(), nullptr, frame.data(), cells_x * sizeof(Pixel));
+		SDL_RenderCopy(renderer, texture.get(), nullptr, &boundary_rect);
 
+		SDL_SetRenderDrawColor(renderer, 0, 0, 255, 255);
+		SDL_RenderDrawRect(renderer, &boundary_rect);
 		SDL_RenderPresent(renderer);
 	}
 };
@@ -0,0 +1,480 @@
+/**
+ * FluidSim - a free and open-source interactive fluid flow simulator
+ * Copyright (C) 2015  Damian Jarek <damian.jarek93@gmail.com>
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License along
+ * with this program; if not, write to the Free Software Foundation, Inc.,
+ * 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+ */
+
+#include "native_simulation.h"
+#include <algorithm>
+#include <cmath>
+#include <stdexcept>
+#if defined(__AVX512F__) or defined(__AVX2__)
+#include <immintrin.h>
+#endif
+
+constexpr cl_uint rows_per_block = 8; //work stealing granularity of the parallel loops
+//Same as in kernels.cl
+constexpr Scalar gravity_x = 0.0;
+constexpr Scalar gravity_y = 0.0;
+constexpr Scalar epsilon = 2.4414e-4; //2^-12
+
+static Scalar lerp(Scalar s, Scalar e, Scalar t)
+{
+	return s + (e - s) * t;
+}
+
+//Bilinear interpolation of a component of the field at position, clamped to the inner cells like in kernels.cl
+template<typename Field, typename Component>
+static Scalar bilinear_interpolation(const Field& field, cl_uint cells_x, cl_uint cells_y, Scalar position_x, Scalar position_y,
+				     Component component)
+{
+	const cl_int x = std::min(std::max(static_cast<cl_int>(std::floor(position_x)), 1), static_cast<cl_int>(cells_x) - 3);
+	const cl_int y = std::min(std::max(static_cast<cl_int>(std::floor(position_y)), 1), static_cast<cl_int>(cells_y) - 3);
+	const Scalar tx = std::fabs(position_x) - x;
+	const Scalar ty = std::fabs(position_y) - y;
+
+	const auto at = [&](cl_int cell_x, cl_int cell_y) { return component(field[cell_y * cells_x + cell_x]); };
+	return lerp(lerp(at(x, y), at(x + 1, y), tx), lerp(at(x, y + 1), at(x + 1, y + 1), tx), ty);
+}
+
+//Boundary cells take the value of their inner neighbour passed through boundary_value, corners take the diagonal one
+template<typename T, typename BoundaryValue>
+static void apply_boundary(std::vector<T>& field, cl_uint cells_x, cl_uint cells_y, BoundaryValue boundary_value)
+{
+	const auto at = [&](cl_uint x, cl_uint y) -> T& { return field[y * cells_x + x]; };
+	for (cl_uint x = 1; x < cells_x - 1; ++x) {
+		at(x, 0) = boundary_value(at(x, 1));
+		at(x, cells_y - 1) = boundary_value(at(x, cells_y - 2));
+	}
+	for (cl_uint y = 1; y < cells_y - 1; ++y) {
+		at(0, y) = boundary_value(at(1, y));
+		at(cells_x - 1, y) = boundary_value(at(cells_x - 2, y));
+	}
+	at(0, 0) = boundary_value(at(1, 1));
+	at(cells_x - 1, 0) = boundary_value(at(cells_x - 2, 1));
+	at(0, cells_y - 1) = boundary_value(at(1, cells_y - 2));
+	at(cells_x - 1, cells_y - 1) = boundary_value(at(cells_x - 2, cells_y - 2));
+}
+
+//One Jacobi iteration over count floats of a row. The vector fields are handled as rows of interleaved floats,
+//neighbour is the distance to the left and right neighbours and row the distance to the top and bottom ones.
+//All paths sum in the order of the kernels, so their results are identical.
+static void jacobi_row(const Scalar* x, const Scalar* b, Scalar* x_out, size_t count, size_t neighbour, size_t row,
+		       Scalar alpha, Scalar beta_reciprocal)
+{
+	size_t i = 0;
+#ifdef __AVX512F__
+	const __m512 alpha_16 = _mm512_set1_ps(alpha);
+	const __m512 beta_reciprocal_16 = _mm512_set1_ps(beta_reciprocal);
+	for (; i + 16 <= count; i += 16) {
+		__m512 sum = _mm512_add_ps(_mm512_loadu_ps(x + i - neighbour), _mm512_loadu_ps(x + i + neighbour));
+		sum = _mm512_add_ps(sum, _mm512_loadu_ps(x + i + row));
+		sum = _mm512_add_ps(sum, _mm512_loadu_ps(x + i - row));
+		sum = _mm512_add_ps(sum, _mm512_mul_ps(alpha_16, _mm512_loadu_ps(b + i)));
+		_mm512_storeu_ps(x_out + i, _mm512_mul_ps(sum, beta_reciprocal_16));
+	}
+#endif
+#ifdef __AVX2__
+	const __m256 alpha_8 = _mm256_set1_ps(alpha);
+	const __m256 beta_reciprocal_8 = _mm256_set1_ps(beta_reciprocal);
+	for (; i + 8 <= count; i += 8) {
+		__m256 sum = _mm256_add_ps(_mm256_loadu_ps(x + i - neighbour), _mm256_loadu_ps(x + i + neighbour));
+		sum = _mm256_add_ps(sum, _mm256_loadu_ps(x + i + row));
+		sum = _mm256_add_ps(sum, _mm256_loadu_ps(x + i - row));
+		sum = _mm256_add_ps(sum, _mm256_mul_ps(alpha_8, _mm256_loadu_ps(b + i)));
+		_mm256_storeu_ps(x_out + i, _mm256_mul_ps(sum, beta_reciprocal_8));
+	}
+#endif
+	for (; i < count; ++i) {
+		x_out[i] = (x[i - neighbour] + x[i + neighbour] + x[i + row] + x[i - row] + alpha * b[i]) * beta_reciprocal;
+	}
+}
+
+NativeSimulation::NativeSimulation(const SimulationParameters& parameters,
+				   Mailbox_ptr<PixelField> to_ui,
+				   Channel_ptr<Event> events_from_ui,
+				   size_t thread_count):
+	cells_x(parameters.cells_x),
+	cells_y(parameters.cells_y),
+	total_cell_count(cells_x * cells_y),
+	p(total_cell_count, Scalar{0.0}),
+	temporary_p(total_cell_count, Scalar{0.0}),
+	divergence_w(total_cell_count, Scalar{0.0}),
+	dye(total_cell_count, Scalar{0.0}),
+	temporary_dye(total_cell_count, Scalar{0.0}),
+	u(total_cell_count, Vector{0.0, 0.0}),
+	w(total_cell_count, Vector{0.0, 0.0}),
+	temporary_w(total_cell_count, Vector{0.0, 0.0}),
+	time_step(parameters.time_step),
+	dx_reciprocal(1 / parameters.dx),
+	halved_dx_reciprocal(dx_reciprocal * 0.5),
+	velocity_dissipation(parameters.velocity_dissipation),
+	dye_dissipation(parameters.dye_dissipation),
+	pressure_alpha(-parameters.dx * parameters.dx),
+	diffusion_alpha(parameters.dx * parameters.dx / (parameters.viscosity * parameters.time_step)),
+	vorticity_dx_scale(parameters.vorticity_scale * parameters.dx),
+	emitters(default_emitters(cells_x, cells_y)),
+	to_ui(to_ui),
+	events_from_ui(events_from_ui),
+	pool(thread_count)
+{
+	if (parameters.storage != FieldStorage::FLOAT) {
+		throw std::invalid_argument{"The native backend only supports float field storage"};
+	}
+	set_visualization(VisualizedField::DYE, ColormapType::RED_GREEN, -1.0, 1.0);
+}
+
+void NativeSimulation::set_pressure_solver(PressureSolver solver)
+{
+	if (solver != PressureSolver::JACOBI) {
+		throw std::invalid_argument{"The native backend only supports the Jacobi pressure solver"};
+	}
+}
+
+void NativeSimulation::set_diffusion_solver(DiffusionSolver solver)
+{
+	if (solver != DiffusionSolver::JACOBI) {
+		throw std::invalid_argument{"The native backend only supports the Jacobi diffusion solver"};
+	}
+}
+
+void NativeSimulation::set_solver_iterations(cl_uint iterations)
+{
+	solver_iterations = iterations;
+}
+
+void NativeSimulation::set_phase_timing(bool enabled)
+{
+	phase_timing = enabled;
+}
+
+const FrameStats& NativeSimulation::frame_stats() const
+{
+	return stats;
+}
+
+void NativeSimulation::set_visualization(VisualizedField field, ColormapType colormap_type, Scalar min, Scalar max)
+{
+	visualized_field = field;
+	colormap = make_colormap(colormap_type);
+	visualized_min = min;
+	visualized_max = max;
+}
+
+void NativeSimulation::set_emitters(std::vector<Event> emitters)
+{
+	this->emitters = std::move(emitters);
+}
+
+void NativeSimulation::read_dye(ScalarField& field)
+{
+	field = dye;
+}
+
+void NativeSimulation::for_rows(cl_uint begin, cl_uint end, const std::function<void(cl_uint)>& row_body)
+{
+	pool.parallel_for(begin, end, rows_per_block, [&](size_t block_begin, size_t block_end) {
+		for (size_t y = block_begin; y < block_end; ++y) {
+			row_body(y);
+		}
+	});
+	++stats.kernel_launches;
+}
+
+void NativeSimulation::jacobi(const Scalar* x, const Scalar* b, Scalar* x_out, cl_uint components, Scalar alpha, Scalar beta_reciprocal)
+{
+	const size_t row = cells_x * components;
+	for_rows(1, cells_y - 1, [&](cl_uint y) {
+		const size_t first = y * row + components;
+		jacobi_row(x + first, b + first, x_out + first, (cells_x - 2) * components, components, row, alpha, beta_reciprocal);
+	});
+}
+
+void NativeSimulation::apply_scalar_boundary_conditions(ScalarField& field)
+{
+	apply_boundary(field, cells_x, cells_y, [](Scalar value) { return value; });
+}
+
+void NativeSimulation::apply_vector_boundary_conditions(VectorField& field)
+{
+	apply_boundary(field, cells_x, cells_y, [](const Vector& value) { return Vector{-value.s[0], -value.s[1]}; });
+}
+
+void NativeSimulation::apply_dye_boundary_conditions()
+{
+	apply_boundary(dye, cells_x, cells_y, [](Scalar) { return Scalar{0.0}; });
+}
+
+void NativeSimulation::inject_sources(Event::Type type)
+{
+	const bool force = type == Event::Type::APPLY_FORCE;
+	const Scalar range = force ? impulse_range : dye_range;
+	const cl_int reach = std::ceil(source_cutoff_ranges * range);
+
+	// Bounding box of the inner cells within reach of any of the sources
+	sources.clear();
+	cl_int min_x = cells_x - 2, min_y = cells_y - 2;
+	cl_int max_x = 1, max_y = 1;
+	const auto add_source = [&](const Event& source_event) {
+		if (source_event.type != type) {
+			return;
+		}
+
+		Source source {source_event.point, Vector{0.0, 0.0}, Scalar{0.0}, range};
+		if (force) {
+			source.force = source_event.value.as_vector;
+		} else {
+			source.dye = source_event.value.as_scalar;
+		}
+		sources.push_back(source);
+
+		min_x = std::min(min_x, source.position.s[0] - reach);
+		min_y = std::min(min_y, source.position.s[1] - reach);
+		max_x = std::max(max_x, source.position.s[0] + reach);
+		max_y = std::max(max_y, source.position.s[1] + reach);
+	};
+	for (auto& source_event : events) {
+		add_source(source_event);
+	}
+	for (auto& emitter : emitters) {
+		add_source(emitter);
+	}
+
+	min_x = std::max(min_x, 1);
+	min_y = std::max(min_y, 1);
+	max_x = std::min<cl_int>(max_x, cells_x - 2);
+	max_y = std::min<cl_int>(max_y, cells_y - 2);
+	if (sources.empty() or min_x > max_x or min_y > max_y) {
+		return;
+	}
+
+	const Scalar cutoff_squared = source_cutoff_ranges * source_cutoff_ranges;
+	for_rows(min_y, max_y + 1, [&](cl_uint y) {
+		for (cl_int x = min_x; x <= max_x; ++x) {
+			Scalar force_x = 0, force_y = 0, dye_change = 0;
+			for (const auto& source : sources) {
+				const Scalar dx = x - source.position.s[0];
+				const Scalar dy = static_cast<cl_int>(y) - source.position.s[1];
+				const Scalar distance_squared = dx * dx + dy * dy;
+				const Scalar range_squared = source.range * source.range;
+				if (distance_squared >= cutoff_squared * range_squared) {
+					continue;
+				}
+
+				const Scalar falloff = std::exp(-distance_squared / range_squared);
+				force_x += 100 * source.force.s[0] * time_step * falloff;
+				force_y += 100 * source.force.s[1] * time_step * falloff;
+				dye_change += source.dye * time_step * falloff;
+			}
+
+			const size_t index = y * cells_x + x;
+			if (force) {
+				w[index].s[0] += force_x;
+				w[index].s[1] += force_y;
+			} else {
+				dye[index] += dye_change;
+			}
+		}
+	});
+}
+
+void NativeSimulation::advect_velocity_and_dye()
+{
+	const Scalar scale = time_step * dx_reciprocal;
+	for_rows(1, cells_y - 1, [&](cl_uint y) {
+		for (cl_uint x = 1; x < cells_x - 1; ++x) {
+			const size_t index = y * cells_x + x;
+			const Scalar position_x = x - scale * u[index].s[0];
+			const Scalar position_y = y - scale * u[index].s[1];
+
+			const auto velocity_x = bilinear_interpolation(u, cells_x, cells_y, position_x, position_y, [](const Vector& value) { return value.s[0]; });
+			const auto velocity_y = bilinear_interpolation(u, cells_x, cells_y, position_x, position_y, [](const Vector& value) { return value.s[1]; });
+			temporary_w[index] = Vector{velocity_x * velocity_dissipation + gravity_x, velocity_y * velocity_dissipation + gravity_y};
+
+			const auto dye_value = bilinear_interpolation(dye, cells_x, cells_y, position_x, position_y, [](Scalar value) { return value; });
+			temporary_dye[index] = std::fabs(dye_value) * dye_dissipation;
+		}
+	});
+
+	std::swap(w, temporary_w);
+	std::swap(dye, temporary_dye);
+}
+
+void NativeSimulation::calculate_diffusion()
+{
+	for (int i = 0; i < solver_iterations; ++i) {
+		apply_vector_boundary_conditions(w);
+		jacobi(&w[0].s[0], &w[0].s[0], &temporary_w[0].s[0], 2, diffusion_alpha, 1 / (4 + diffusion_alpha));
+		std::swap(w, temporary_w);
+	}
+	apply_vector_boundary_conditions(w);
+	stats.diffusion_iterations = solver_iterations;
+}
+
+Scalar NativeSimulation::vorticity_at(const VectorField& field, cl_int x, cl_int y) const
+{
+	if (x < 1 or y < 1 or x > static_cast<cl_int>(cells_x) - 2 or y > static_cast<cl_int>(cells_y) - 2) {
+		return 0;
+	}
+
+	const auto at = [&](cl_int cell_x, cl_int cell_y) -> const Vector& { return field[cell_y * cells_x + cell_x]; };
+	return halved_dx_reciprocal * ((at(x + 1, y).s[1] - at(x - 1, y).s[1]) - (at(x, y + 1).s[0] - at(x, y - 1).s[0]));
+}
+
+void NativeSimulation::apply_vorticity_confinement()
+{
+	for_rows(1, cells_y - 1, [&](cl_uint y) {
+		for (cl_uint x = 1; x < cells_x - 1; ++x) {
+			const cl_int cell_x = x, cell_y = y;
+			const Scalar v_center = vorticity_at(w, cell_x, cell_y);
+			const Scalar v_left = vorticity_at(w, cell_x - 1, cell_y);
+			const Scalar v_right = vorticity_at(w, cell_x + 1, cell_y);
+			const Scalar v_top = vorticity_at(w, cell_x, cell_y + 1);
+			const Scalar v_bottom = vorticity_at(w, cell_x, cell_y - 1);
+
+			Scalar force_x = std::fabs(v_top) - std::fabs(v_bottom);
+			Scalar force_y = std::fabs(v_right) - std::fabs(v_left);
+			const Scalar magnitude_reciprocal = 1 / std::sqrt(std::max(epsilon, force_x * force_x + force_y * force_y));
+			const Scalar scale = vorticity_dx_scale * v_center;
+			force_x *= magnitude_reciprocal;
+			force_y *= magnitude_reciprocal;
+			force_x *= scale;
+			force_y *= -scale;
+
+			const size_t index = y * cells_x + x;
+			temporary_w[index] = Vector{w[index].s[0] + time_step * force_x, w[index].s[1] + time_step * force_y};
+		}
+	});
+
+	std::swap(w, temporary_w);
+}
+
+void NativeSimulation::calculate_divergence_w()
+{
+	for_rows(1, cells_y - 1, [&](cl_uint y) {
+		for (cl_uint x = 1; x < cells_x - 1; ++x) {
+			const size_t index = y * cells_x + x;
+			divergence_w[index] = halved_dx_reciprocal * (w[index + 1].s[0] - w[index - 1].s[0] + w[index + cells_x].s[1] - w[index - cells_x].s[1]);
+		}
+	});
+}
+
+void NativeSimulation::calculate_p()
+{
+	std::fill(p.begin(), p.end(), Scalar{0.0});
+	for (int i = 0; i < solver_iterations; ++i) {
+		apply_scalar_boundary_conditions(p);
+		jacobi(p.data(), divergence_w.data(), temporary_p.data(), 1, pressure_alpha, Scalar{0.25});
+		std::swap(p, temporary_p);
+	}
+	apply_scalar_boundary_conditions(p);
+	stats.pressure_iterations = solver_iterations;
+}
+
+void NativeSimulation::subtract_pressure_gradient()
+{
+	for_rows(1, cells_y - 1, [&](cl_uint y) {
+		for (cl_uint x = 1; x < cells_x - 1; ++x) {
+			const size_t index = y * cells_x + x;
+			u[index] = Vector{w[index].s[0] - (p[index + 1] - p[index - 1]), w[index].s[1] - (p[index + cells_x] - p[index - cells_x])};
+		}
+	});
+}
+
+void NativeSimulation::render_frame()
+{
+	// The mailbox's buffers circulate between the simulation and the UI, so they're only allocated once
+	auto& frame = to_ui->back_buffer();
+	frame.resize(total_cell_count);
+
+	const Scalar last_index = colormap_size - 1;
+	const auto lookup = [&](Scalar value) {
+		const Scalar index = std::min(std::max((value - visualized_min) * last_index / (visualized_max - visualized_min), Scalar{0}), last_index);
+		return colormap[static_cast<cl_uint>(index + 0.5f)];
+	};
+	for_rows(0, cells_y, [&](cl_uint y) {
+		for (cl_uint x = 0; x < cells_x; ++x) {
+			const size_t index = y * cells_x + x;
+			switch (visualized_field) {
+				case VisualizedField::DYE:
+					frame[index] = lookup(dye[index]);
+					break;
+				case VisualizedField::PRESSURE:
+					frame[index] = lookup(p[index]);
+					break;
+				case VisualizedField::SPEED:
+					frame[index] = lookup(std::sqrt(u[index].s[0] * u[index].s[0] + u[index].s[1] * u[index].s[1]));
+					break;
+				case VisualizedField::VORTICITY:
+					frame[index] = lookup(vorticity_at(u, x, y));
+					break;
+			}
+		}
+	});
+
+	to_ui->publish();
+}
+
+void NativeSimulation::update()
+{
+	stats.kernel_launches = 0;
+	if (phase_timing) {
+		stats.phase_seconds.fill(0.0);
+		phase_start = std::chrono::steady_clock::now();
+	}
+
+	events.clear();
+	events_from_ui->pop_all(events);
+
+	inject_sources(Event::Type::ADD_DYE);
+	end_phase(Phase::SOURCES);
+	advect_velocity_and_dye();
+	end_phase(Phase::ADVECTION);
+	inject_sources(Event::Type::APPLY_FORCE);
+	end_phase(Phase::SOURCES);
+
+	apply_vector_boundary_conditions(w);
+	apply_dye_boundary_conditions();
+	calculate_diffusion();
+	end_phase(Phase::DIFFUSION);
+	apply_vorticity_confinement();
+	apply_vector_boundary_conditions(w);
+	end_phase(Phase::VORTICITY);
+
+	calculate_divergence_w();
+	apply_scalar_boundary_conditions(divergence_w);
+	end_phase(Phase::DIVERGENCE);
+
+	calculate_p();
+	end_phase(Phase::PRESSURE);
+	subtract_pressure_gradient();
+	apply_vector_boundary_conditions(u);
+	end_phase(Phase::PROJECTION);
+
+	render_frame();
+	end_phase(Phase::READBACK);
+}
+
+void NativeSimulation::end_phase(Phase phase)
+{
+	if (not phase_timing) {
+		return;
+	}
+
+	const auto now = std::chrono::steady_clock::now();
+	stats.phase_seconds[static_cast<size_t>(phase)] += std::chrono::duration<double>(now - phase_start).count();
+	phase_start = now;
+}
@@ -0,0 +1,112 @@
+/**
+ * FluidSim - a free and open-source interactive fluid flow simulator
+ * Copyright (C) 2015  Damian Jarek <damian.jarek93@gmail.com>
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License along
+ * with this program; if not, write to the Free Software Foundation, Inc.,
+ * 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+ */
+
+#ifndef NATIVE_SIMULATION_H
+#define NATIVE_SIMULATION_H
+
+#include "typedefs.h"
+#include "channel.h"
+#include "colormap.h"
+#include "simulation.h"
+#include "threadpool.h"
+
+#include <chrono>
+#include <functional>
+#include <vector>
+
+//Simulation computed on the host, without OpenCL. Runs the same steps as the fused pipeline of Simulation
+//with the Jacobi solvers, the stencil loops are split into blocks of rows between the threads of a pool.
+class NativeSimulation
+{
+	cl_uint cells_x;
+	cl_uint cells_y;
+	cl_uint total_cell_count;
+
+	ScalarField p; //pressure field
+	ScalarField temporary_p;
+	ScalarField divergence_w;
+	ScalarField dye;
+	ScalarField temporary_dye;
+	VectorField u; //divergence-free velocity field
+	VectorField w; //divergent velocity field
+	VectorField temporary_w;
+
+	Scalar time_step;
+	Scalar dx_reciprocal;
+	Scalar halved_dx_reciprocal;
+	Scalar velocity_dissipation;
+	Scalar dye_dissipation;
+	Scalar pressure_alpha;
+	Scalar diffusion_alpha;
+	Scalar vorticity_dx_scale;
+
+	std::vector<Source> sources; //of the type being injected
+	std::vector<Event> emitters;
+
+	Colormap colormap;
+	VisualizedField visualized_field {VisualizedField::DYE};
+	Scalar visualized_min {-1.0};
+	Scalar visualized_max {1.0};
+
+	Mailbox_ptr<PixelField> to_ui;
+	Channel_ptr<Event> events_from_ui;
+	std::vector<Event> events; //received from the UI during the current update
+
+	ThreadPool pool;
+	int solver_iterations {100};
+	bool phase_timing {false};
+	std::chrono::steady_clock::time_point phase_start;
+	FrameStats stats;
+public:
+	//A thread count of 0 uses all hardware threads
+	NativeSimulation(const SimulationParameters& parameters,
+			 Mailbox_ptr<PixelField> to_ui,
+			 Channel_ptr<Event> events_from_ui,
+			 size_t thread_count);
+
+	void update();
+	//Throw std::invalid_argument for the solvers other than Jacobi
+	void set_pressure_solver(PressureSolver solver);
+	void set_diffusion_solver(DiffusionSolver solver);
+	void set_solver_iterations(cl_uint iterations);
+	void set_phase_timing(bool enabled);
+	//Kernel launches in the stats count the parallel loops
+	const FrameStats& frame_stats() const;
+	void set_visualization(VisualizedField field, ColormapType colormap_type, Scalar min, Scalar max);
+	void set_emitters(std::vector<Event> emitters);
+	void read_dye(ScalarField& field);
+private:
+	void for_rows(cl_uint begin, cl_uint end, const std::function<void(cl_uint)>& row_body);
+	void jacobi(const Scalar* x, const Scalar* b, Scalar* x_out, cl_uint components, Scalar alpha, Scalar beta_reciprocal);
+	void apply_scalar_boundary_conditions(ScalarField& field);
+	void apply_vector_boundary_conditions(VectorField& field);
+	void apply_dye_boundary_conditions();
+	void inject_sources(Event::Type type);
+	void advect_velocity_and_dye();
+	void calculate_diffusion();
+	void apply_vorticity_confinement();
+	void calculate_divergence_w();
+	void calculate_p();
+	void subtract_pressure_gradient();
+	void render_frame();
+	Scalar vorticity_at(const VectorField& field, cl_int x, cl_int y) const;
+	void end_phase(Phase phase);
+};
+
+#endif //NATIVE_SIMULATION_H
@@ -0,0 +1,293 @@
+/**
+ * FluidSim - a free and open-source interactive fluid flow simulator
+ * Copyright (C) 2015  Damian Jarek <damian.jarek93@gmail.com>
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License along
+ * with this program; if not, write to the Free Software Foundation, Inc.,
+ * 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+ */
+
+#include "profiler.h"
+#include <algorithm>
+#include <cmath>
+#include <fstream>
+#include <iomanip>
+#include <limits>
+#include <sstream>
+
+Profiler::Profiler(std::string output_prefix, size_t window_frames):
+	output_prefix(std::move(output_prefix)),
+	window_frames(window_frames)
+{
+}
+
+void Profiler::add_boundary_kernel(const cl::Kernel& kernel)
+{
+	boundary_kernels.insert(kernel());
+}
+
+void Profiler::record(const cl::Kernel& kernel, const cl::Event& event)
+{
+	// Names are looked up once per kernel, the commands point into the map
+	auto name = kernel_names.find(kernel());
+	if (name == kernel_names.end()) {
+		name = kernel_names.emplace(kernel(), kernel.getInfo<CL_KERNEL_FUNCTION_NAME>()).first;
+	}
+	const bool boundary = boundary_kernels.count(kernel()) != 0;
+	current.commands.push_back(Command{&name->second, boundary ? boundaries_category : unassigned_category, event, 0, 0, 0, 0});
+}
+
+void Profiler::record(const std::string& name, const cl::Event& event)
+{
+	const auto& interned = *command_names.insert(name).first;
+	current.commands.push_back(Command{&interned, unassigned_category, event, 0, 0, 0, 0});
+}
+
+void Profiler::end_phase(Phase phase)
+{
+	for (size_t i = phase_begin; i < current.commands.size(); ++i) {
+		auto& command = current.commands[i];
+		if (command.category == unassigned_category) {
+			command.category = static_cast<size_t>(phase);
+		}
+	}
+	phase_begin = current.commands.size();
+}
+
+void Profiler::end_frame(const FrameStats& stats)
+{
+	end_phase(Phase::READBACK);
+	current.number = frame_count++;
+	current.stats = stats;
+	in_flight.push_back(std::move(current));
+	current = Frame{};
+	phase_begin = 0;
+
+	collect(false);
+}
+
+bool Profiler::resolve(Frame& frame, bool wait)
+{
+	for (auto& command : frame.commands) {
+		if (wait) {
+			command.event.wait();
+		} else if (command.event.getInfo<CL_EVENT_COMMAND_EXECUTION_STATUS>() != CL_COMPLETE) {
+			return false;
+		}
+	}
+
+	for (auto& command : frame.commands) {
+		command.queued = command.event.getProfilingInfo<CL_PROFILING_COMMAND_QUEUED>();
+		command.submitted = command.event.getProfilingInfo<CL_PROFILING_COMMAND_SUBMIT>();
+		command.started = command.event.getProfilingInfo<CL_PROFILING_COMMAND_START>();
+		command.ended = command.event.getProfilingInfo<CL_PROFILING_COMMAND_END>();
+		command.event = cl::Event{};
+	}
+	return true;
+}
+
+void Profiler::collect(bool wait_for_all)
+{
+	while (not in_flight.empty()) {
+		const bool wait = wait_for_all or in_flight.size() > max_frames_in_flight;
+		if (not resolve(in_flight.front(), wait)) {
+			break;
+		}
+
+		window.push_back(std::move(in_flight.front()));
+		in_flight.pop_front();
+		add_to_histograms(window.back(), 1);
+		if (window.size() > window_frames) {
+			add_to_histograms(window.front(), -1);
+			window.pop_front();
+		}
+	}
+}
+
+void Profiler::add_to_histograms(const Frame& frame, int sign)
+{
+	for (const auto& command : frame.commands) {
+		auto& category = histograms[command.category];
+		category[QUEUED][bin_of(command.submitted - command.queued)] += sign;
+		category[SUBMITTED][bin_of(command.started - command.submitted)] += sign;
+		category[RUNNING][bin_of(command.ended - command.started)] += sign;
+		running_nanoseconds[command.category] += sign * static_cast<cl_long>(command.ended - command.started);
+	}
+}
+
+size_t Profiler::bin_of(cl_ulong nanoseconds)
+{
+	if (nanoseconds <= 1) {
+		return 0;
+	}
+	const auto bin = static_cast<size_t>(bins_per_octave * std::log2(static_cast<double>(nanoseconds)));
+	return std::min(bin, bin_count - 1);
+}
+
+double Profiler::bin_upper_bound(size_t bin)
+{
+	return std::exp2(static_cast<double>(bin + 1) / bins_per_octave);
+}
+
+const char* Profiler::category_name(size_t category)
+{
+	return category == boundaries_category ? "boundaries" : phase_name(static_cast<Phase>(category));
+}
+
+//Upper bound of the bin holding the given fraction of the samples, in microseconds
+static double percentile(const Profiler::Histogram& histogram, double fraction, double (*upper_bound)(size_t))
+{
+	cl_ulong total = 0;
+	for (auto count : histogram) {
+		total += count;
+	}
+	if (total == 0) {
+		return 0.0;
+	}
+
+	const auto rank = static_cast<cl_ulong>(std::ceil(fraction * total));
+	cl_ulong seen = 0;
+	for (size_t bin = 0; bin < histogram.size(); ++bin) {
+		seen += histogram[bin];
+		if (seen >= rank and histogram[bin] != 0) {
+			return upper_bound(bin) * 1e-3;
+		}
+	}
+	return upper_bound(histogram.size() - 1) * 1e-3;
+}
+
+void Profiler::write_summary(std::ostream& out) const
+{
+	if (window.empty()) {
+		out << "No profiled frames yet" << std::endl;
+		return;
+	}
+
+	out << "Profile of frames " << window.front().number << " to " << window.back().number
+	    << ", durations in us as p50/p95/max bin upper bounds" << std::endl;
+	out << std::left << std::setw(12) << "category" << std::right << std::setw(12) << "commands" << std::setw(14) << "device ms"
+	    << std::setw(24) << "queued" << std::setw(24) << "submitted" << std::setw(24) << "running" << std::endl;
+	out << std::fixed << std::setprecision(3);
+	for (size_t category = 0; category < category_count; ++category) {
+		const auto& intervals = histograms[category];
+		cl_ulong commands = 0;
+		for (auto count : intervals[RUNNING]) {
+			commands += count;
+		}
+		if (commands == 0) {
+			continue;
+		}
+
+		out << std::left << std::setw(12) << category_name(category) << std::right
+		    << std::setw(12) << static_cast<double>(commands) / window.size()
+		    << std::setw(14) << running_nanoseconds[category] * 1e-6 / window.size();
+		for (const auto& histogram : intervals) {
+			std::ostringstream durations;
+			durations << std::fixed << std::setprecision(1) << percentile(histogram, 0.5, bin_upper_bound) << '/'
+				  << percentile(histogram, 0.95, bin_upper_bound) << '/' << percentile(histogram, 1.0, bin_upper_bound);
+			out << std::setw(24) << durations.str();
+		}
+		out << std::endl;
+	}
+	out << "(commands and device ms per frame)" << std::endl;
+	out.unsetf(std::ios::floatfield);
+}
+
+void Profiler::write_frame_stats(std::ostream& out) const
+{
+	out << "frame,commands,span_ms";
+	for (size_t category = 0; category < category_count; ++category) {
+		out << ',' << category_name(category) << "_ms";
+	}
+	out << ",pressure_iterations,pressure_residual,diffusion_iterations,diffusion_residual\n";
+
+	// The span runs from the first command being queued to the last one ending
+	for (const auto& frame : window) {
+		cl_ulong first_queued = std::numeric_limits<cl_ulong>::max();
+		cl_ulong last_ended = 0;
+		std::array<cl_ulong, category_count> nanoseconds {};
+		for (const auto& command : frame.commands) {
+			first_queued = std::min(first_queued, command.queued);
+			last_ended = std::max(last_ended, command.ended);
+			nanoseconds[command.category] += command.ended - command.started;
+		}
+		const auto span = frame.commands.empty() ? 0 : last_ended - first_queued;
+
+		out << frame.number << ',' << frame.commands.size() << ',' << span * 1e-6;
+		for (auto category_nanoseconds : nanoseconds) {
+			out << ',' << category_nanoseconds * 1e-6;
+		}
+		out << ',' << frame.stats.pressure_iterations << ',' << frame.stats.pressure_residual
+		    << ',' << frame.stats.diffusion_iterations << ',' << frame.stats.diffusion_residual << '\n';
+	}
+}
+
+void Profiler::write_chrome_trace(std::ostream& out) const
+{
+	// Every category gets a track of its own, so that the phases line up in the viewer
+	cl_ulong origin = std::numeric_limits<cl_ulong>::max();
+	for (const auto& frame : window) {
+		for (const auto& command : frame.commands) {
+			origin = std::min(origin, command.queued);
+		}
+	}
+	const auto microseconds = [origin](cl_ulong nanoseconds) {
+		return (nanoseconds - origin) * 1e-3;
+	};
+
+	out << "{\"displayTimeUnit\":\"ms\",\"traceEvents\":[\n";
+	out << std::fixed << std::setprecision(3);
+	out << "{\"name\":\"thread_name\",\"ph\":\"M\",\"pid\":1,\"tid\":0,\"args\":{\"name\":\"frames\"}}";
+	for (size_t category = 0; category < category_count; ++category) {
+		out << ",\n{\"name\":\"thread_name\",\"ph\":\"M\",\"pid\":1,\"tid\":" << category + 1
+		    << ",\"args\":{\"name\":\"" << category_name(category) << "\"}}";
+	}
+
+	for (const auto& frame : window) {
+		if (frame.commands.empty()) {
+			continue;
+		}
+
+		cl_ulong first_started = std::numeric_limits<cl_ulong>::max();
+		cl_ulong last_ended = 0;
+		for (const auto& command : frame.commands) {
+			first_started = std::min(first_started, command.started);
+			last_ended = std::max(last_ended, command.ended);
+			out << ",\n{\"name\":\"" << *command.name << "\",\"cat\":\"" << category_name(command.category)
+			    << "\",\"ph\":\"X\",\"pid\":1,\"tid\":" << command.category + 1
+			    << ",\"ts\":" << microseconds(command.started) << ",\"dur\":" << (command.ended - command.started) * 1e-3
+			    << ",\"args\":{\"frame\":" << frame.number << ",\"queued_us\":" << microseconds(command.queued)
+			    << ",\"submitted_us\":" << microseconds(command.submitted) << "}}";
+		}
+		out << ",\n{\"name\":\"frame " << frame.number << "\",\"ph\":\"X\",\"pid\":1,\"tid\":0,\"ts\":"
+		    << microseconds(first_started) << ",\"dur\":" << (last_ended - first_started) * 1e-3 << "}";
+	}
+	out << "\n]}\n";
+	out.unsetf(std::ios::floatfield);
+}
+
+void Profiler::dump(std::ostream& summary)
+{
+	collect(true);
+	write_summary(summary);
+
+	const auto frames_path = output_prefix + ".frames.csv";
+	std::ofstream frames_file{frames_path};
+	write_frame_stats(frames_file);
+
+	const auto trace_path = output_prefix + ".trace.json";
+	std::ofstream trace_file{trace_path};
+	write_chrome_trace(trace_file);
+
+	summary << "Wrote " << frames_path << " and " << trace_path << std::endl;
+}
@@ -0,0 +1,153 @@
+/**
+ * FluidSim - a free and open-source interactive fluid flow simulator
+ * Copyright (C) 2015  Damian Jarek <damian.jarek93@gmail.com>
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License along
+ * with this program; if not, write to the Free Software Foundation, Inc.,
+ * 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+ */
+
+#ifndef PROFILER_H
+#define PROFILER_H
+
+#define __CL_ENABLE_EXCEPTIONS
+
+#include <CL/cl.hpp>
+
+#include "typedefs.h"
+
+#include <array>
+#include <deque>
+#include <map>
+#include <set>
+#include <ostream>
+#include <string>
+#include <vector>
+
+//Parts of an update, which can be timed separately
+enum class Phase {
+	SOURCES,
+	ADVECTION,
+	DIFFUSION,
+	VORTICITY,
+	DIVERGENCE,
+	PRESSURE,
+	PROJECTION, //subtraction of the pressure gradient
+	READBACK
+};
+constexpr size_t phase_count = 8;
+
+inline const char* phase_name(Phase phase)
+{
+	static const char* const names[phase_count] = {"sources", "advection", "diffusion", "vorticity", "divergence", "pressure",
+						       "projection", "readback"};
+	return names[static_cast<size_t>(phase)];
+}
+
+//Solver statistics of the last update, the residuals are the RMS of the change a Jacobi iteration would
+//make to the solution and are only measured when the residual tolerance is enabled
+struct FrameStats {
+	cl_uint pressure_iterations {0};
+	cl_uint diffusion_iterations {0};
+	Scalar pressure_residual {0.0};
+	Scalar diffusion_residual {0.0};
+	cl_uint kernel_launches {0};
+	std::array<double, phase_count> phase_seconds {}; //only measured when phase timing is enabled
+};
+
+//Collects the profiling info of the commands enqueued by the simulation, which needs a queue created with
+//CL_QUEUE_PROFILING_ENABLE. Commands are attributed to the phase they were enqueued in, except for the boundary
+//condition kernels, which get a category of their own. The last window_frames frames are kept for the report
+//and the trace.
+class Profiler
+{
+public:
+	static constexpr size_t category_count = phase_count + 1;
+	static constexpr size_t boundaries_category = phase_count;
+	//Quarter-octave bins of durations in nanoseconds, the last one also holds everything longer
+	static constexpr size_t bins_per_octave = 4;
+	static constexpr size_t bin_count = 40 * bins_per_octave;
+	using Histogram = std::array<cl_uint, bin_count>;
+
+	//Parts of a command's lifetime, from being queued to being submitted to the device,
+	//from being submitted to starting and from starting to ending
+	enum Interval {
+		QUEUED,
+		SUBMITTED,
+		RUNNING,
+		interval_count
+	};
+private:
+	static constexpr size_t unassigned_category = category_count; //until the end of the command's phase
+	static constexpr size_t max_frames_in_flight = 4;
+
+	struct Command {
+		const std::string* name;
+		size_t category;
+		cl::Event event; //released once the times are read
+		cl_ulong queued;
+		cl_ulong submitted;
+		cl_ulong started;
+		cl_ulong ended;
+	};
+
+	struct Frame {
+		unsigned long number;
+		std::vector<Command> commands;
+		FrameStats stats;
+	};
+
+	std::map<cl_kernel, std::string> kernel_names;
+	std::set<cl_kernel> boundary_kernels;
+	std::set<std::string> command_names;
+	std::string output_prefix;
+	size_t window_frames;
+
+	Frame current;
+	size_t phase_begin {0}; //first command of the current frame without a phase
+	std::deque<Frame> in_flight; //frames with commands which may not have completed yet
+	std::deque<Frame> window;
+	unsigned long frame_count {0};
+	std::array<std::array<Histogram, interval_count>, category_count> histograms {};
+	std::array<cl_ulong, category_count> running_nanoseconds {}; //of the commands in the window
+public:
+	//Dumps write <output_prefix>.trace.json and <output_prefix>.frames.csv
+	Profiler(std::string output_prefix, size_t window_frames = 120);
+
+	//Launches of the kernel are put in the boundaries category
+	void add_boundary_kernel(const cl::Kernel& kernel);
+	void record(const cl::Kernel& kernel, const cl::Event& event);
+	//Records a command other than a kernel launch, e.g. a transfer
+	void record(const std::string& name, const cl::Event& event);
+	//The commands recorded since the previous call belong to the phase
+	void end_phase(Phase phase);
+	//Commands of completed frames are added to the histograms, waits for the oldest frame if too many are in flight.
+	//The frame's solver statistics are written with its per-frame stats.
+	void end_frame(const FrameStats& stats);
+
+	//Waits for the frames in flight, prints a summary of the histograms to the stream and writes
+	//the per-frame stats and a Chrome trace (chrome://tracing, Perfetto) of the window to files
+	void dump(std::ostream& summary);
+	void write_summary(std::ostream& out) const;
+	void write_frame_stats(std::ostream& out) const;
+	void write_chrome_trace(std::ostream& out) const;
+private:
+	bool resolve(Frame& frame, bool wait);
+	void collect(bool wait_for_all);
+	void add_to_histograms(const Frame& frame, int sign);
+	static size_t bin_of(cl_ulong nanoseconds);
+	static double bin_upper_bound(size_t bin);
+	static const char* category_name(size_t category);
+};
+
+#endif //PROFILER_H
@@ -0,0 +1,272 @@
+/**
+ * FluidSim - a free and open-source interactive fluid flow simulator
+ * Copyright (C) 2015  Damian Jarek <damian.jarek93@gmail.com>
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License along
+ * with this program; if not, write to the Free Software Foundation, Inc.,
+ * 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+ */
+
+#include "program.h"
+#include "hash.h"
+#include "simulation.h"
+#ifdef FLUIDSIM_EMBED_KERNELS
+#include "kernels_source.h"
+#endif
+#include <cerrno>
+#include <cstdio>
+#include <cstdlib>
+#include <fstream>
+#include <iostream>
+#include <iterator>
+#include <sstream>
+#include <stdexcept>
+#include <string>
+#include <sys/stat.h>
+#include <unistd.h>
+
+using Binary = std::vector<unsigned char>;
+
+static const char binary_cache_magic[] = "FluidSim program binary 1";
+
+static std::string kernel_source()
+{
+#ifdef FLUIDSIM_EMBED_KERNELS
+	return embedded_kernels_source;
+#else
+	std::ifstream kernels_file("kernels/kernels.cl");
+	if (not kernels_file) {
+		throw std::runtime_error{"can't open kernels/kernels.cl, run FluidSim from the directory containing kernels/"
+					 " or build it with FLUIDSIM_EMBED_KERNELS"};
+	}
+	return {std::istreambuf_iterator<char>(kernels_file), std::istreambuf_iterator<char>()};
+#endif
+}
+
+//The defines are prepended to the kernels, so they're covered by the hash of the source
+static std::string program_source(const size_t size_x, const size_t size_y, const FieldStorage storage)
+{
+	std::string kernel_sources {"#define SIZE_X "};
+	kernel_sources.append(std::to_string(size_x));
+	kernel_sources.append("\n#define SIZE_Y ");
+	kernel_sources.append(std::to_string(size_y));
+	kernel_sources.append("\n#define JACOBI_BLOCK_SIZE ");
+	kernel_sources.append(std::to_string(Simulation::jacobi_block_size));
+	kernel_sources.append("\n#define JACOBI_TILE_SIZE ");
+	kernel_sources.append(std::to_string(Simulation::jacobi_tile_size));
+	kernel_sources.append("\n");
+	if (storage == FieldStorage::HALF) {
+		kernel_sources.append("#define HALF_STORAGE\n");
+	} else if (storage == FieldStorage::BFLOAT16) {
+		kernel_sources.append("#define BFLOAT16_STORAGE\n");
+	}
+#ifdef FLUIDSIM_TILED_STENCILS
+	kernel_sources.append("#define TILED_STENCILS\n#define TILE_SIZE ");
+	kernel_sources.append(std::to_string(Simulation::tile_size));
+	kernel_sources.append("\n");
+#endif
+	kernel_sources.append(kernel_source());
+	return kernel_sources;
+}
+
+static std::string to_hex(cl_ulong value)
+{
+	std::ostringstream hex;
+	hex << std::hex << value;
+	return hex.str();
+}
+
+//Anything that changes the compiled code of a device is a part of its key
+static std::string binary_key(const cl::Device& device, const std::string& source)
+{
+	return device.getInfo<CL_DEVICE_NAME>() + '\n' + device.getInfo<CL_DEVICE_VENDOR>() + '\n'
+	       + device.getInfo<CL_DEVICE_VERSION>() + '\n' + device.getInfo<CL_DRIVER_VERSION>() + '\n' + to_hex(fnv1a_hash(source.data(), source.size()));
+}
+
+static std::string binary_path(const std::string& cache_directory, const std::string& key)
+{
+	return cache_directory + '/' + to_hex(fnv1a_hash(key.data(), key.size())) + ".bin";
+}
+
+//The file starts with the magic line, followed by the size and contents of the key and then of the binary.
+//The stored key is compared with the expected one, so that hash collisions can't load a wrong binary.
+static bool read_cached_binary(const std::string& path, const std::string& key, Binary& binary)
+{
+	std::ifstream file{path, std::ios::binary};
+	std::string magic;
+	size_t key_size = 0;
+	if (not std::getline(file, magic) or magic != binary_cache_magic or not (file >> key_size) or file.get() != '\n') {
+		return false;
+	}
+
+	std::string stored_key(key_size, '\0');
+	size_t binary_size = 0;
+	if (not file.read(&stored_key[0], key_size) or stored_key != key or not (file >> binary_size) or file.get() != '\n'
+	    or binary_size == 0) {
+		return false;
+	}
+
+	binary.resize(binary_size);
+	return static_cast<bool>(file.read(reinterpret_cast<char*>(binary.data()), binary_size));
+}
+
+static void make_directories(const std::string& path)
+{
+	for (size_t separator = path.find('/', 1); ; separator = path.find('/', separator + 1)) {
+		const auto directory = path.substr(0, separator);
+		if (mkdir(directory.c_str(), 0755) != 0 and errno != EEXIST) {
+			throw std::runtime_error{"can't create " + directory};
+		}
+		if (separator == std::string::npos) {
+			break;
+		}
+	}
+}
+
+//Written to a temporary file first, so that concurrent runs never read a partial binary
+static void write_cached_binary(const std::string& path, const std::string& key, const Binary& binary)
+{
+	const auto temporary_path = path + '.' + std::to_string(getpid()) + ".tmp";
+	{
+		std::ofstream file{temporary_path, std::ios::binary};
+		file << binary_cache_magic << '\n' << key.size() << '\n' << key << '\n' << binary.size() << '\n';
+		file.write(reinterpret_cast<const char*>(binary.data()), binary.size());
+		if (not file) {
+			std::remove(temporary_path.c_str());
+			throw std::runtime_error{"can't write " + temporary_path};
+		}
+	}
+	if (std::rename(temporary_path.c_str(), path.c_str()) != 0) {
+		std::remove(temporary_path.c_str());
+		throw std::runtime_error{"can't rename " + temporary_path + " to " + path};
+	}
+}
+
+//The C++ bindings don't allocate the binaries, so the C API is used directly
+static std::vector<Binary> program_binaries(const cl::Program& program, size_t device_count)
+{
+	std::vector<size_t> sizes(device_count);
+	cl_int error = clGetProgramInfo(program(), CL_PROGRAM_BINARY_SIZES, sizes.size() * sizeof(size_t), sizes.data(), nullptr);
+	if (error != CL_SUCCESS) {
+		throw cl::Error{error, "clGetProgramInfo"};
+	}
+
+	std::vector<Binary> binaries(device_count);
+	std::vector<unsigned char*> pointers(device_count);
+	for (size_t i = 0; i < device_count; ++i) {
+		binaries[i].resize(sizes[i]);
+		pointers[i] = binaries[i].data();
+	}
+	error = clGetProgramInfo(program(), CL_PROGRAM_BINARIES, pointers.size() * sizeof(unsigned char*), pointers.data(), nullptr);
+	if (error != CL_SUCCESS) {
+		throw cl::Error{error, "clGetProgramInfo"};
+	}
+	return binaries;
+}
+
+//Returns a null program if any of the devices' binaries is missing or can't be built
+static cl::Program load_cached_program(const cl::Context& context, const std::vector<cl::Device>& devices,
+				       const std::string& source, const std::string& cache_directory)
+{
+	std::vector<Binary> binaries(devices.size());
+	cl::Program::Binaries binary_pointers;
+	for (size_t i = 0; i < devices.size(); ++i) {
+		const auto key = binary_key(devices[i], source);
+		if (not read_cached_binary(binary_path(cache_directory, key), key, binaries[i])) {
+			return cl::Program{};
+		}
+		binary_pointers.push_back(std::make_pair(binaries[i].data(), binaries[i].size()));
+	}
+
+	// A binary from an incompatible driver is rejected here, it's rebuilt from the source then
+	try {
+		cl::Program program{context, devices, binary_pointers};
+		program.build(devices);
+		return program;
+	} catch (const cl::Error&) {
+		return cl::Program{};
+	}
+}
+
+static void store_cached_program(const cl::Program& program, const std::string& source, const std::string& cache_directory)
+{
+	const auto devices = program.getInfo<CL_PROGRAM_DEVICES>();
+	const auto binaries = program_binaries(program, devices.size());
+	make_directories(cache_directory);
+	for (size_t i = 0; i < devices.size(); ++i) {
+		// Devices of the context the program wasn't built for have no binary
+		if (binaries[i].empty()) {
+			continue;
+		}
+		const auto key = binary_key(devices[i], source);
+		write_cached_binary(binary_path(cache_directory, key), key, binaries[i]);
+	}
+}
+
+cl::Program build_program(const cl::Context& context, const std::vector<cl::Device>& devices, cl_uint cells_x, cl_uint cells_y,
+			  FieldStorage storage, const std::string& binary_cache_directory)
+{
+	const auto source = program_source(cells_x, cells_y, storage);
+	if (not binary_cache_directory.empty()) {
+		auto program = load_cached_program(context, devices, source, binary_cache_directory);
+		if (program() != nullptr) {
+			return program;
+		}
+	}
+
+	cl::Program program{context, source};
+	try {
+		program.build(devices);
+	} catch(...) {
+		std::cerr << program.getBuildInfo<CL_PROGRAM_BUILD_LOG>(devices[0]) << std::endl;
+		throw;
+	}
+
+	// The cache only saves time, failing to update it isn't an error
+	if (not binary_cache_directory.empty()) {
+		try {
+			store_cached_program(program, source, binary_cache_directory);
+		} catch (const std::exception& error) {
+			std::cerr << "Program binary cache not updated: " << error.what() << std::endl;
+		}
+	}
+	return program;
+}
+
+std::string default_binary_cache_directory()
+{
+	if (const char* cache_home = std::getenv("XDG_CACHE_HOME")) {
+		return std::string{cache_home} + "/fluidsim";
+	}
+	if (const char* home = std::getenv("HOME")) {
+		return std::string{home} + "/.cache/fluidsim";
+	}
+	return {};
+}
+
+ProgramCache::ProgramCache(const cl::Context& context, const std::vector<cl::Device>& devices, std::string binary_cache_directory):
+	context(context),
+	devices(devices),
+	binary_cache_directory(std::move(binary_cache_directory))
+{
+}
+
+const cl::Program& ProgramCache::get(cl_uint cells_x, cl_uint cells_y, FieldStorage storage)
+{
+	const auto key = std::make_tuple(cells_x, cells_y, storage);
+	auto program = programs.find(key);
+	if (program == programs.end()) {
+		program = programs.emplace(key, build_program(context, devices, cells_x, cells_y, storage, binary_cache_directory)).first;
+	}
+	return program->second;
+}
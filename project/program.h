@@ -0,0 +1,57 @@
+/**
+ * FluidSim - a free and open-source interactive fluid flow simulator
+ * Copyright (C) 2015  Damian Jarek <damian.jarek93@gmail.com>
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License along
+ * with this program; if not, write to the Free Software Foundation, Inc.,
+ * 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+ */
+
+#ifndef PROGRAM_H
+#define PROGRAM_H
+
+#define __CL_ENABLE_EXCEPTIONS
+
+#include <CL/cl.hpp>
+#include "typedefs.h"
+
+#include <map>
+#include <string>
+#include <tuple>
+#include <vector>
+
+//Builds kernels/kernels.cl (or the copy embedded with FLUIDSIM_EMBED_KERNELS) for a grid of cells_x x cells_y cells
+//(boundary included) with the fields stored in the given format, the build log is printed if the build fails. The binaries are cached in binary_cache_directory,
+//keyed by the device, its driver version and the hash of the source with the defines, an empty directory disables
+//the cache.
+cl::Program build_program(const cl::Context& context, const std::vector<cl::Device>& devices, cl_uint cells_x, cl_uint cells_y,
+			  FieldStorage storage, const std::string& binary_cache_directory);
+
+//$XDG_CACHE_HOME/fluidsim or ~/.cache/fluidsim, empty if neither variable is set
+std::string default_binary_cache_directory();
+
+//The grid size and the field storage are compiled into the kernels, programs are built the first time they're requested
+//and reused afterwards
+class ProgramCache
+{
+	cl::Context context;
+	std::vector<cl::Device> devices;
+	std::string binary_cache_directory;
+	std::map<std::tuple<cl_uint, cl_uint, FieldStorage>, cl::Program> programs;
+public:
+	ProgramCache(const cl::Context& context, const std::vector<cl::Device>& devices, std::string binary_cache_directory);
+
+	const cl::Program& get(cl_uint cells_x, cl_uint cells_y, FieldStorage storage = FieldStorage::FLOAT);
+};
+
+#endif //PROGRAM_H
@@ -0,0 +1,503 @@
+/**
+ * FluidSim - a free and open-source interactive fluid flow simulator
+ * Copyright (C) 2015  Damian Jarek <damian.jarek93@gmail.com>
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License along
+ * with this program; if not, write to the Free Software Foundation, Inc.,
+ * 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+ */
+
+#include "recorder.h"
+#include <algorithm>
+#include <cstdint>
+#include <cstring>
+#include <iostream>
+#include <stdexcept>
+
+static const char recording_magic[8] = {'F', 'L', 'U', 'I', 'D', 'R', 'E', 'C'};
+static const char frame_magic[4] = {'F', 'R', 'A', 'M'};
+static const char index_magic[8] = {'F', 'L', 'U', 'I', 'D', 'I', 'D', 'X'};
+
+//On-disk layout, in the host's byte order. The header is followed by an entry per field.
+struct RecordingHeader {
+	char magic[8];
+	cl_uint version;
+	cl_uint cells_x;
+	cl_uint cells_y;
+	cl_uint storage;
+	cl_uint codec;
+	cl_uint field_count;
+};
+
+struct RecordingFieldEntry {
+	char name[16];
+	cl_uint channels;
+	cl_uint reserved;
+};
+
+//Followed by the size and the encoded data of each field
+struct FrameHeader {
+	char magic[4];
+	cl_uint field_count;
+	cl_ulong step;
+};
+
+//Last bytes of a closed recording, the index holds the step and the offset of each frame
+struct RecordingTrailer {
+	cl_ulong index_offset;
+	cl_ulong frame_count;
+	char magic[8];
+};
+
+//Each value XOR the value channels before it, with byte b of every value moved to the b-th plane
+template<typename Word>
+static void delta_shuffle(const unsigned char* values, size_t count, cl_uint channels, unsigned char* shuffled)
+{
+	for (size_t i = 0; i < count; ++i) {
+		Word value;
+		Word before = 0;
+		std::memcpy(&value, values + i * sizeof(Word), sizeof(Word));
+		if (i >= channels) {
+			std::memcpy(&before, values + (i - channels) * sizeof(Word), sizeof(Word));
+		}
+		const Word delta = value ^ before;
+		for (size_t byte = 0; byte < sizeof(Word); ++byte) {
+			shuffled[byte * count + i] = static_cast<unsigned char>(delta >> (8 * byte));
+		}
+	}
+}
+
+template<typename Word>
+static void delta_unshuffle(const unsigned char* shuffled, size_t count, cl_uint channels, unsigned char* values)
+{
+	for (size_t i = 0; i < count; ++i) {
+		Word delta = 0;
+		Word before = 0;
+		for (size_t byte = 0; byte < sizeof(Word); ++byte) {
+			delta |= static_cast<Word>(static_cast<Word>(shuffled[byte * count + i]) << (8 * byte));
+		}
+		if (i >= channels) {
+			std::memcpy(&before, values + (i - channels) * sizeof(Word), sizeof(Word));
+		}
+		const Word value = delta ^ before;
+		std::memcpy(values + i * sizeof(Word), &value, sizeof(Word));
+	}
+}
+
+//A control byte below 0x80 is followed by that many literal bytes plus 1, from 0x80 up it stands for
+//that many zero bytes minus 0x7F. Single zeros are kept in the literal runs.
+static void compress_zero_runs(const unsigned char* data, size_t size, std::vector<unsigned char>& out)
+{
+	const size_t max_run = 128;
+	size_t i = 0;
+	while (i < size) {
+		size_t zeros = 0;
+		while (i + zeros < size and zeros < max_run and data[i + zeros] == 0) {
+			++zeros;
+		}
+		if (zeros >= 2) {
+			out.push_back(static_cast<unsigned char>(0x7F + zeros));
+			i += zeros;
+			continue;
+		}
+
+		size_t length = 0;
+		while (i + length < size and length < max_run
+		       and not (data[i + length] == 0 and i + length + 1 < size and data[i + length + 1] == 0)) {
+			++length;
+		}
+		out.push_back(static_cast<unsigned char>(length - 1));
+		out.insert(out.end(), data + i, data + i + length);
+		i += length;
+	}
+}
+
+static bool expand_zero_runs(const unsigned char* data, size_t size, unsigned char* out, size_t out_size)
+{
+	size_t written = 0;
+	size_t i = 0;
+	while (i < size) {
+		const unsigned control = data[i++];
+		if (control >= 0x80) {
+			const size_t zeros = control - 0x7F;
+			if (written + zeros > out_size) {
+				return false;
+			}
+			std::memset(out + written, 0, zeros);
+			written += zeros;
+		} else {
+			const size_t length = control + 1;
+			if (i + length > size or written + length > out_size) {
+				return false;
+			}
+			std::memcpy(out + written, data + i, length);
+			i += length;
+			written += length;
+		}
+	}
+	return written == out_size;
+}
+
+static Scalar bits_to_float(cl_uint bits)
+{
+	Scalar value;
+	std::memcpy(&value, &bits, sizeof(value));
+	return value;
+}
+
+static Scalar half_to_float(cl_half value)
+{
+	const cl_uint sign = static_cast<cl_uint>(value & 0x8000) << 16;
+	cl_uint exponent = (value >> 10) & 0x1F;
+	cl_uint mantissa = value & 0x3FF;
+	if (exponent == 0x1F) {
+		return bits_to_float(sign | 0x7F800000 | mantissa << 13);
+	}
+	if (exponent != 0) {
+		return bits_to_float(sign | (exponent + 112) << 23 | mantissa << 13);
+	}
+	if (mantissa == 0) {
+		return bits_to_float(sign);
+	}
+	// Subnormals are normalized, a float has enough exponent range for them
+	exponent = 113;
+	while (not (mantissa & 0x400)) {
+		mantissa <<= 1;
+		--exponent;
+	}
+	return bits_to_float(sign | exponent << 23 | (mantissa & 0x3FF) << 13);
+}
+
+FieldRecorder::FieldRecorder(const std::string& path, cl_uint cells_x, cl_uint cells_y, FieldStorage storage,
+			     std::vector<RecordedField> fields, RecordingCodec codec, size_t capacity):
+	file(path, std::ios::binary),
+	fields(std::move(fields)),
+	cell_count(cells_x * cells_y),
+	scalar_size(stored_scalar_size(storage)),
+	codec(codec),
+	capacity(capacity)
+{
+	if (not file) {
+		throw std::runtime_error{"can't create " + path};
+	}
+
+	RecordingHeader header {};
+	std::memcpy(header.magic, recording_magic, sizeof(recording_magic));
+	header.version = recording_version;
+	header.cells_x = cells_x;
+	header.cells_y = cells_y;
+	header.storage = static_cast<cl_uint>(storage);
+	header.codec = static_cast<cl_uint>(codec);
+	header.field_count = this->fields.size();
+	write(&header, sizeof(header));
+	for (const auto& field : this->fields) {
+		RecordingFieldEntry entry {};
+		field.name.copy(entry.name, sizeof(entry.name) - 1);
+		entry.channels = field.channels;
+		write(&entry, sizeof(entry));
+	}
+
+	thread = std::thread{&FieldRecorder::run, this};
+}
+
+FieldRecorder::~FieldRecorder()
+{
+	{
+		std::lock_guard<std::mutex> lock{mutex};
+		stopping = true;
+	}
+	condition.notify_all();
+	thread.join();
+
+	// Without the index the recording can still be read by scanning it
+	if (failure) {
+		return;
+	}
+	try {
+		RecordingTrailer trailer {};
+		trailer.index_offset = offset;
+		trailer.frame_count = index.size() / 2;
+		std::memcpy(trailer.magic, index_magic, sizeof(index_magic));
+		write(index.data(), index.size() * sizeof(cl_ulong));
+		write(&trailer, sizeof(trailer));
+		file.flush();
+	} catch (const std::exception& error) {
+		std::cerr << "Recording index not written: " << error.what() << std::endl;
+	}
+}
+
+cl_ulong FieldRecorder::submit(cl_ulong step, std::vector<const void*> data, std::vector<cl::Event> ready)
+{
+	std::unique_lock<std::mutex> lock{mutex};
+	condition.wait(lock, [&] { return queue.size() < capacity; });
+	queue.push_back(Frame{step, std::move(data), std::move(ready)});
+	condition.notify_all();
+	return submitted_count++;
+}
+
+void FieldRecorder::wait(cl_ulong frame)
+{
+	std::unique_lock<std::mutex> lock{mutex};
+	condition.wait(lock, [&] { return written_count > frame; });
+	if (failure) {
+		std::rethrow_exception(failure);
+	}
+}
+
+//Frames queued before the recorder is destroyed are still written. After a failure the remaining frames are
+//only dequeued, so that nobody waits for them forever.
+void FieldRecorder::run()
+{
+	std::unique_lock<std::mutex> lock{mutex};
+	while (true) {
+		condition.wait(lock, [&] { return not queue.empty() or stopping; });
+		if (queue.empty()) {
+			return;
+		}
+
+		// The producer only appends to the queue, which doesn't move its front
+		const Frame& frame = queue.front();
+		const bool failed = static_cast<bool>(failure);
+		lock.unlock();
+		std::exception_ptr error;
+		try {
+			if (not frame.ready.empty()) {
+				cl::Event::waitForEvents(frame.ready);
+			}
+			if (not failed) {
+				write_frame(frame);
+			}
+		} catch (...) {
+			error = std::current_exception();
+		}
+		lock.lock();
+
+		if (error and not failure) {
+			failure = error;
+		}
+		queue.pop_front();
+		++written_count;
+		condition.notify_all();
+	}
+}
+
+void FieldRecorder::write_frame(const Frame& frame)
+{
+	const cl_ulong frame_offset = offset;
+	FrameHeader header {};
+	std::memcpy(header.magic, frame_magic, sizeof(frame_magic));
+	header.field_count = fields.size();
+	header.step = frame.step;
+	write(&header, sizeof(header));
+
+	for (size_t i = 0; i < fields.size(); ++i) {
+		const auto data = static_cast<const unsigned char*>(frame.data[i]);
+		const size_t count = cell_count * fields[i].channels;
+		const cl_ulong size = count * scalar_size;
+		if (codec == RecordingCodec::RAW) {
+			write(&size, sizeof(size));
+			write(data, size);
+			continue;
+		}
+
+		shuffled.resize(size);
+		if (scalar_size == sizeof(cl_uint)) {
+			delta_shuffle<cl_uint>(data, count, fields[i].channels, shuffled.data());
+		} else {
+			delta_shuffle<cl_ushort>(data, count, fields[i].channels, shuffled.data());
+		}
+		encoded.clear();
+		compress_zero_runs(shuffled.data(), shuffled.size(), encoded);
+		const cl_ulong encoded_size = encoded.size();
+		write(&encoded_size, sizeof(encoded_size));
+		write(encoded.data(), encoded.size());
+	}
+
+	// Flushed so that a crashed run leaves whole frames behind
+	file.flush();
+	index.push_back(frame.step);
+	index.push_back(frame_offset);
+}
+
+void FieldRecorder::write(const void* data, size_t size)
+{
+	file.write(static_cast<const char*>(data), size);
+	if (not file) {
+		throw std::runtime_error{"can't write the recording"};
+	}
+	offset += size;
+}
+
+RecordingReader::RecordingReader(const std::string& path):
+	file(path, std::ios::binary)
+{
+	RecordingHeader header;
+	if (not file.read(reinterpret_cast<char*>(&header), sizeof(header))
+	    or std::memcmp(header.magic, recording_magic, sizeof(recording_magic)) != 0 or header.version != recording_version
+	    or header.storage > static_cast<cl_uint>(FieldStorage::BFLOAT16) or header.codec > static_cast<cl_uint>(RecordingCodec::DELTA)) {
+		throw std::runtime_error{path + " isn't a version " + std::to_string(recording_version) + " recording"};
+	}
+	cells_x = header.cells_x;
+	cells_y = header.cells_y;
+	storage = static_cast<FieldStorage>(header.storage);
+	codec = static_cast<RecordingCodec>(header.codec);
+
+	for (cl_uint i = 0; i < header.field_count; ++i) {
+		RecordingFieldEntry entry;
+		if (not file.read(reinterpret_cast<char*>(&entry), sizeof(entry)) or entry.channels == 0 or entry.channels > 2) {
+			throw std::runtime_error{path + " is damaged"};
+		}
+		fields.push_back(RecordedField{std::string{entry.name, strnlen(entry.name, sizeof(entry.name))}, entry.channels});
+	}
+	const cl_ulong frames_begin = file.tellg();
+
+	file.seekg(0, std::ios::end);
+	const cl_ulong end = file.tellg();
+	RecordingTrailer trailer;
+	if (end >= frames_begin + sizeof(trailer)) {
+		file.seekg(end - sizeof(trailer));
+		file.read(reinterpret_cast<char*>(&trailer), sizeof(trailer));
+	}
+	const bool indexed = file and end >= frames_begin + sizeof(trailer)
+			     and std::memcmp(trailer.magic, index_magic, sizeof(index_magic)) == 0
+			     and trailer.index_offset >= frames_begin and trailer.index_offset <= end - sizeof(trailer)
+			     and end - sizeof(trailer) - trailer.index_offset == trailer.frame_count * 2 * sizeof(cl_ulong);
+	if (not indexed) {
+		file.clear();
+		scan_frames(frames_begin, end);
+		return;
+	}
+
+	std::vector<cl_ulong> index(2 * trailer.frame_count);
+	file.seekg(trailer.index_offset);
+	if (not file.read(reinterpret_cast<char*>(index.data()), index.size() * sizeof(cl_ulong))) {
+		throw std::runtime_error{path + " is damaged"};
+	}
+	for (size_t i = 0; i < index.size(); i += 2) {
+		steps.push_back(index[i]);
+		offsets.push_back(index[i + 1]);
+	}
+}
+
+//Rebuilds the index of a recording that wasn't closed, a frame cut off by the end of the file is left out
+void RecordingReader::scan_frames(cl_ulong begin, cl_ulong end)
+{
+	cl_ulong frame_offset = begin;
+	while (true) {
+		FrameHeader header;
+		file.seekg(frame_offset);
+		if (not file.read(reinterpret_cast<char*>(&header), sizeof(header))
+		    or std::memcmp(header.magic, frame_magic, sizeof(frame_magic)) != 0 or header.field_count != fields.size()) {
+			break;
+		}
+
+		cl_ulong next = frame_offset + sizeof(header);
+		for (cl_uint i = 0; i < header.field_count and next <= end; ++i) {
+			cl_ulong size = 0;
+			file.seekg(next);
+			if (not file.read(reinterpret_cast<char*>(&size), sizeof(size))) {
+				next = end + 1;
+				break;
+			}
+			next += sizeof(size) + size;
+		}
+		if (next > end) {
+			break;
+		}
+		steps.push_back(header.step);
+		offsets.push_back(frame_offset);
+		frame_offset = next;
+	}
+	file.clear();
+}
+
+cl_uint RecordingReader::grid_width() const
+{
+	return cells_x;
+}
+
+cl_uint RecordingReader::grid_height() const
+{
+	return cells_y;
+}
+
+const std::vector<RecordedField>& RecordingReader::recorded_fields() const
+{
+	return fields;
+}
+
+size_t RecordingReader::frame_count() const
+{
+	return offsets.size();
+}
+
+cl_ulong RecordingReader::step(size_t frame) const
+{
+	return steps.at(frame);
+}
+
+std::vector<Scalar> RecordingReader::read(size_t frame, const std::string& field)
+{
+	const auto field_index = std::find_if(fields.begin(), fields.end(), [&](const RecordedField& recorded) { return recorded.name == field; })
+				 - fields.begin();
+	if (static_cast<size_t>(field_index) == fields.size()) {
+		throw std::invalid_argument{"the recording has no " + field + " field"};
+	}
+
+	// Skips to the field's data, past the sizes and data of the fields before it
+	file.seekg(offsets.at(frame) + sizeof(FrameHeader));
+	cl_ulong size = 0;
+	for (ptrdiff_t i = 0; i <= field_index; ++i) {
+		if (i != 0) {
+			file.seekg(size, std::ios::cur);
+		}
+		file.read(reinterpret_cast<char*>(&size), sizeof(size));
+	}
+	std::vector<unsigned char> data(size);
+	if (not file or not file.read(reinterpret_cast<char*>(data.data()), size)) {
+		file.clear();
+		throw std::runtime_error{"the recording is damaged"};
+	}
+
+	const size_t count = static_cast<size_t>(cells_x) * cells_y * fields[field_index].channels;
+	const size_t scalar_size = stored_scalar_size(storage);
+	std::vector<unsigned char> values(count * scalar_size);
+	if (codec == RecordingCodec::RAW) {
+		if (data.size() != values.size()) {
+			throw std::runtime_error{"the recording is damaged"};
+		}
+		values.swap(data);
+	} else {
+		std::vector<unsigned char> shuffled(values.size());
+		if (not expand_zero_runs(data.data(), data.size(), shuffled.data(), shuffled.size())) {
+			throw std::runtime_error{"the recording is damaged"};
+		}
+		if (scalar_size == sizeof(cl_uint)) {
+			delta_unshuffle<cl_uint>(shuffled.data(), count, fields[field_index].channels, values.data());
+		} else {
+			delta_unshuffle<cl_ushort>(shuffled.data(), count, fields[field_index].channels, values.data());
+		}
+	}
+
+	std::vector<Scalar> result(count);
+	for (size_t i = 0; i < count; ++i) {
+		if (storage == FieldStorage::FLOAT) {
+			std::memcpy(&result[i], &values[i * sizeof(Scalar)], sizeof(Scalar));
+			continue;
+		}
+		cl_ushort value;
+		std::memcpy(&value, &values[i * sizeof(value)], sizeof(value));
+		result[i] = storage == FieldStorage::HALF ? half_to_float(value) : bits_to_float(static_cast<cl_uint>(value) << 16);
+	}
+	return result;
+}
@@ -0,0 +1,130 @@
+/**
+ * FluidSim - a free and open-source interactive fluid flow simulator
+ * Copyright (C) 2015  Damian Jarek <damian.jarek93@gmail.com>
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License along
+ * with this program; if not, write to the Free Software Foundation, Inc.,
+ * 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+ */
+
+#ifndef RECORDER_H
+#define RECORDER_H
+
+#define __CL_ENABLE_EXCEPTIONS
+
+#include <CL/cl.hpp>
+
+#include "typedefs.h"
+
+#include <condition_variable>
+#include <deque>
+#include <exception>
+#include <fstream>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <vector>
+
+//Recordings hold the fields of a simulation every few updates, for offline analysis. The file starts with a header
+//describing the grid and the fields, followed by the frames and an index of the frames' offsets at the end, so that
+//any frame can be read without the ones before it. A recording that wasn't closed has no index, the frames are
+//found by scanning the file then.
+constexpr cl_uint recording_version = 1;
+
+//DELTA stores each value XOR the previous value of the same component, with the bytes of the values grouped by
+//their position and runs of zero bytes collapsed. Neighbouring values of smooth fields share their sign, exponent
+//and high mantissa bits, so most of the high bytes become runs of zeros. Every frame is encoded on its own.
+enum class RecordingCodec {
+	RAW,
+	DELTA
+};
+
+struct RecordedField {
+	std::string name;
+	cl_uint channels; //components per cell, 1 for scalar and 2 for vector fields
+};
+
+//Writes a recording on its own thread. Frames are queued with the events their data waits for, so the fields can
+//still be on their way from the device, the queue holds at most capacity frames.
+class FieldRecorder
+{
+	struct Frame {
+		cl_ulong step;
+		std::vector<const void*> data;
+		std::vector<cl::Event> ready;
+	};
+
+	std::ofstream file;
+	const std::vector<RecordedField> fields;
+	const size_t cell_count;
+	const size_t scalar_size;
+	const RecordingCodec codec;
+	const size_t capacity;
+	std::vector<cl_ulong> index; //the step and the offset of each written frame, interleaved
+	cl_ulong offset {0}; //of the end of the file
+	std::vector<unsigned char> shuffled;
+	std::vector<unsigned char> encoded;
+
+	std::mutex mutex;
+	std::condition_variable condition;
+	std::deque<Frame> queue;
+	cl_ulong submitted_count {0};
+	cl_ulong written_count {0};
+	bool stopping {false};
+	std::exception_ptr failure;
+	std::thread thread;
+public:
+	//Throws std::runtime_error if the file can't be created
+	FieldRecorder(const std::string& path, cl_uint cells_x, cl_uint cells_y, FieldStorage storage,
+		      std::vector<RecordedField> fields, RecordingCodec codec, size_t capacity);
+	//Writes the queued frames and the index
+	~FieldRecorder();
+
+	//Queues a frame of the fields' data in the storage format, blocks while the queue is full. The data has to stay
+	//valid until the frame is written, frames are numbered from 0 in the order they're submitted.
+	cl_ulong submit(cl_ulong step, std::vector<const void*> data, std::vector<cl::Event> ready);
+	//Blocks until the frame is written, rethrows the exception the writing failed with
+	void wait(cl_ulong frame);
+private:
+	void run();
+	void write_frame(const Frame& frame);
+	void write(const void* data, size_t size);
+};
+
+//Random access to the frames of a recording, throws std::runtime_error if the file isn't a recording of this
+//version or is damaged
+class RecordingReader
+{
+	std::ifstream file;
+	cl_uint cells_x;
+	cl_uint cells_y;
+	FieldStorage storage;
+	RecordingCodec codec;
+	std::vector<RecordedField> fields;
+	std::vector<cl_ulong> steps;
+	std::vector<cl_ulong> offsets;
+public:
+	explicit RecordingReader(const std::string& path);
+
+	cl_uint grid_width() const;
+	cl_uint grid_height() const;
+	const std::vector<RecordedField>& recorded_fields() const;
+	size_t frame_count() const;
+	cl_ulong step(size_t frame) const;
+	//Values of the field in the frame, converted to floats, components of a cell are adjacent
+	std::vector<Scalar> read(size_t frame, const std::string& field);
+private:
+	void scan_frames(cl_ulong begin, cl_ulong end);
+};
+
+#endif //RECORDER_H
@@ -18,61 +18,210 @@
  */
 
 #include "simulation.h"
+#include "decomposition.h"
+#include "hash.h"
+#include "snapshot.h"
 #include <algorithm>
 #include <iostream>
+#include <cmath>
+#include <exception>
+#include <stdexcept>
+
+constexpr cl_int jacobi_block_sweeps = 4; //iterations per launch of the temporally blocked Jacobi kernels
+constexpr auto multigrid_cycles = 2;
+constexpr auto multigrid_smoothing_iterations = 2;
+constexpr auto multigrid_coarsest_iterations = 32;
+constexpr cl_uint multigrid_coarsest_inner_cell_count = 8;
+constexpr Scalar multigrid_smoothing_weight = 0.8; //optimal damping of the weighted Jacobi smoother for the 5-point stencil
+constexpr auto conjugate_gradient_max_iterations = 100;
+constexpr cl_uint max_reduction_local_size = 16;
+constexpr cl_uint max_inner_local_size = 16;
+constexpr size_t readback_buffer_count = 3;
+//Slots of the reduction results buffer, the conjugate gradient method alternates rho between the first two
+constexpr cl_uint residual_result_index = 0;
+constexpr cl_uint cg_d_dot_q_result_index = 2;
+constexpr cl_uint reduction_result_count = 3;
+
+std::vector<Event> default_emitters(cl_uint cells_x, cl_uint cells_y)
+{
+	std::vector<Event> emitters;
+	for (int i = 1; i < 10; ++i) {
+		Event emitter;
+		emitter.point = Point{static_cast<cl_int>(i * 0.1 * cells_x), static_cast<cl_int>(cells_y * 0.8)};
+		emitter.type = Event::Type::APPLY_FORCE;
+		emitter.value.as_vector = Vector{0, -20.0};
+		emitters.push_back(emitter);
+		emitter.type = Event::Type::ADD_DYE;
+		emitter.value.as_scalar = Scalar{0.01};
+		emitters.push_back(emitter);
+	}
+	return emitters;
+}
+
+//Scalar parameters by their names in event traces
+static const std::pair<const char*, Scalar SimulationParameters::*> scalar_parameters[] = {
+	{"time_step", &SimulationParameters::time_step},
+	{"dx", &SimulationParameters::dx},
+	{"viscosity", &SimulationParameters::viscosity},
+	{"velocity_dissipation", &SimulationParameters::velocity_dissipation},
+	{"dye_dissipation", &SimulationParameters::dye_dissipation},
+	{"vorticity_scale", &SimulationParameters::vorticity_scale}
+};
+
+static const std::string& trace_setting(const TraceSettings& settings, const std::string& name)
+{
+	const auto setting = settings.find(name);
+	if (setting == settings.end()) {
+		throw std::invalid_argument{"The trace has no " + name + " setting"};
+	}
+	return setting->second;
+}
 
-constexpr auto jacobi_iterations = 100;
+//The std::sto* functions throw std::invalid_argument for malformed values too, but don't name the setting
+template<typename Parse>
+static auto parse_trace_setting(const TraceSettings& settings, const std::string& name, Parse parse) -> decltype(parse(std::string{}))
+{
+	const auto& value = trace_setting(settings, name);
+	try {
+		return parse(value);
+	} catch (const std::exception&) {
+		throw std::invalid_argument{"Malformed " + name + " setting in the trace: " + value};
+	}
+}
+
+static cl_uint parse_uint_setting(const TraceSettings& settings, const std::string& name)
+{
+	return parse_trace_setting(settings, name, [](const std::string& value) { return static_cast<cl_uint>(std::stoul(value)); });
+}
+
+static Scalar parse_scalar_setting(const TraceSettings& settings, const std::string& name)
+{
+	return parse_trace_setting(settings, name, [](const std::string& value) { return std::stof(value); });
+}
+
+TraceSettings parameter_settings(const SimulationParameters& parameters)
+{
+	TraceSettings settings;
+	settings["cells_x"] = std::to_string(parameters.cells_x);
+	settings["cells_y"] = std::to_string(parameters.cells_y);
+	settings["storage"] = std::to_string(static_cast<cl_uint>(parameters.storage));
+	for (const auto& parameter : scalar_parameters) {
+		settings[parameter.first] = setting_text(parameters.*parameter.second);
+	}
+	return settings;
+}
+
+SimulationParameters settings_parameters(const TraceSettings& settings)
+{
+	SimulationParameters parameters;
+	parameters.cells_x = parse_uint_setting(settings, "cells_x");
+	parameters.cells_y = parse_uint_setting(settings, "cells_y");
+	const cl_uint storage = parse_uint_setting(settings, "storage");
+	if (storage > static_cast<cl_uint>(FieldStorage::BFLOAT16)) {
+		throw std::invalid_argument{"Unknown storage in the trace: " + std::to_string(storage)};
+	}
+	parameters.storage = static_cast<FieldStorage>(storage);
+	for (const auto& parameter : scalar_parameters) {
+		parameters.*parameter.second = parse_scalar_setting(settings, parameter.first);
+	}
+	return parameters;
+}
+
+//A zero-initialized field of size bytes
+static cl::Buffer create_field(const cl::Context& context, size_t size)
+{
+	std::vector<cl_uchar> zeros(size, 0);
+	return cl::Buffer{context, CL_MEM_READ_WRITE | CL_MEM_COPY_HOST_PTR, size, zeros.data()};
+}
 
 Simulation::Simulation(cl::CommandQueue cmd_queue,
 		       const cl::Context& context,
-		       cl_uint cell_count,
+		       const SimulationParameters& parameters,
 		       const cl::Program& program,
-		       Channel_ptr<ScalarField> to_ui,
+		       Mailbox_ptr<PixelField> to_ui,
 		       Channel_ptr<Event> events_from_ui,
 		       cl_uint workgroup_size):
 	cmd_queue(cmd_queue),
-	cell_count(cell_count),
-	total_cell_count(cell_count * cell_count),
+	parameters(parameters),
+	cells_x(parameters.cells_x),
+	cells_y(parameters.cells_y),
+	total_cell_count(cells_x * cells_y),
+	scalar_size(stored_scalar_size(parameters.storage)),
 	vector_advection_kernel(program, "advect_vector"),
 	scalar_advection_kernel(program, "advect_scalar"),
 	scalar_jacobi_kernel(program, "scalar_jacobi_iteration"),
 	vector_jacobi_kernel(program, "vector_jacobi_iteration"),
+	scalar_jacobi_folded_kernel(program, "scalar_jacobi_iteration_folded"),
+	vector_jacobi_folded_kernel(program, "vector_jacobi_iteration_folded"),
+	scalar_sor_kernel(program, "scalar_sor_iteration"),
+	vector_sor_kernel(program, "vector_sor_iteration"),
+	scalar_jacobi_blocked_kernel(program, "scalar_jacobi_blocked"),
+	vector_jacobi_blocked_kernel(program, "vector_jacobi_blocked"),
+	advect_velocity_and_dye_kernel(program, "advect_velocity_and_dye"),
+	vorticity_confinement_kernel(program, "vorticity_confinement"),
+	subtract_pressure_gradient_kernel(program, "subtract_pressure_gradient"),
 	divergence_kernel(program, "divergence"),
 	gradient_kernel(program, "gradient"),
 	subtract_gradient_p_kernel(program, "subtract_gradient_p"),
 	vector_boundary_kernel(program, "vector_boundary_condition"),
 	scalar_boundary_kernel(program, "scalar_boundary_condition"),
-	apply_impulse_kernel(program, "apply_impulse"),
-	add_dye_kernel(program, "add_dye"),
+	apply_force_sources_kernel(program, "apply_force_sources"),
+	add_dye_sources_kernel(program, "add_dye_sources"),
 	dye_boundary_conditions_kernel(program, "apply_dye_boundary_conditions"),
 	vorticity_kernel(program, "vorticity"),
 	apply_vorticity_kernel(program, "apply_voritcity_force"),
 	apply_gravity_kernel(program, "apply_gravity"),
+	multigrid_smooth_kernel(program, "multigrid_smooth"),
+	multigrid_residual_kernel(program, "multigrid_residual"),
+	multigrid_restrict_kernel(program, "multigrid_restrict"),
+	multigrid_prolongate_kernel(program, "multigrid_prolongate"),
+	multigrid_boundary_kernel(program, "multigrid_boundary_condition"),
+	scalar_jacobi_residual_kernel(program, "scalar_jacobi_residual"),
+	vector_jacobi_residual_kernel(program, "vector_jacobi_residual"),
+	reduce_sum_kernel(program, "reduce_sum"),
+	cg_initialize_kernel(program, "cg_initialize"),
+	cg_apply_operator_kernel(program, "cg_apply_operator"),
+	cg_update_solution_kernel(program, "cg_update_solution"),
+	cg_update_direction_kernel(program, "cg_update_direction"),
+	visualize_scalar_kernel(program, "visualize_scalar"),
+	visualize_speed_kernel(program, "visualize_speed"),
+	visualize_vorticity_kernel(program, "visualize_vorticity"),
+	unpack_scalar_field_kernel(program, "unpack_scalar_field"),
 	to_ui(to_ui),
 	events_from_ui(events_from_ui),
-	zero_vector_buffer(total_cell_count, Vector{0.0, 0.0}),
 	workgroup_size(workgroup_size)
 {
-	ScalarField scalar_buffer(total_cell_count, Scalar{0.0});
-
-	u = cl::Buffer{context, zero_vector_buffer.begin(), zero_vector_buffer.end(), false};
-	w = cl::Buffer{context, zero_vector_buffer.begin(), zero_vector_buffer.end(), false};
-	gradient_p = cl::Buffer{context, zero_vector_buffer.begin(), zero_vector_buffer.end(), false};
-	temporary_w = cl::Buffer{context, zero_vector_buffer.begin(), zero_vector_buffer.end(), false};
-
-	p = cl::Buffer{context, scalar_buffer.begin(), scalar_buffer.end(), false};
-	temporary_p = cl::Buffer{context, scalar_buffer.begin(), scalar_buffer.end(), false};
-	divergence_w = cl::Buffer{context, scalar_buffer.begin(), scalar_buffer.end(), false};
-	dye = cl::Buffer{context, scalar_buffer.begin(), scalar_buffer.end(), false};
+	const size_t scalar_field_size = total_cell_count * scalar_size;
+	const size_t vector_field_size = 2 * scalar_field_size;
+
+	u = create_field(context, vector_field_size);
+	w = create_field(context, vector_field_size);
+	gradient_p = create_field(context, vector_field_size);
+	temporary_w = create_field(context, vector_field_size);
+
+	p = create_field(context, scalar_field_size);
+	temporary_p = create_field(context, scalar_field_size);
+	divergence_w = create_field(context, scalar_field_size);
+	dye = create_field(context, scalar_field_size);
+	cg_r = create_field(context, scalar_field_size);
+	cg_z = create_field(context, scalar_field_size);
+	cg_d = create_field(context, scalar_field_size);
+	cg_q = create_field(context, scalar_field_size);
+
+	readbacks.resize(readback_buffer_count);
+	for (auto& readback : readbacks) {
+		readback.staging = cl::Buffer{context, CL_MEM_WRITE_ONLY | CL_MEM_ALLOC_HOST_PTR, total_cell_count * sizeof(Pixel)};
+	}
+	colormap = cl::Buffer{context, CL_MEM_READ_ONLY, colormap_size * sizeof(Pixel)};
 
-	const Scalar time_step = .1;
-	const Scalar dx = .2;
+	const Scalar time_step = parameters.time_step;
+	const Scalar dx = parameters.dx;
 	const Scalar dx_reciprocal = 1 / dx;
 	const Scalar halved_dx_reciprocal = dx_reciprocal * 0.5;
-	const auto velocity_dissipation = Vector{0.99, 0.99};
-	const Scalar dye_dissipation = 0.999;
-	const Scalar ni = 1.13e-3;
-	const Scalar vorticity_confinemnet_scale{0.35};
+	const auto velocity_dissipation = Vector{parameters.velocity_dissipation, parameters.velocity_dissipation};
+	const Scalar dye_dissipation = parameters.dye_dissipation;
+	const Scalar ni = parameters.viscosity;
+	const Scalar vorticity_confinemnet_scale = parameters.vorticity_scale;
 	const Vector vorticity_dx_scale{vorticity_confinemnet_scale * dx, vorticity_confinemnet_scale * dx};
 	vector_advection_kernel.setArg(0, u);
 	vector_advection_kernel.setArg(1, u);
@@ -105,6 +254,35 @@ Simulation::Simulation(cl::CommandQueue cmd_queue,
 	vector_jacobi_kernel.setArg(3, alpha);
 	vector_jacobi_kernel.setArg(4, 1/(4 + alpha));
 
+	scalar_jacobi_folded_kernel.setArg(3, Scalar{-dx * dx});
+	scalar_jacobi_folded_kernel.setArg(4, Scalar{0.25});
+	scalar_jacobi_folded_kernel.setArg(5, Scalar{1});
+
+	vector_jacobi_folded_kernel.setArg(3, alpha);
+	vector_jacobi_folded_kernel.setArg(4, 1/(4 + alpha));
+	vector_jacobi_folded_kernel.setArg(5, Scalar{-1});
+
+	scalar_sor_kernel.setArg(1, divergence_w);
+	scalar_sor_kernel.setArg(2, Scalar{-dx * dx});
+	scalar_sor_kernel.setArg(3, Scalar{0.25});
+
+	vector_sor_kernel.setArg(2, alpha);
+	vector_sor_kernel.setArg(3, 1/(4 + alpha));
+
+	scalar_jacobi_blocked_kernel.setArg(3, Scalar{-dx * dx});
+	scalar_jacobi_blocked_kernel.setArg(4, Scalar{0.25});
+	scalar_jacobi_blocked_kernel.setArg(5, Scalar{1});
+
+	vector_jacobi_blocked_kernel.setArg(3, alpha);
+	vector_jacobi_blocked_kernel.setArg(4, 1/(4 + alpha));
+	vector_jacobi_blocked_kernel.setArg(5, Scalar{-1});
+
+	scalar_jacobi_residual_kernel.setArg(4, Scalar{-dx * dx});
+	scalar_jacobi_residual_kernel.setArg(5, Scalar{0.25});
+
+	vector_jacobi_residual_kernel.setArg(4, alpha);
+	vector_jacobi_residual_kernel.setArg(5, 1/(4 + alpha));
+
 	gradient_kernel.setArg(0, p);
 	gradient_kernel.setArg(1, gradient_p);
 	gradient_kernel.setArg(2, halved_dx_reciprocal);
@@ -113,9 +291,13 @@ Simulation::Simulation(cl::CommandQueue cmd_queue,
 	subtract_gradient_p_kernel.setArg(1, gradient_p);
 	subtract_gradient_p_kernel.setArg(2, u);
 
-	apply_impulse_kernel.setArg(4, time_step);
+	apply_force_sources_kernel.setArg(3, source_cutoff_ranges);
+	apply_force_sources_kernel.setArg(4, time_step);
+
+	add_dye_sources_kernel.setArg(3, source_cutoff_ranges);
+	add_dye_sources_kernel.setArg(4, time_step);
 
-	add_dye_kernel.setArg(4, time_step);
+	emitters = default_emitters(cells_x, cells_y);
 
 	vorticity_kernel.setArg(0, w);
 	vorticity_kernel.setArg(1, temporary_p);
@@ -129,43 +311,406 @@ Simulation::Simulation(cl::CommandQueue cmd_queue,
 	apply_vorticity_kernel.setArg(5, vorticity_dx_scale);
 
 	apply_gravity_kernel.setArg(0, temporary_w);
+
+	advect_velocity_and_dye_kernel.setArg(4, dx_reciprocal);
+	advect_velocity_and_dye_kernel.setArg(5, time_step);
+	advect_velocity_and_dye_kernel.setArg(6, velocity_dissipation);
+	advect_velocity_and_dye_kernel.setArg(7, dye_dissipation);
+
+	vorticity_confinement_kernel.setArg(2, halved_dx_reciprocal);
+	vorticity_confinement_kernel.setArg(3, time_step);
+	vorticity_confinement_kernel.setArg(4, vorticity_dx_scale);
+
+	create_multigrid_levels(context, dx);
+
+	// The residual kernels reduce whole work-groups in local memory, so their (square) work-groups have to fit on the device
+	const auto device = cmd_queue.getInfo<CL_QUEUE_DEVICE>();
+	const size_t max_group_size = std::min({device.getInfo<CL_DEVICE_MAX_WORK_GROUP_SIZE>(),
+						scalar_jacobi_residual_kernel.getWorkGroupInfo<CL_KERNEL_WORK_GROUP_SIZE>(device),
+						vector_jacobi_residual_kernel.getWorkGroupInfo<CL_KERNEL_WORK_GROUP_SIZE>(device),
+						reduce_sum_kernel.getWorkGroupInfo<CL_KERNEL_WORK_GROUP_SIZE>(device),
+						cg_initialize_kernel.getWorkGroupInfo<CL_KERNEL_WORK_GROUP_SIZE>(device),
+						cg_apply_operator_kernel.getWorkGroupInfo<CL_KERNEL_WORK_GROUP_SIZE>(device),
+						cg_update_solution_kernel.getWorkGroupInfo<CL_KERNEL_WORK_GROUP_SIZE>(device),
+						cg_update_direction_kernel.getWorkGroupInfo<CL_KERNEL_WORK_GROUP_SIZE>(device)});
+	reduction_local_size = max_reduction_local_size;
+	while (reduction_local_size * reduction_local_size > max_group_size) {
+		reduction_local_size /= 2;
+	}
+	reduction_groups_x = (cells_x - 2 + reduction_local_size - 1) / reduction_local_size;
+	reduction_groups_y = (cells_y - 2 + reduction_local_size - 1) / reduction_local_size;
+
+	// Inner kernels share one work-group size, the largest square one allowed by workgroup_size and all of the kernels
+	size_t max_inner_group_size = std::min<size_t>(workgroup_size, device.getInfo<CL_DEVICE_MAX_WORK_GROUP_SIZE>());
+	for (const cl::Kernel* kernel : {&vector_advection_kernel, &scalar_advection_kernel, &scalar_jacobi_kernel, &vector_jacobi_kernel,
+					 &scalar_jacobi_folded_kernel, &vector_jacobi_folded_kernel, &advect_velocity_and_dye_kernel,
+					 &vorticity_confinement_kernel, &subtract_pressure_gradient_kernel, &divergence_kernel, &gradient_kernel,
+					 &subtract_gradient_p_kernel, &vorticity_kernel, &apply_vorticity_kernel, &apply_gravity_kernel}) {
+		max_inner_group_size = std::min(max_inner_group_size, kernel->getWorkGroupInfo<CL_KERNEL_WORK_GROUP_SIZE>(device));
+	}
+#ifdef FLUIDSIM_TILED_STENCILS
+	// The tiled kernels are compiled for tile_size x tile_size work-groups
+	inner_local_size = tile_size;
+#else
+	inner_local_size = max_inner_local_size;
+	while (inner_local_size > 1 and inner_local_size * inner_local_size > max_inner_group_size) {
+		inner_local_size /= 2;
+	}
+#endif
+	inner_global_x = (cells_x - 2 + inner_local_size - 1) / inner_local_size * inner_local_size;
+	inner_global_y = (cells_y - 2 + inner_local_size - 1) / inner_local_size * inner_local_size;
+
+	const cl_uint partial_sum_count = reduction_groups_x * reduction_groups_y;
+	residual_partial_sums = cl::Buffer{context, CL_MEM_READ_WRITE, partial_sum_count * sizeof(Scalar)};
+	reduction_results = cl::Buffer{context, CL_MEM_READ_WRITE, reduction_result_count * sizeof(Scalar)};
+
+	const auto local_scratch = cl::Local(reduction_local_size * reduction_local_size * sizeof(Scalar));
+	scalar_jacobi_residual_kernel.setArg(2, residual_partial_sums);
+	scalar_jacobi_residual_kernel.setArg(3, local_scratch);
+	vector_jacobi_residual_kernel.setArg(2, residual_partial_sums);
+	vector_jacobi_residual_kernel.setArg(3, local_scratch);
+	reduce_sum_kernel.setArg(0, residual_partial_sums);
+	reduce_sum_kernel.setArg(1, partial_sum_count);
+	reduce_sum_kernel.setArg(2, reduction_results);
+	reduce_sum_kernel.setArg(3, local_scratch);
+
+	cg_initialize_kernel.setArg(0, divergence_w);
+	cg_initialize_kernel.setArg(1, cg_r);
+	cg_initialize_kernel.setArg(2, cg_z);
+	cg_initialize_kernel.setArg(3, cg_d);
+	cg_initialize_kernel.setArg(4, Scalar{-dx * dx});
+	cg_initialize_kernel.setArg(5, residual_partial_sums);
+	cg_initialize_kernel.setArg(6, local_scratch);
+
+	cg_apply_operator_kernel.setArg(0, cg_d);
+	cg_apply_operator_kernel.setArg(1, cg_q);
+	cg_apply_operator_kernel.setArg(2, residual_partial_sums);
+	cg_apply_operator_kernel.setArg(3, local_scratch);
+
+	cg_update_solution_kernel.setArg(1, cg_r);
+	cg_update_solution_kernel.setArg(2, cg_z);
+	cg_update_solution_kernel.setArg(3, cg_d);
+	cg_update_solution_kernel.setArg(4, cg_q);
+	cg_update_solution_kernel.setArg(5, reduction_results);
+	cg_update_solution_kernel.setArg(7, cg_d_dot_q_result_index);
+	cg_update_solution_kernel.setArg(8, residual_partial_sums);
+	cg_update_solution_kernel.setArg(9, local_scratch);
+
+	cg_update_direction_kernel.setArg(0, cg_z);
+	cg_update_direction_kernel.setArg(1, cg_d);
+	cg_update_direction_kernel.setArg(2, reduction_results);
+
+	visualize_vorticity_kernel.setArg(6, halved_dx_reciprocal);
+	set_visualization(VisualizedField::DYE, ColormapType::RED_GREEN, -1.0, 1.0);
+}
+
+void Simulation::create_multigrid_levels(const cl::Context& context, Scalar dx)
+{
+	cl_uint level_cells_x = cells_x;
+	cl_uint level_cells_y = cells_y;
+	Scalar h = dx;
+
+	while (true) {
+		const size_t field_size = level_cells_x * level_cells_y * scalar_size;
+		MultigridLevel level;
+		level.cells_x = level_cells_x;
+		level.cells_y = level_cells_y;
+		level.h = h;
+		level.residual = create_field(context, field_size);
+		if (not multigrid_levels.empty()) {
+			level.x = create_field(context, field_size);
+			level.temporary_x = create_field(context, field_size);
+			level.b = create_field(context, field_size);
+		}
+		multigrid_levels.push_back(level);
+
+		// Coarsening requires an even number of inner cells, so that each coarse cell covers exactly 2x2 fine cells
+		const cl_uint inner_x = level_cells_x - 2;
+		const cl_uint inner_y = level_cells_y - 2;
+		if (inner_x % 2 != 0 or inner_y % 2 != 0 or std::min(inner_x, inner_y) / 2 < multigrid_coarsest_inner_cell_count) {
+			break;
+		}
+
+		level_cells_x = inner_x / 2 + 2;
+		level_cells_y = inner_y / 2 + 2;
+		h *= 2;
+	}
+}
+
+void Simulation::set_pressure_solver(PressureSolver solver)
+{
+	pressure_solver = solver;
+}
+
+void Simulation::set_residual_tolerance(Scalar tolerance, cl_uint check_interval)
+{
+	residual_tolerance = tolerance;
+	residual_check_interval = check_interval;
+}
+
+void Simulation::set_diffusion_solver(DiffusionSolver solver)
+{
+	diffusion_solver = solver;
+}
+
+void Simulation::set_sor_relaxation_factor(Scalar omega)
+{
+	sor_relaxation_factor = omega;
+}
+
+void Simulation::set_fused_kernels(bool enabled)
+{
+	fused_kernels = enabled;
+}
+
+void Simulation::set_fold_boundary_conditions(bool enabled)
+{
+	fold_boundary_conditions = enabled;
+}
+
+void Simulation::set_solver_iterations(cl_uint iterations)
+{
+	solver_iterations = iterations;
+}
+
+void Simulation::set_phase_timing(bool enabled)
+{
+	phase_timing = enabled;
+}
+
+void Simulation::set_profiler(std::shared_ptr<Profiler> profiler)
+{
+	this->profiler = std::move(profiler);
+	if (this->profiler) {
+		for (const auto kernel : {&vector_boundary_kernel, &scalar_boundary_kernel, &dye_boundary_conditions_kernel, &multigrid_boundary_kernel}) {
+			this->profiler->add_boundary_kernel(*kernel);
+		}
+	}
+}
+
+const FrameStats& Simulation::frame_stats() const
+{
+	return stats;
+}
+
+void Simulation::set_visualization(VisualizedField field, ColormapType colormap_type, Scalar min, Scalar max)
+{
+	visualized_field = field;
+
+	const auto colormap_table = make_colormap(colormap_type);
+	cmd_queue.enqueueWriteBuffer(colormap, CL_TRUE, 0, sizeof(colormap_table), colormap_table.data());
+	for (auto kernel : {&visualize_scalar_kernel, &visualize_speed_kernel, &visualize_vorticity_kernel}) {
+		kernel->setArg(2, colormap);
+		kernel->setArg(3, static_cast<cl_uint>(colormap_size));
+		kernel->setArg(4, min);
+		kernel->setArg(5, max);
+	}
+}
+
+void Simulation::set_emitters(std::vector<Event> emitters)
+{
+	this->emitters = std::move(emitters);
+}
+
+void Simulation::set_halo_exchange(std::shared_ptr<HaloExchange> halo_exchange, size_t slab)
+{
+	this->halo_exchange = halo_exchange;
+	this->slab = slab;
+}
+
+void Simulation::read_dye(ScalarField& field)
+{
+	const size_t size = total_cell_count * sizeof(Scalar);
+	cl::Buffer unpacked{cmd_queue.getInfo<CL_QUEUE_CONTEXT>(), CL_MEM_WRITE_ONLY, size};
+	unpack_scalar_field_kernel.setArg(0, dye);
+	unpack_scalar_field_kernel.setArg(1, unpacked);
+	enqueueKernel(cmd_queue, unpack_scalar_field_kernel, cl::NullRange, cl::NDRange{cells_x, cells_y});
+
+	field.resize(total_cell_count);
+	cmd_queue.enqueueReadBuffer(unpacked, CL_TRUE, 0, size, field.data());
+}
+
+void Simulation::enqueueKernel(cl::CommandQueue& cmd_queue, const cl::Kernel& kernel, const cl::NDRange& offset,
+			       const cl::NDRange& global, const cl::NDRange& local) const
+{
+	if (profiler) {
+		cl::Event event;
+		cmd_queue.enqueueNDRangeKernel(kernel, offset, global, local, nullptr, &event);
+		profiler->record(kernel, event);
+	} else {
+		cmd_queue.enqueueNDRangeKernel(kernel, offset, global, local);
+	}
+	++stats.kernel_launches;
 }
 
 void Simulation::enqueueBoundaryKernel(cl::CommandQueue& cmd_queue, cl::Kernel& boundary_kernel) const
 {
-	const cl_uint boundary_cell_count = cell_count - 2;
-	//Argument 1 is the offset, used to indicate whether we use the cell above/below/to the left/to the right
-	//to calculate the boundary value
-	//Enqueue the first and last rows boundary calculations
-	boundary_kernel.setArg(1, Offset{0, 1});
-	cmd_queue.enqueueNDRangeKernel(boundary_kernel, cl::NDRange{1, 0}, cl::NDRange{boundary_cell_count, 1});
-	boundary_kernel.setArg(1, Offset{0, -1});
-	cmd_queue.enqueueNDRangeKernel(boundary_kernel, cl::NDRange{1, cell_count - 1}, cl::NDRange{boundary_cell_count, 1});
-
-	//Enqueue the first and last columns boundary calculations
-	boundary_kernel.setArg(1, Offset{1, 0});
-	cmd_queue.enqueueNDRangeKernel(boundary_kernel, cl::NDRange{0, 1}, cl::NDRange{1, boundary_cell_count});
-	boundary_kernel.setArg(1, Offset{-1, 0});
-	cmd_queue.enqueueNDRangeKernel(boundary_kernel, cl::NDRange{cell_count - 1, 1}, cl::NDRange{1, boundary_cell_count});
+	//A single launch covers the 4 edges (without corners) and then the 4 corners, the kernel derives
+	//the boundary cell and its inner neighbour from the global id
+	const cl_uint perimeter_cell_count = 2 * (cells_x - 2) + 2 * (cells_y - 2) + 4;
+	enqueueKernel(cmd_queue, boundary_kernel, cl::NullRange, cl::NDRange{perimeter_cell_count});
 
 	cmd_queue.enqueueBarrierWithWaitList();
 }
 
 void Simulation::enqueueInnerKernel(cl::CommandQueue& cmd_queue, const cl::Kernel& kernel) const
 {
-	// Subtract 2 from the range in each dimension to account for 2 boundary cells
-	// top & bottom or left & right cells
-	const auto range  = cl::NDRange{workgroup_size, workgroup_size};
+	// A single launch starting past the boundary, the kernels skip the work-items past the last inner cell
+	enqueueKernel(cmd_queue, kernel, cl::NDRange{1, 1}, cl::NDRange{inner_global_x, inner_global_y},
+		      cl::NDRange{inner_local_size, inner_local_size});
+
+	cmd_queue.enqueueBarrierWithWaitList();
+}
+
+void Simulation::enqueueRowsKernel(cl::CommandQueue& cmd_queue, const cl::Kernel& kernel, cl_uint first_row, cl_uint row_count) const
+{
+	// Rounded up to whole work-groups like the inner launches, so rows past the range are computed too
+	const cl_uint global_y = (row_count + inner_local_size - 1) / inner_local_size * inner_local_size;
+	enqueueKernel(cmd_queue, kernel, cl::NDRange{1, first_row}, cl::NDRange{inner_global_x, global_y},
+		      cl::NDRange{inner_local_size, inner_local_size});
+
+	cmd_queue.enqueueBarrierWithWaitList();
+}
+
+void Simulation::enqueueJacobiKernel(const cl::Kernel& kernel, const cl::Buffer& x, int iteration, size_t element_size)
+{
+	// Each iteration without an exchange spoils one more halo row, starting from the outermost one, which gets the
+	// boundary condition of a wall, so the slab's own rows stay exact for halo rows iterations
+	if (not halo_exchange or iteration % halo_exchange->rows() != 0) {
+		enqueueInnerKernel(cmd_queue, kernel);
+		return;
+	}
+	if (not halo_exchange->overlapped()) {
+		halo_exchange->exchange(slab, cmd_queue, x, element_size);
+		enqueueInnerKernel(cmd_queue, kernel);
+		return;
+	}
+
+	// The rows away from the halo are computed while it's copied, in whole work-groups so that none of them read it
+	const auto rows = halo_exchange->independent_rows(slab);
+	const cl_uint independent_row_count = (rows.second - rows.first) / inner_local_size * inner_local_size;
+	halo_exchange->begin_exchange(slab, cmd_queue, x, element_size);
+	if (independent_row_count != 0) {
+		enqueueRowsKernel(cmd_queue, kernel, rows.first, independent_row_count);
+	}
+	halo_exchange->finish_exchange(slab, cmd_queue);
+
+	const cl_uint remaining_row = rows.first + independent_row_count;
+	if (rows.first > 1) {
+		enqueueRowsKernel(cmd_queue, kernel, 1, rows.first - 1);
+	}
+	if (remaining_row < cells_y - 1) {
+		enqueueRowsKernel(cmd_queue, kernel, remaining_row, cells_y - 1 - remaining_row);
+	}
+}
+
+void Simulation::enqueueLevelKernel(cl::CommandQueue& cmd_queue, const cl::Kernel& kernel, const MultigridLevel& level) const
+{
+	enqueueKernel(cmd_queue, kernel, cl::NDRange{1, 1}, cl::NDRange{level.cells_x - 2, level.cells_y - 2});
 
-	for (uint y = 1; y < cell_count - 2; y += workgroup_size) {
-		for (uint x = 1; x < cell_count - 2; x += workgroup_size) {
-			cmd_queue.enqueueNDRangeKernel(kernel, cl::NDRange{x, y}, range);
+	cmd_queue.enqueueBarrierWithWaitList();
+}
+
+void Simulation::enqueueBlockedKernel(cl::CommandQueue& cmd_queue, cl::Kernel& kernel, cl_int sweeps) const
+{
+	//Tiles overlap by 2 * sweeps cells, only their centres are written back
+	const cl_uint block_stride = jacobi_tile_size - 2 * sweeps;
+	const cl_uint block_count_x = (cells_x - 2 + block_stride - 1) / block_stride;
+	const cl_uint block_count_y = (cells_y - 2 + block_stride - 1) / block_stride;
+
+	kernel.setArg(6, sweeps);
+	enqueueKernel(cmd_queue, kernel, cl::NullRange, cl::NDRange{block_count_x * jacobi_block_size, block_count_y * jacobi_block_size},
+		      cl::NDRange{jacobi_block_size, jacobi_block_size});
+
+	cmd_queue.enqueueBarrierWithWaitList();
+}
+
+int Simulation::blocked_jacobi(cl::Kernel& kernel, cl::Kernel& residual_kernel, cl::Buffer& x, cl::Buffer& temporary_x, const cl::Buffer& b, Scalar& residual)
+{
+	int i = 0;
+	auto next_residual_check = residual_check_interval;
+	while (i < solver_iterations) {
+		const cl_int sweeps = std::min(jacobi_block_sweeps, solver_iterations - i);
+		// b is x itself for the diffusion, so it's bound after every swap, or a launch would write the buffer it reads b from
+		kernel.setArg(0, x);
+		kernel.setArg(1, b);
+		kernel.setArg(2, temporary_x);
+		enqueueBlockedKernel(cmd_queue, kernel, sweeps);
+
+		using std::swap;
+		swap(x, temporary_x);
+		i += sweeps;
+
+		// Launches cover several iterations, so the check happens on the first launch past the interval
+		if (residual_check_enabled() and static_cast<cl_uint>(i) >= next_residual_check) {
+			next_residual_check += residual_check_interval;
+			residual = calculate_residual(residual_kernel, x, b);
+			if (residual <= residual_tolerance) {
+				break;
+			}
 		}
 	}
 
+	return i;
+}
+
+void Simulation::enqueueRedBlackKernel(cl::CommandQueue& cmd_queue, cl::Kernel& kernel) const
+{
+	const auto range = cl::NDRange{(cells_x - 2 + 1) / 2, cells_y - 2};
+
+	//Argument 5 is the parity of the cells updated by the launch, red cells have to be updated before black ones
+	for (cl_int parity = 0; parity < 2; ++parity) {
+		kernel.setArg(5, parity);
+		enqueueKernel(cmd_queue, kernel, cl::NDRange{0, 1}, range);
+		cmd_queue.enqueueBarrierWithWaitList();
+	}
+}
+
+bool Simulation::residual_check_enabled() const
+{
+	return residual_check_interval != 0;
+}
+
+bool Simulation::residual_check_due(int iteration) const
+{
+	return residual_check_enabled() and iteration != 0 and iteration % residual_check_interval == 0;
+}
+
+void Simulation::enqueueReductionKernel(cl::CommandQueue& cmd_queue, const cl::Kernel& kernel) const
+{
+	enqueueKernel(cmd_queue, kernel, cl::NDRange{1, 1}, cl::NDRange{reduction_groups_x * reduction_local_size, reduction_groups_y * reduction_local_size},
+		      cl::NDRange{reduction_local_size, reduction_local_size});
+
+	cmd_queue.enqueueBarrierWithWaitList();
+}
+
+void Simulation::enqueueReduceSum(cl::CommandQueue& cmd_queue, cl_uint result_index)
+{
+	const cl_uint reduce_local_size = reduction_local_size * reduction_local_size;
+	reduce_sum_kernel.setArg(4, result_index);
+	enqueueKernel(cmd_queue, reduce_sum_kernel, cl::NullRange, cl::NDRange{reduce_local_size}, cl::NDRange{reduce_local_size});
+
 	cmd_queue.enqueueBarrierWithWaitList();
 }
 
+Scalar Simulation::read_reduction_result(cl_uint result_index)
+{
+	Scalar result;
+	cmd_queue.enqueueReadBuffer(reduction_results, CL_TRUE, result_index * sizeof(Scalar), sizeof(Scalar), &result);
+	return result;
+}
+
+Scalar Simulation::calculate_residual(cl::Kernel& residual_kernel, const cl::Buffer& x, const cl::Buffer& b)
+{
+	residual_kernel.setArg(0, x);
+	residual_kernel.setArg(1, b);
+	enqueueReductionKernel(cmd_queue, residual_kernel);
+	enqueueReduceSum(cmd_queue, residual_result_index);
+
+	const cl_uint inner_cell_count = (cells_x - 2) * (cells_y - 2);
+	return std::sqrt(read_reduction_result(residual_result_index) / inner_cell_count);
+}
+
 void Simulation::calculate_advection()
 {
 	vector_advection_kernel.setArg(0, u);
@@ -178,19 +723,50 @@ void Simulation::calculate_advection()
 
 void Simulation::calculate_diffusion()
 {
-	for (int i = 0; i < jacobi_iterations; ++i) {
-		apply_vector_boundary_conditions(w);
+	// The blocked kernels apply the boundary condition themselves
+	if (diffusion_solver == DiffusionSolver::TEMPORALLY_BLOCKED_JACOBI) {
+		stats.diffusion_iterations = blocked_jacobi(vector_jacobi_blocked_kernel, vector_jacobi_residual_kernel, w, temporary_w, w, stats.diffusion_residual);
+		return;
+	}
 
-		vector_jacobi_kernel.setArg(0, w);
-		vector_jacobi_kernel.setArg(1, w);
-		vector_jacobi_kernel.setArg(2, temporary_w);
-		enqueueInnerKernel(cmd_queue, vector_jacobi_kernel);
+	auto& jacobi_kernel = fold_boundary_conditions ? vector_jacobi_folded_kernel : vector_jacobi_kernel;
+	const bool fold = fold_boundary_conditions and diffusion_solver == DiffusionSolver::JACOBI;
 
-		using std::swap;
-		swap(w, temporary_w);
+	int i = 0;
+	for (; i < solver_iterations; ++i) {
+		// The folded kernels don't read the boundary, but the residual kernel does. The Jacobi launches exchange the halo.
+		if (not fold or residual_check_due(i)) {
+			apply_vector_boundary_conditions(w, false);
+		}
+
+		if (residual_check_due(i)) {
+			stats.diffusion_residual = calculate_residual(vector_jacobi_residual_kernel, w, w);
+			if (stats.diffusion_residual <= residual_tolerance) {
+				break;
+			}
+		}
+
+		if (diffusion_solver == DiffusionSolver::RED_BLACK_SOR) {
+			vector_sor_kernel.setArg(0, w);
+			vector_sor_kernel.setArg(1, w);
+			vector_sor_kernel.setArg(4, sor_relaxation_factor);
+			enqueueRedBlackKernel(cmd_queue, vector_sor_kernel);
+		} else {
+			jacobi_kernel.setArg(0, w);
+			jacobi_kernel.setArg(1, w);
+			jacobi_kernel.setArg(2, temporary_w);
+			enqueueJacobiKernel(jacobi_kernel, w, i, 2 * scalar_size);
+
+			using std::swap;
+			swap(w, temporary_w);
+		}
 	}
 
 	apply_vector_boundary_conditions(w);
+	stats.diffusion_iterations = i;
+	if (residual_check_enabled() and i == solver_iterations) {
+		stats.diffusion_residual = calculate_residual(vector_jacobi_residual_kernel, w, w);
+	}
 }
 
 void Simulation::calculate_divergence_w()
@@ -199,45 +775,229 @@ void Simulation::calculate_divergence_w()
 	enqueueInnerKernel(cmd_queue, divergence_kernel);
 }
 
+//Zero is all bits cleared in each of the storage formats
 void Simulation::zero_fill_vector_field(cl::Buffer& field)
 {
-	cl::copy(cmd_queue, zero_vector_buffer.begin(), zero_vector_buffer.end(), field);
+	cmd_queue.enqueueFillBuffer(field, cl_uchar{0}, 0, 2 * total_cell_count * scalar_size);
 }
 
-void Simulation::zero_fill_scalar_field(cl::Buffer& field)
+void Simulation::zero_fill_scalar_field(cl::Buffer& field, cl_uint field_cell_count)
 {
-	cmd_queue.enqueueFillBuffer(field, Scalar{0.0}, 0, total_cell_count);
+	cmd_queue.enqueueFillBuffer(field, cl_uchar{0}, 0, field_cell_count * scalar_size);
 }
 
 void Simulation::calculate_p()
 {
-    zero_fill_scalar_field(p);
-	scalar_jacobi_kernel.setArg(1, divergence_w);
+	switch (pressure_solver) {
+		case PressureSolver::JACOBI:
+		case PressureSolver::RED_BLACK_SOR:
+			calculate_p_relaxation();
+			break;
+		case PressureSolver::TEMPORALLY_BLOCKED_JACOBI:
+			zero_fill_scalar_field(p, total_cell_count);
+			stats.pressure_iterations = blocked_jacobi(scalar_jacobi_blocked_kernel, scalar_jacobi_residual_kernel, p, temporary_p, divergence_w, stats.pressure_residual);
+			break;
+		case PressureSolver::MULTIGRID:
+			calculate_p_multigrid();
+			break;
+		case PressureSolver::CONJUGATE_GRADIENT:
+			calculate_p_conjugate_gradient();
+			break;
+	}
+}
+
+void Simulation::calculate_p_relaxation()
+{
+	zero_fill_scalar_field(p, total_cell_count);
+	auto& jacobi_kernel = fold_boundary_conditions ? scalar_jacobi_folded_kernel : scalar_jacobi_kernel;
+	jacobi_kernel.setArg(1, divergence_w);
+	const bool fold = fold_boundary_conditions and pressure_solver == PressureSolver::JACOBI;
+
+	int i = 0;
+	for (; i < solver_iterations; ++i) {
+		// The folded kernels don't read the boundary, but the residual kernel does. The Jacobi launches exchange the halo.
+		if (not fold or residual_check_due(i)) {
+			apply_scalar_boundary_conditions(p, false);
+		}
 
-	for (int i = 0; i < jacobi_iterations; ++i) {
-		apply_scalar_boundary_conditions(p);
+		if (residual_check_due(i)) {
+			stats.pressure_residual = calculate_residual(scalar_jacobi_residual_kernel, p, divergence_w);
+			if (stats.pressure_residual <= residual_tolerance) {
+				break;
+			}
+		}
 
-		scalar_jacobi_kernel.setArg(0, p);
-		scalar_jacobi_kernel.setArg(2, temporary_p);
-		enqueueInnerKernel(cmd_queue, scalar_jacobi_kernel);
+		if (pressure_solver == PressureSolver::RED_BLACK_SOR) {
+			scalar_sor_kernel.setArg(0, p);
+			scalar_sor_kernel.setArg(4, sor_relaxation_factor);
+			enqueueRedBlackKernel(cmd_queue, scalar_sor_kernel);
+		} else {
+			jacobi_kernel.setArg(0, p);
+			jacobi_kernel.setArg(2, temporary_p);
+			enqueueJacobiKernel(jacobi_kernel, p, i, scalar_size);
+
+			using std::swap;
+			swap(p, temporary_p);
+		}
+	}
 
-		using std::swap;
-		swap(p, temporary_p);
+	apply_scalar_boundary_conditions(p);
+	stats.pressure_iterations = i;
+	if (residual_check_enabled() and i == solver_iterations) {
+		stats.pressure_residual = calculate_residual(scalar_jacobi_residual_kernel, p, divergence_w);
+	}
+}
+
+void Simulation::calculate_p_multigrid()
+{
+	zero_fill_scalar_field(p, total_cell_count);
+
+	int i = 0;
+	while (i < multigrid_cycles) {
+		multigrid_v_cycle(0, p, temporary_p, divergence_w);
+		++i;
+
+		// A V-cycle does far more work than a Jacobi iteration, so the residual is checked after every cycle
+		if (residual_check_enabled()) {
+			stats.pressure_residual = calculate_residual(scalar_jacobi_residual_kernel, p, divergence_w);
+			if (stats.pressure_residual <= residual_tolerance) {
+				break;
+			}
+		}
+	}
+	stats.pressure_iterations = i;
+}
+
+void Simulation::calculate_p_conjugate_gradient()
+{
+	zero_fill_scalar_field(p, total_cell_count);
+	cg_update_solution_kernel.setArg(0, p);
+
+	enqueueReductionKernel(cmd_queue, cg_initialize_kernel);
+	enqueueReduceSum(cmd_queue, 0);
+
+	// rho (r dot z) alternates between result slots 0 and 1, so that the direction update can use both the
+	// current and the previous value without reading them back
+	int i = 0;
+	while (i < conjugate_gradient_max_iterations) {
+		const cl_uint rho_index = i % 2;
+		const cl_uint next_rho_index = 1 - rho_index;
+
+		enqueueReductionKernel(cmd_queue, cg_apply_operator_kernel);
+		enqueueReduceSum(cmd_queue, cg_d_dot_q_result_index);
+
+		cg_update_solution_kernel.setArg(6, rho_index);
+		enqueueReductionKernel(cmd_queue, cg_update_solution_kernel);
+		enqueueReduceSum(cmd_queue, next_rho_index);
+		++i;
+
+		// With the diagonal preconditioner r dot z is 4 times the squared norm of the Jacobi update,
+		// which makes the residual comparable with the other solvers
+		if (residual_check_due(i)) {
+			const cl_uint inner_cell_count = (cells_x - 2) * (cells_y - 2);
+			const Scalar rho = read_reduction_result(next_rho_index);
+			stats.pressure_residual = std::sqrt(rho / (4 * inner_cell_count));
+			if (stats.pressure_residual <= residual_tolerance) {
+				break;
+			}
+		}
+
+		cg_update_direction_kernel.setArg(3, next_rho_index);
+		cg_update_direction_kernel.setArg(4, rho_index);
+		enqueueReductionKernel(cmd_queue, cg_update_direction_kernel);
 	}
 
 	apply_scalar_boundary_conditions(p);
+	stats.pressure_iterations = i;
 }
 
-void Simulation::apply_scalar_boundary_conditions(cl::Buffer& buffer)
+void Simulation::multigrid_v_cycle(size_t level, cl::Buffer& x, cl::Buffer& temporary_x, const cl::Buffer& b)
+{
+	if (level + 1 == multigrid_levels.size()) {
+		multigrid_smooth(level, x, temporary_x, b, multigrid_coarsest_iterations);
+		return;
+	}
+
+	multigrid_smooth(level, x, temporary_x, b, multigrid_smoothing_iterations);
+
+	auto& fine = multigrid_levels[level];
+	auto& coarse = multigrid_levels[level + 1];
+
+	multigrid_residual_kernel.setArg(0, x);
+	multigrid_residual_kernel.setArg(1, b);
+	multigrid_residual_kernel.setArg(2, fine.residual);
+	multigrid_residual_kernel.setArg(3, fine.cells_x);
+	multigrid_residual_kernel.setArg(4, Scalar{1 / (fine.h * fine.h)});
+	enqueueLevelKernel(cmd_queue, multigrid_residual_kernel, fine);
+
+	multigrid_restrict_kernel.setArg(0, fine.residual);
+	multigrid_restrict_kernel.setArg(1, coarse.b);
+	multigrid_restrict_kernel.setArg(2, fine.cells_x);
+	multigrid_restrict_kernel.setArg(3, coarse.cells_x);
+	enqueueLevelKernel(cmd_queue, multigrid_restrict_kernel, coarse);
+
+	// The coarse grid solves for the error of the fine grid solution, starting from a zero guess
+	zero_fill_scalar_field(coarse.x, coarse.cells_x * coarse.cells_y);
+	multigrid_v_cycle(level + 1, coarse.x, coarse.temporary_x, coarse.b);
+
+	multigrid_prolongate_kernel.setArg(0, coarse.x);
+	multigrid_prolongate_kernel.setArg(1, x);
+	multigrid_prolongate_kernel.setArg(2, coarse.cells_x);
+	multigrid_prolongate_kernel.setArg(3, fine.cells_x);
+	enqueueLevelKernel(cmd_queue, multigrid_prolongate_kernel, fine);
+
+	multigrid_smooth(level, x, temporary_x, b, multigrid_smoothing_iterations);
+}
+
+void Simulation::multigrid_smooth(size_t level, cl::Buffer& x, cl::Buffer& temporary_x, const cl::Buffer& b, int iterations)
+{
+	const auto& current = multigrid_levels[level];
+
+	multigrid_smooth_kernel.setArg(1, b);
+	multigrid_smooth_kernel.setArg(3, current.cells_x);
+	multigrid_smooth_kernel.setArg(4, Scalar{-current.h * current.h});
+	multigrid_smooth_kernel.setArg(5, multigrid_smoothing_weight);
+
+	for (int i = 0; i < iterations; ++i) {
+		apply_multigrid_boundary_conditions(x, current);
+
+		multigrid_smooth_kernel.setArg(0, x);
+		multigrid_smooth_kernel.setArg(2, temporary_x);
+		enqueueLevelKernel(cmd_queue, multigrid_smooth_kernel, current);
+
+		using std::swap;
+		swap(x, temporary_x);
+	}
+
+	apply_multigrid_boundary_conditions(x, current);
+}
+
+void Simulation::apply_multigrid_boundary_conditions(cl::Buffer& buffer, const MultigridLevel& level)
+{
+	multigrid_boundary_kernel.setArg(0, buffer);
+	multigrid_boundary_kernel.setArg(1, level.cells_x);
+	multigrid_boundary_kernel.setArg(2, level.cells_y);
+	enqueueKernel(cmd_queue, multigrid_boundary_kernel, cl::NDRange{1}, cl::NDRange{std::max(level.cells_x, level.cells_y) - 2});
+
+	cmd_queue.enqueueBarrierWithWaitList();
+}
+
+void Simulation::apply_scalar_boundary_conditions(cl::Buffer& buffer, bool exchange_halo)
 {
 	scalar_boundary_kernel.setArg(0, buffer);
 	enqueueBoundaryKernel(cmd_queue, scalar_boundary_kernel);
+	if (halo_exchange and exchange_halo) {
+		halo_exchange->exchange(slab, cmd_queue, buffer, scalar_size);
+	}
 }
 
-void Simulation::apply_vector_boundary_conditions(cl::Buffer& buffer)
+void Simulation::apply_vector_boundary_conditions(cl::Buffer& buffer, bool exchange_halo)
 {
 	vector_boundary_kernel.setArg(0, buffer);
 	enqueueBoundaryKernel(cmd_queue, vector_boundary_kernel);
+	if (halo_exchange and exchange_halo) {
+		halo_exchange->exchange(slab, cmd_queue, buffer, 2 * scalar_size);
+	}
 }
 
 void Simulation::calculate_gradient_p()
@@ -248,6 +1008,8 @@ void Simulation::calculate_gradient_p()
 
 void Simulation::calculate_u()
 {
+	//Which of the two buffers holds w depends on the solvers, so it is bound before every launch
+	subtract_gradient_p_kernel.setArg(0, w);
 	enqueueInnerKernel(cmd_queue, subtract_gradient_p_kernel);
 }
 
@@ -261,25 +1023,6 @@ void Simulation::advect_dye()
 	std::swap(dye, temporary_p);
 }
 
-void Simulation::apply_impulse(const Event& simulation_event)
-{
-	apply_impulse_kernel.setArg(0, w);
-	apply_impulse_kernel.setArg(1, simulation_event.point);
-	apply_impulse_kernel.setArg(2, simulation_event.value.as_vector);
-
-	apply_impulse_kernel.setArg(3, Scalar{2});
-	enqueueInnerKernel(cmd_queue, apply_impulse_kernel);
-}
-
-void Simulation::add_dye(const Event& simulation_event)
-{
-	add_dye_kernel.setArg(0, dye);
-	add_dye_kernel.setArg(1, simulation_event.point);
-	add_dye_kernel.setArg(2, simulation_event.value.as_scalar);
-	add_dye_kernel.setArg(3, Scalar{64});
-	enqueueInnerKernel(cmd_queue, add_dye_kernel);
-}
-
 void Simulation::apply_gravity()
 {
 	apply_gravity_kernel.setArg(0, w);
@@ -290,6 +1033,9 @@ void Simulation::apply_dye_boundary_conditions()
 {
 	dye_boundary_conditions_kernel.setArg(0, dye);
 	enqueueBoundaryKernel(cmd_queue, dye_boundary_conditions_kernel);
+	if (halo_exchange) {
+		halo_exchange->exchange(slab, cmd_queue, dye, scalar_size);
+	}
 }
 
 void Simulation::apply_vorticity()
@@ -307,63 +1053,536 @@ void Simulation::apply_vorticity()
 	swap(w, temporary_w);
 }
 
-void Simulation::update()
+void Simulation::advect_velocity_and_dye()
 {
-	calculate_advection();
-	auto events = events_from_ui->try_pop_all();
-	if (not events.empty()) {
-		cmd_queue.finish();
+	advect_velocity_and_dye_kernel.setArg(0, u);
+	advect_velocity_and_dye_kernel.setArg(1, temporary_w);
+	advect_velocity_and_dye_kernel.setArg(2, dye);
+	advect_velocity_and_dye_kernel.setArg(3, temporary_p);
+	enqueueInnerKernel(cmd_queue, advect_velocity_and_dye_kernel);
+
+	using std::swap;
+	swap(w, temporary_w);
+	swap(dye, temporary_p);
+}
+
+void Simulation::apply_vorticity_confinement()
+{
+	vorticity_confinement_kernel.setArg(0, w);
+	vorticity_confinement_kernel.setArg(1, temporary_w);
+	enqueueInnerKernel(cmd_queue, vorticity_confinement_kernel);
+
+	using std::swap;
+	swap(w, temporary_w);
+}
+
+void Simulation::subtract_pressure_gradient()
+{
+	subtract_pressure_gradient_kernel.setArg(0, w);
+	subtract_pressure_gradient_kernel.setArg(1, p);
+	subtract_pressure_gradient_kernel.setArg(2, u);
+	enqueueInnerKernel(cmd_queue, subtract_pressure_gradient_kernel);
+}
+
+void Simulation::inject_sources(Event::Type type)
+{
+	const bool force = type == Event::Type::APPLY_FORCE;
+	auto& batch = force ? force_sources : dye_sources;
+	auto& kernel = force ? apply_force_sources_kernel : add_dye_sources_kernel;
+	const Scalar range = force ? impulse_range : dye_range;
+	const cl_int reach = std::ceil(source_cutoff_ranges * range);
+
+	if (not batch.sources.empty()) {
+		batch.upload.wait();
+		batch.sources.clear();
 	}
-	for (auto& simulation_event : events) {
-		if (simulation_event.type == Event::Type::ADD_DYE) {
-			add_dye(simulation_event);
-		} else if (simulation_event.type == Event::Type::APPLY_FORCE) {
-			apply_impulse(simulation_event);
+
+	// Bounding box of the inner cells within reach of any of the sources
+	cl_int min_x = cells_x - 2, min_y = cells_y - 2;
+	cl_int max_x = 1, max_y = 1;
+	const auto add_source = [&](const Event& source_event) {
+		if (source_event.type != type) {
+			return;
+		}
+
+		Source source {source_event.point, Vector{0.0, 0.0}, Scalar{0.0}, range};
+		if (force) {
+			source.force = source_event.value.as_vector;
+		} else {
+			source.dye = source_event.value.as_scalar;
 		}
+		batch.sources.push_back(source);
+
+		min_x = std::min(min_x, source.position.s[0] - reach);
+		min_y = std::min(min_y, source.position.s[1] - reach);
+		max_x = std::max(max_x, source.position.s[0] + reach);
+		max_y = std::max(max_y, source.position.s[1] + reach);
+	};
+	for (auto& source_event : events) {
+		add_source(source_event);
+	}
+	for (auto& emitter : emitters) {
+		add_source(emitter);
 	}
 
-	for (int i = 1; i < 10; ++ i) {
-		Event imp_source;
-		imp_source.point = Point{static_cast<cl_int>(i * 0.1 * cell_count), static_cast<cl_int>(cell_count * 0.8)};
-		imp_source.value.as_vector = Vector{0, -20.0};
-		apply_impulse(imp_source);
-		imp_source.value.as_scalar = Scalar{0.01};
-		add_dye(imp_source);
+	min_x = std::max(min_x, 1);
+	min_y = std::max(min_y, 1);
+	max_x = std::min<cl_int>(max_x, cells_x - 2);
+	max_y = std::min<cl_int>(max_y, cells_y - 2);
+	if (batch.sources.empty() or min_x > max_x or min_y > max_y) {
+		batch.sources.clear();
+		return;
 	}
 
-	apply_gravity();
+	const size_t size = batch.sources.size() * sizeof(Source);
+	if (size > batch.capacity) {
+		batch.capacity = 2 * size;
+		batch.buffer = cl::Buffer{cmd_queue.getInfo<CL_QUEUE_CONTEXT>(), CL_MEM_READ_ONLY, batch.capacity};
+	}
+	cmd_queue.enqueueWriteBuffer(batch.buffer, CL_FALSE, 0, size, batch.sources.data(), nullptr, &batch.upload);
+	if (profiler) {
+		profiler->record("write_sources", batch.upload);
+	}
 
-	apply_dye_boundary_conditions();
+	kernel.setArg(0, force ? w : dye);
+	kernel.setArg(1, batch.buffer);
+	kernel.setArg(2, static_cast<cl_uint>(batch.sources.size()));
+	enqueueKernel(cmd_queue, kernel, cl::NDRange(min_x, min_y), cl::NDRange(max_x - min_x + 1, max_y - min_y + 1));
 
-	apply_vector_boundary_conditions(w);
+	cmd_queue.enqueueBarrierWithWaitList();
+}
 
-	advect_dye();
+void Simulation::update()
+{
+	stats.kernel_launches = 0;
+	if (phase_timing) {
+		stats.phase_seconds.fill(0.0);
+		cmd_queue.finish();
+		phase_start = std::chrono::steady_clock::now();
+	}
 
-	apply_dye_boundary_conditions();
-	calculate_diffusion();
-	apply_vector_boundary_conditions(w);
-	apply_vorticity();
-	apply_vector_boundary_conditions(w);
+	events.clear();
+	events_from_ui->pop_all(events);
+	if (replayed_trace) {
+		// The UI can still dump the profile, but its input would make the run differ from the trace
+		events.erase(std::remove_if(events.begin(), events.end(), [](const Event& event) { return event.type != Event::Type::DUMP_PROFILE; }),
+			     events.end());
+		const auto& replayed = replayed_trace->events(step_count + 1);
+		events.insert(events.end(), replayed.begin(), replayed.end());
+	}
+	if (trace_writer) {
+		trace_writer->record(step_count + 1, events);
+	}
+	if (profiler and std::any_of(events.begin(), events.end(), [](const Event& event) { return event.type == Event::Type::DUMP_PROFILE; })) {
+		profiler->dump(std::cerr);
+	}
+
+	if (fused_kernels) {
+		// Dye is injected before the advection and the impulses are applied after it, like in the unfused
+		// pipeline, gravity is applied by the advection kernel
+		inject_sources(Event::Type::ADD_DYE);
+		end_phase(Phase::SOURCES);
+		advect_velocity_and_dye();
+		end_phase(Phase::ADVECTION);
+		inject_sources(Event::Type::APPLY_FORCE);
+		end_phase(Phase::SOURCES);
+
+		apply_vector_boundary_conditions(w);
+		apply_dye_boundary_conditions();
+		calculate_diffusion();
+		apply_vector_boundary_conditions(w);
+		end_phase(Phase::DIFFUSION);
+		apply_vorticity_confinement();
+		apply_vector_boundary_conditions(w);
+		end_phase(Phase::VORTICITY);
+	} else {
+		calculate_advection();
+		end_phase(Phase::ADVECTION);
+		inject_sources(Event::Type::APPLY_FORCE);
+		inject_sources(Event::Type::ADD_DYE);
+		end_phase(Phase::SOURCES);
+
+		apply_gravity();
+
+		apply_dye_boundary_conditions();
+
+		apply_vector_boundary_conditions(w);
+
+		advect_dye();
+
+		apply_dye_boundary_conditions();
+		end_phase(Phase::ADVECTION);
+		calculate_diffusion();
+		apply_vector_boundary_conditions(w);
+		end_phase(Phase::DIFFUSION);
+		apply_vorticity();
+		apply_vector_boundary_conditions(w);
+		end_phase(Phase::VORTICITY);
+	}
 
 	calculate_divergence_w();
 	apply_scalar_boundary_conditions(divergence_w);
+	end_phase(Phase::DIVERGENCE);
 
 	calculate_p();
-	calculate_gradient_p();
-
-	calculate_u();
+	end_phase(Phase::PRESSURE);
+	if (fused_kernels) {
+		subtract_pressure_gradient();
+	} else {
+		calculate_gradient_p();
+		calculate_u();
+	}
 	apply_vector_boundary_conditions(u);
+	end_phase(Phase::PROJECTION);
+
+	read_back_frame();
+	++step_count;
+	if (checkpoint.pending and not snapshot_writer->busy()) {
+		try {
+			finish_checkpoint();
+		} catch (const std::exception& error) {
+			std::cerr << "Checkpoint not written: " << error.what() << std::endl;
+		}
+	}
+	if (checkpoint_interval != 0 and step_count % checkpoint_interval == 0) {
+		// Waiting for the previous checkpoint would stall the update, it's skipped instead
+		if (checkpoint.pending) {
+			std::cerr << "Checkpoint of update " << step_count << " skipped, the previous one is still being written" << std::endl;
+		} else {
+			start_checkpoint(checkpoint_path);
+		}
+	}
+	if (recorder and step_count % recording_interval == 0) {
+		record_fields();
+	}
+	if (trace_writer and checksum_interval != 0 and step_count % checksum_interval == 0) {
+		trace_writer->record(step_count, field_checksums());
+	}
+	if (replayed_trace and not replayed_trace->checksums(step_count).empty()) {
+		verify_checksums(replayed_trace->checksums(step_count));
+	}
+	end_phase(Phase::READBACK);
+	if (profiler) {
+		profiler->end_frame(stats);
+	}
+}
 
-	ScalarField output_buffer;
+void Simulation::end_phase(Phase phase)
+{
+	if (profiler) {
+		profiler->end_phase(phase);
+	}
+	if (not phase_timing) {
+		return;
+	}
 
-	output_buffer.resize(total_cell_count);
+	cmd_queue.finish();
+	const auto now = std::chrono::steady_clock::now();
+	stats.phase_seconds[static_cast<size_t>(phase)] += std::chrono::duration<double>(now - phase_start).count();
+	phase_start = now;
+}
 
-	cl::copy(cmd_queue, dye, output_buffer.begin(), output_buffer.end());
+void Simulation::read_back_frame()
+{
+	// The slot's previous frame is the oldest one still in flight, it has to be delivered before the slot is reused
+	auto& readback = readbacks[next_readback];
+	if (readback.pending) {
+		deliver_readback(readback);
+	}
 
-	if (dye_buffers_wait_list.empty()) {
-		to_ui->try_push(output_buffer);
-	} else {
-		dye_buffers_wait_list.emplace_back(output_buffer);
-		to_ui->try_push_all(dye_buffers_wait_list);
+	// The visualization kernels write the frame straight into the staging buffer
+	cl::Kernel* kernel = &visualize_scalar_kernel;
+	switch (visualized_field) {
+		case VisualizedField::DYE:
+			visualize_scalar_kernel.setArg(0, dye);
+			break;
+		case VisualizedField::PRESSURE:
+			visualize_scalar_kernel.setArg(0, p);
+			break;
+		case VisualizedField::SPEED:
+			kernel = &visualize_speed_kernel;
+			kernel->setArg(0, u);
+			break;
+		case VisualizedField::VORTICITY:
+			kernel = &visualize_vorticity_kernel;
+			kernel->setArg(0, u);
+			break;
+	}
+	kernel->setArg(1, readback.staging);
+	enqueueKernel(cmd_queue, *kernel, cl::NullRange, cl::NDRange{cells_x, cells_y});
+
+	const size_t size = total_cell_count * sizeof(Pixel);
+	readback.data = static_cast<Pixel*>(cmd_queue.enqueueMapBuffer(readback.staging, CL_FALSE, CL_MAP_READ, 0, size, nullptr, &readback.mapped));
+	readback.pending = true;
+	if (profiler) {
+		profiler->record("map_frame", readback.mapped);
+	}
+	cmd_queue.flush();
+	next_readback = (next_readback + 1) % readbacks.size();
+
+	// Deliver the frames which are already mapped, oldest first
+	for (size_t i = 0; i < readbacks.size(); ++i) {
+		auto& oldest = readbacks[(next_readback + i) % readbacks.size()];
+		if (not oldest.pending) {
+			continue;
+		}
+		if (oldest.mapped.getInfo<CL_EVENT_COMMAND_EXECUTION_STATUS>() != CL_COMPLETE) {
+			break;
+		}
+		deliver_readback(oldest);
+	}
+}
+
+void Simulation::deliver_readback(Readback& readback)
+{
+	readback.mapped.wait();
+	// The mailbox's buffers circulate between the simulation and the UI, so they're only allocated once
+	auto& frame = to_ui->back_buffer();
+	frame.assign(readback.data, readback.data + total_cell_count);
+	cmd_queue.enqueueUnmapMemObject(readback.staging, readback.data);
+	readback.data = nullptr;
+	readback.pending = false;
+
+	to_ui->publish();
+}
+
+cl_ulong Simulation::step() const
+{
+	return step_count;
+}
+
+void Simulation::set_checkpoints(std::string path, cl_ulong interval)
+{
+	checkpoint_path = std::move(path);
+	checkpoint_interval = interval;
+}
+
+void Simulation::save_snapshot(const std::string& path)
+{
+	if (checkpoint.pending) {
+		try {
+			finish_checkpoint();
+		} catch (const std::exception& error) {
+			std::cerr << "Checkpoint not written: " << error.what() << std::endl;
+		}
+	}
+	start_checkpoint(path);
+	finish_checkpoint();
+}
+
+void Simulation::load_snapshot(const Snapshot& snapshot)
+{
+	const auto& saved = snapshot.parameters();
+	if (saved.cells_x != cells_x or saved.cells_y != cells_y or saved.storage != parameters.storage) {
+		throw std::invalid_argument{"The snapshot's grid size or field storage doesn't match the simulation"};
+	}
+
+	// The writes block, the mapping of the file can't go away while they're in flight
+	for (const auto& field : state_fields()) {
+		cmd_queue.enqueueWriteBuffer(*field.buffer, CL_TRUE, 0, field.size, snapshot.field(field.name, field.size));
+	}
+	step_count = snapshot.step();
+}
+
+std::vector<RecordedField> Simulation::recorded_fields()
+{
+	return {{"velocity", 2}, {"pressure", 1}, {"dye", 1}};
+}
+
+void Simulation::set_recorder(std::unique_ptr<FieldRecorder> recorder, cl_ulong interval)
+{
+	if (recorder and interval == 0) {
+		throw std::invalid_argument{"The recording interval has to be at least 1"};
+	}
+	for (auto& slot : recording_slots) {
+		if (slot.pending) {
+			release_recording_slot(slot);
+		}
+	}
+	this->recorder = std::move(recorder);
+	recording_interval = interval;
+	recording_slots.resize(recording_slot_count);
+}
+
+void Simulation::set_event_recording(std::shared_ptr<EventTraceWriter> trace, cl_ulong checksum_interval)
+{
+	trace_writer = trace;
+	this->checksum_interval = checksum_interval;
+}
+
+void Simulation::set_replay(std::shared_ptr<const EventTrace> trace)
+{
+	// The checksums only match when the fields are computed the same way
+	std::string mismatches;
+	if (trace) {
+		for (const auto& setting : trace_settings()) {
+			const auto recorded = trace->settings().find(setting.first);
+			const std::string recorded_value = recorded == trace->settings().end() ? "none" : recorded->second;
+			if (recorded_value != setting.second) {
+				mismatches += (mismatches.empty() ? "" : ", ") + setting.first + " " + recorded_value + " instead of " + setting.second;
+			}
+		}
+	}
+	if (not mismatches.empty()) {
+		throw std::invalid_argument{"The trace was recorded with other settings: " + mismatches};
+	}
+	replayed_trace = trace;
+	mismatch_count = 0;
+}
+
+TraceSettings Simulation::trace_settings() const
+{
+	// The enums are stored as their values
+	auto settings = parameter_settings(parameters);
+	settings["pressure_solver"] = std::to_string(static_cast<int>(pressure_solver));
+	settings["diffusion_solver"] = std::to_string(static_cast<int>(diffusion_solver));
+	settings["solver_iterations"] = std::to_string(solver_iterations);
+	settings["sor_relaxation_factor"] = setting_text(sor_relaxation_factor);
+	settings["residual_tolerance"] = setting_text(residual_tolerance);
+	settings["residual_check_interval"] = std::to_string(residual_check_interval);
+	settings["fused_kernels"] = std::to_string(fused_kernels);
+	settings["fold_boundary_conditions"] = std::to_string(fold_boundary_conditions);
+	return settings;
+}
+
+void Simulation::apply_trace_settings(const TraceSettings& settings)
+{
+	const cl_uint pressure_solver = parse_uint_setting(settings, "pressure_solver");
+	const cl_uint diffusion_solver = parse_uint_setting(settings, "diffusion_solver");
+	if (pressure_solver > static_cast<cl_uint>(PressureSolver::CONJUGATE_GRADIENT)
+	    or diffusion_solver > static_cast<cl_uint>(DiffusionSolver::TEMPORALLY_BLOCKED_JACOBI)) {
+		throw std::invalid_argument{"Unknown solver in the trace"};
+	}
+	set_pressure_solver(static_cast<PressureSolver>(pressure_solver));
+	set_diffusion_solver(static_cast<DiffusionSolver>(diffusion_solver));
+	set_solver_iterations(parse_uint_setting(settings, "solver_iterations"));
+	set_sor_relaxation_factor(parse_scalar_setting(settings, "sor_relaxation_factor"));
+	set_residual_tolerance(parse_scalar_setting(settings, "residual_tolerance"), parse_uint_setting(settings, "residual_check_interval"));
+	set_fused_kernels(parse_uint_setting(settings, "fused_kernels") != 0);
+	set_fold_boundary_conditions(parse_uint_setting(settings, "fold_boundary_conditions") != 0);
+}
+
+cl_ulong Simulation::checksum_mismatches() const
+{
+	return mismatch_count;
+}
+
+std::vector<FieldChecksum> Simulation::field_checksums()
+{
+	std::vector<FieldChecksum> checksums;
+	std::vector<unsigned char> data;
+	for (const auto& field : state_fields()) {
+		data.resize(field.size);
+		cmd_queue.enqueueReadBuffer(*field.buffer, CL_TRUE, 0, field.size, data.data());
+		checksums.push_back(FieldChecksum{field.name, fnv1a_hash(data.data(), data.size())});
+	}
+	return checksums;
+}
+
+void Simulation::verify_checksums(const std::vector<FieldChecksum>& expected)
+{
+	const auto actual = field_checksums();
+	for (const auto& checksum : expected) {
+		const auto field = std::find_if(actual.begin(), actual.end(), [&](const FieldChecksum& field) { return field.field == checksum.field; });
+		if (field == actual.end() or field->checksum != checksum.checksum) {
+			std::cerr << "Update " << step_count << ": the " << checksum.field << " field doesn't match the trace" << std::endl;
+			++mismatch_count;
+		}
+	}
+}
+
+std::vector<Simulation::StateField> Simulation::state_fields()
+{
+	const size_t scalar_field_size = total_cell_count * scalar_size;
+	return {{"velocity", &u, 2 * scalar_field_size}, {"pressure", &p, scalar_field_size}, {"dye", &dye, scalar_field_size}};
+}
+
+//The fields are copied into the staging buffers, which are mapped for the writer once the copies complete
+void Simulation::start_checkpoint(const std::string& path)
+{
+	const auto fields = state_fields();
+	if (not snapshot_writer) {
+		const auto context = cmd_queue.getInfo<CL_QUEUE_CONTEXT>();
+		for (const auto& field : fields) {
+			checkpoint.staging.emplace_back(context, CL_MEM_READ_WRITE | CL_MEM_ALLOC_HOST_PTR, field.size);
+		}
+		checkpoint.data.resize(fields.size());
+		snapshot_writer = std::make_shared<SnapshotWriter>();
+	}
+
+	SnapshotWriter::Job job;
+	job.path = path;
+	job.parameters = parameters;
+	job.step = step_count;
+	for (size_t i = 0; i < fields.size(); ++i) {
+		cmd_queue.enqueueCopyBuffer(*fields[i].buffer, checkpoint.staging[i], 0, 0, fields[i].size);
+		cl::Event mapped;
+		checkpoint.data[i] = cmd_queue.enqueueMapBuffer(checkpoint.staging[i], CL_FALSE, CL_MAP_READ, 0, fields[i].size, nullptr, &mapped);
+		job.fields.push_back(SnapshotField{fields[i].name, checkpoint.data[i], fields[i].size});
+		job.ready.push_back(mapped);
+	}
+	cmd_queue.flush();
+	snapshot_writer->submit(std::move(job));
+	checkpoint.pending = true;
+}
+
+//Blocks until the writer is done with the staging buffers, they're unmapped even if the snapshot wasn't written
+void Simulation::finish_checkpoint()
+{
+	std::exception_ptr failure;
+	try {
+		snapshot_writer->wait();
+	} catch (...) {
+		failure = std::current_exception();
+	}
+	for (size_t i = 0; i < checkpoint.staging.size(); ++i) {
+		cmd_queue.enqueueUnmapMemObject(checkpoint.staging[i], checkpoint.data[i]);
+		checkpoint.data[i] = nullptr;
+	}
+	checkpoint.pending = false;
+	if (failure) {
+		std::rethrow_exception(failure);
+	}
+}
+
+//Like the frames for the UI, the fields are copied into the next slot of the ring and mapped without blocking
+void Simulation::record_fields()
+{
+	const auto fields = state_fields();
+	auto& slot = recording_slots[next_recording_slot];
+	if (slot.staging.empty()) {
+		const auto context = cmd_queue.getInfo<CL_QUEUE_CONTEXT>();
+		for (const auto& field : fields) {
+			slot.staging.emplace_back(context, CL_MEM_READ_WRITE | CL_MEM_ALLOC_HOST_PTR, field.size);
+		}
+		slot.data.resize(fields.size());
+	}
+	// The slot's previous frame is the oldest one still queued, it has to be written before the slot is reused
+	if (slot.pending) {
+		release_recording_slot(slot);
+	}
+
+	std::vector<const void*> data;
+	std::vector<cl::Event> ready;
+	for (size_t i = 0; i < fields.size(); ++i) {
+		cmd_queue.enqueueCopyBuffer(*fields[i].buffer, slot.staging[i], 0, 0, fields[i].size);
+		cl::Event mapped;
+		slot.data[i] = cmd_queue.enqueueMapBuffer(slot.staging[i], CL_FALSE, CL_MAP_READ, 0, fields[i].size, nullptr, &mapped);
+		data.push_back(slot.data[i]);
+		ready.push_back(mapped);
+	}
+	cmd_queue.flush();
+	slot.frame = recorder->submit(step_count, std::move(data), std::move(ready));
+	slot.pending = true;
+	next_recording_slot = (next_recording_slot + 1) % recording_slots.size();
+}
+
+void Simulation::release_recording_slot(RecordingSlot& slot)
+{
+	recorder->wait(slot.frame);
+	for (size_t i = 0; i < slot.staging.size(); ++i) {
+		cmd_queue.enqueueUnmapMemObject(slot.staging[i], slot.data[i]);
+		slot.data[i] = nullptr;
 	}
+	slot.pending = false;
 }
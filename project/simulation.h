@@ -26,9 +26,84 @@
 
 #include "typedefs.h"
 #include "channel.h"
+#include "colormap.h"
+#include "profiler.h"
+#include "recorder.h"
+#include "trace.h"
+
+#include <array>
+#include <chrono>
+#include <memory>
+#include <string>
+#include <vector>
+
+enum class PressureSolver {
+	JACOBI,
+	RED_BLACK_SOR,
+	TEMPORALLY_BLOCKED_JACOBI,
+	MULTIGRID,
+	CONJUGATE_GRADIENT
+};
+
+enum class DiffusionSolver {
+	JACOBI,
+	RED_BLACK_SOR,
+	TEMPORALLY_BLOCKED_JACOBI
+};
+
+//Field shown by the UI
+enum class VisualizedField {
+	DYE,
+	SPEED,
+	PRESSURE,
+	VORTICITY
+};
+
+//Grid and physical parameters of a simulation, the grid size includes the boundary cells
+struct SimulationParameters {
+	cl_uint cells_x {512 + 2};
+	cl_uint cells_y {512 + 2};
+	Scalar time_step {0.1};
+	Scalar dx {0.2};
+	Scalar viscosity {1.13e-3};
+	Scalar velocity_dissipation {0.99};
+	Scalar dye_dissipation {0.999};
+	Scalar vorticity_scale {0.35}; //of the vorticity confinement force
+	FieldStorage storage {FieldStorage::FLOAT};
+};
+
+//The parameters as settings of an event trace and back, settings_parameters throws std::invalid_argument
+//if one of them is missing or malformed
+TraceSettings parameter_settings(const SimulationParameters& parameters);
+SimulationParameters settings_parameters(const TraceSettings& settings);
+
+class HaloExchange;
+class Snapshot;
+class SnapshotWriter;
+
+//Ranges of the gaussian falloff of the sources, in cells
+constexpr Scalar impulse_range = 2;
+constexpr Scalar dye_range = 64;
+constexpr Scalar source_cutoff_ranges = 3.75; //the falloff past it is below 1e-6
+
+//Force and dye emitters along a row near the top of the grid, which keep the default simulation moving
+std::vector<Event> default_emitters(cl_uint cells_x, cl_uint cells_y);
 
 class Simulation
 {
+public:
+#ifdef FLUIDSIM_TILED_STENCILS
+	//Work-group size (per dimension) of the stencil kernels, which load their cells into local memory
+	static constexpr cl_uint tile_size = 16;
+#endif
+	//Work-group size (per dimension) of the temporally blocked Jacobi kernels
+	static constexpr cl_uint jacobi_block_size = 16;
+	//Cells (per dimension) of their tiles, a multiple of the work-group size. A tile loses 2 cells per dimension
+	//with every iteration of a launch, so it has to be much larger than that.
+	static constexpr cl_uint jacobi_tile_size = 32;
+	//Frames of a recording in flight at once, the capacity the recorder's queue needs
+	static constexpr size_t recording_slot_count = 3;
+private:
 	cl::CommandQueue cmd_queue;
 
 	//scalar fields
@@ -43,60 +118,288 @@ class Simulation
 	cl::Buffer w; //divergent velocity field
 	cl::Buffer gradient_p;
 
-	cl_uint cell_count;
+	//Level 0 of the multigrid hierarchy uses p, temporary_p & divergence_w, only its residual buffer is used
+	struct MultigridLevel {
+		cl_uint cells_x;
+		cl_uint cells_y;
+		Scalar h; //cell size on this level
+		cl::Buffer x;
+		cl::Buffer temporary_x;
+		cl::Buffer b;
+		cl::Buffer residual;
+	};
+	std::vector<MultigridLevel> multigrid_levels;
+
+	SimulationParameters parameters; //written into the snapshots
+	cl_uint cells_x;
+	cl_uint cells_y;
 	cl_uint total_cell_count;
+	size_t scalar_size; //bytes per stored scalar
 
 	cl::Kernel vector_advection_kernel;
 	cl::Kernel scalar_advection_kernel;
 	cl::Kernel scalar_jacobi_kernel;
 	cl::Kernel vector_jacobi_kernel;
+	cl::Kernel scalar_jacobi_folded_kernel;
+	cl::Kernel vector_jacobi_folded_kernel;
+	cl::Kernel scalar_sor_kernel;
+	cl::Kernel vector_sor_kernel;
+	cl::Kernel scalar_jacobi_blocked_kernel;
+	cl::Kernel vector_jacobi_blocked_kernel;
+	cl::Kernel advect_velocity_and_dye_kernel;
+	cl::Kernel vorticity_confinement_kernel;
+	cl::Kernel subtract_pressure_gradient_kernel;
 	cl::Kernel divergence_kernel;
 	cl::Kernel gradient_kernel;
 	cl::Kernel subtract_gradient_p_kernel;
 	cl::Kernel vector_boundary_kernel;
 	cl::Kernel scalar_boundary_kernel;
-	cl::Kernel apply_impulse_kernel;
-	cl::Kernel add_dye_kernel;
+	cl::Kernel apply_force_sources_kernel;
+	cl::Kernel add_dye_sources_kernel;
 	cl::Kernel dye_boundary_conditions_kernel;
 	cl::Kernel vorticity_kernel;
 	cl::Kernel apply_vorticity_kernel;
 	cl::Kernel apply_gravity_kernel;
+	cl::Kernel multigrid_smooth_kernel;
+	cl::Kernel multigrid_residual_kernel;
+	cl::Kernel multigrid_restrict_kernel;
+	cl::Kernel multigrid_prolongate_kernel;
+	cl::Kernel multigrid_boundary_kernel;
+	cl::Kernel scalar_jacobi_residual_kernel;
+	cl::Kernel vector_jacobi_residual_kernel;
+	cl::Kernel reduce_sum_kernel;
+	cl::Kernel cg_initialize_kernel;
+	cl::Kernel cg_apply_operator_kernel;
+	cl::Kernel cg_update_solution_kernel;
+	cl::Kernel cg_update_direction_kernel;
+	cl::Kernel visualize_scalar_kernel;
+	cl::Kernel visualize_speed_kernel;
+	cl::Kernel visualize_vorticity_kernel;
+	cl::Kernel unpack_scalar_field_kernel;
+
+	//conjugate gradient fields
+	cl::Buffer cg_r; //residual
+	cl::Buffer cg_z; //preconditioned residual
+	cl::Buffer cg_d; //search direction
+	cl::Buffer cg_q; //operator applied to the search direction
+
+	cl::Buffer residual_partial_sums;
+	cl::Buffer reduction_results;
+	cl_uint inner_local_size; //per dimension of the inner kernels' work-groups
+	cl_uint inner_global_x; //the inner cell count rounded up to the work-group size
+	cl_uint inner_global_y;
+	cl_uint reduction_local_size; //per dimension of the residual kernels' work-groups
+	cl_uint reduction_groups_x;
+	cl_uint reduction_groups_y;
+
+	//Sources of one type, injected with a single launch. The host copy can't be refilled until its upload completes.
+	struct SourceBatch {
+		std::vector<Source> sources;
+		cl::Buffer buffer;
+		size_t capacity {0}; //in bytes
+		cl::Event upload;
+	};
+	SourceBatch force_sources;
+	SourceBatch dye_sources;
+	std::vector<Event> emitters;
+
+	//Ring of staging buffers in host accessible memory, each update renders the visualized field into the next one
+	//and maps it without blocking. Frames are handed to the UI in order, once their maps complete.
+	struct Readback {
+		cl::Buffer staging;
+		cl::Event mapped;
+		Pixel* data {nullptr};
+		bool pending {false};
+	};
+	std::vector<Readback> readbacks;
+	size_t next_readback {0};
+
+	//Host accessible copies of the fields a snapshot is written from, they're filled and mapped without blocking
+	//and stay mapped until the writer is done with them
+	struct Checkpoint {
+		std::vector<cl::Buffer> staging;
+		std::vector<void*> data;
+		bool pending {false};
+	};
+	Checkpoint checkpoint;
+	std::shared_ptr<SnapshotWriter> snapshot_writer; //created with the first snapshot
+	std::string checkpoint_path;
+	cl_ulong checkpoint_interval {0};
+	cl_ulong step_count {0}; //updates made, including those of the snapshot the simulation was loaded from
+
+	//Ring of staging buffers the recorded fields are copied into and mapped without blocking, a slot is reused once
+	//the recorder has written the frame it holds
+	struct RecordingSlot {
+		std::vector<cl::Buffer> staging;
+		std::vector<void*> data;
+		cl_ulong frame {0}; //number of the recorder's frame
+		bool pending {false};
+	};
+	std::vector<RecordingSlot> recording_slots;
+	size_t next_recording_slot {0};
+	std::unique_ptr<FieldRecorder> recorder; //destroyed before the slots, it finishes writing their frames
+	cl_ulong recording_interval {0};
+
+	std::shared_ptr<EventTraceWriter> trace_writer;
+	cl_ulong checksum_interval {0};
+	std::shared_ptr<const EventTrace> replayed_trace;
+	cl_ulong mismatch_count {0};
+
+	//A field which carries over between updates, the others are recomputed by every update
+	struct StateField {
+		const char* name;
+		cl::Buffer* buffer;
+		size_t size; //in bytes
+	};
+
+	cl::Buffer colormap;
+	VisualizedField visualized_field {VisualizedField::DYE};
 
-	Channel_ptr<ScalarField> to_ui;
+	Mailbox_ptr<PixelField> to_ui; //latest-wins, frames the UI is too slow to display are overwritten
 	Channel_ptr<Event> events_from_ui;
+	std::vector<Event> events; //received from the UI during the current update
 
-	VectorField zero_vector_buffer;
-	std::deque<ScalarField> dye_buffers_wait_list;
-	
-	const cl_uint workgroup_size;
+	const cl_uint workgroup_size; //upper bound of the work-items in a work-group of the inner kernels
+	PressureSolver pressure_solver {PressureSolver::JACOBI};
+	DiffusionSolver diffusion_solver {DiffusionSolver::JACOBI};
+	Scalar sor_relaxation_factor {1.5};
+	Scalar residual_tolerance {0.0};
+	cl_uint residual_check_interval {0};
+	bool fused_kernels {false};
+	bool fold_boundary_conditions {false};
+	int solver_iterations {100};
+	bool phase_timing {false};
+	std::chrono::steady_clock::time_point phase_start;
+	std::shared_ptr<Profiler> profiler;
+	std::shared_ptr<HaloExchange> halo_exchange;
+	size_t slab {0};
+	mutable FrameStats stats;
 public:
+	//The program has to be built for the parameters' grid size and field storage
 	Simulation(cl::CommandQueue cmd_queue,
 		   const cl::Context& context,
-		   cl_uint cell_count,
+		   const SimulationParameters& parameters,
 		   const cl::Program& program,
-		   Channel_ptr<ScalarField> to_ui,
+		   Mailbox_ptr<PixelField> to_ui,
 		   Channel_ptr<Event> events_from_ui,
 		   cl_uint workgroup_size);
 
 	void update();
+	void set_pressure_solver(PressureSolver solver);
+	void set_diffusion_solver(DiffusionSolver solver);
+	//Over-relaxation factor (omega) of the red-black SOR iterations, 1 gives plain Gauss-Seidel
+	void set_sor_relaxation_factor(Scalar omega);
+	//Fused kernels do the same work in fewer passes over the fields
+	void set_fused_kernels(bool enabled);
+	//The Jacobi solvers use stencil kernels with the boundary condition folded in, instead of launching
+	//the boundary kernel before every iteration
+	void set_fold_boundary_conditions(bool enabled);
+	//Iteration count of the Jacobi, red-black SOR and temporally blocked Jacobi solvers,
+	//an upper bound when the residual tolerance is enabled
+	void set_solver_iterations(cl_uint iterations);
+	//Waits for the queue to finish after each phase of an update to time it on the host,
+	//this takes away the overlap of the host and the device
+	void set_phase_timing(bool enabled);
+	//Records every command in the profiler, which needs the queue to be created with CL_QUEUE_PROFILING_ENABLE.
+	//The profile is dumped when a DUMP_PROFILE event arrives, a null profiler disables profiling.
+	void set_profiler(std::shared_ptr<Profiler> profiler);
+	//Stops the iterative solvers once the residual, checked every check_interval iterations, drops below tolerance.
+	//A check interval of 0 disables the checks.
+	void set_residual_tolerance(Scalar tolerance, cl_uint check_interval);
+	const FrameStats& frame_stats() const;
+	//The frames sent to the UI show the field through the colormap, values from min to max cover the whole colormap
+	void set_visualization(VisualizedField field, ColormapType colormap_type, Scalar min, Scalar max);
+	//Emitters are injected on every update, in addition to the events from the UI
+	void set_emitters(std::vector<Event> emitters);
+	//Makes this simulation one slab of a decomposed grid, the halo rows are exchanged with the neighbouring
+	//slabs whenever a boundary condition is applied. The Jacobi solvers exchange them only every halo rows
+	//iterations, while the rows away from the halo are computed.
+	void set_halo_exchange(std::shared_ptr<HaloExchange> halo_exchange, size_t slab);
+	//Blocks until the dye field is read, it's converted to floats when the fields are stored in a 16-bit format
+	void read_dye(ScalarField& field);
+	//Updates made so far
+	cl_ulong step() const;
+	//Writes a snapshot every interval updates, in the background, the next one is skipped if it's still being written.
+	//Every checkpoint replaces the previous one at path. An interval of 0 disables the checkpoints.
+	void set_checkpoints(std::string path, cl_ulong interval);
+	//Blocks until the snapshot is written, throws std::runtime_error if it can't be
+	void save_snapshot(const std::string& path);
+	//Continues from a snapshot of a simulation of the same grid size and field storage, throws std::invalid_argument
+	//if it doesn't match
+	void load_snapshot(const Snapshot& snapshot);
+	//Names and components of the fields in the snapshots and recordings, in their order
+	static std::vector<RecordedField> recorded_fields();
+	//Records the fields every interval updates, a null recorder stops the recording once its frames are written.
+	//The recorder's capacity has to be at least recording_slot_count.
+	void set_recorder(std::unique_ptr<FieldRecorder> recorder, cl_ulong interval);
+	//Writes the events of every update into the trace, with the checksums of the fields every checksum_interval
+	//updates. A null trace stops the recording, an interval of 0 disables the checksums.
+	void set_event_recording(std::shared_ptr<EventTraceWriter> trace, cl_ulong checksum_interval);
+	//Takes the events of each update from the trace instead of the UI and compares the fields with the trace's
+	//checksums, throws std::invalid_argument naming the settings which differ from the trace's. A null trace
+	//stops the replay.
+	void set_replay(std::shared_ptr<const EventTrace> trace);
+	//Parameters and solver settings, which the fields depend on, as recorded in event traces
+	TraceSettings trace_settings() const;
+	//Applies the solver settings of a trace, throws std::invalid_argument if one is missing or malformed.
+	//The parameters can't be changed after construction.
+	void apply_trace_settings(const TraceSettings& settings);
+	//Checksums of the replay which didn't match the fields
+	cl_ulong checksum_mismatches() const;
+	//Blocks until the fields are read
+	std::vector<FieldChecksum> field_checksums();
 private:
+	void create_multigrid_levels(const cl::Context& context, Scalar dx);
+	void enqueueKernel(cl::CommandQueue& cmd_queue, const cl::Kernel& kernel, const cl::NDRange& offset,
+			   const cl::NDRange& global, const cl::NDRange& local = cl::NullRange) const;
 	void enqueueBoundaryKernel(cl::CommandQueue& cmd_queue, cl::Kernel& boundary_kernel) const;
 	void enqueueInnerKernel(cl::CommandQueue& cmd_queue, const cl::Kernel& kernel) const;
+	void enqueueRowsKernel(cl::CommandQueue& cmd_queue, const cl::Kernel& kernel, cl_uint first_row, cl_uint row_count) const;
+	//An inner launch of a Jacobi iteration of x, which exchanges the halo of a slab when it's due
+	void enqueueJacobiKernel(const cl::Kernel& kernel, const cl::Buffer& x, int iteration, size_t element_size);
+	void enqueueBlockedKernel(cl::CommandQueue& cmd_queue, cl::Kernel& kernel, cl_int sweeps) const;
+	//b may be the same member as x, it then follows x through the swaps
+	int blocked_jacobi(cl::Kernel& kernel, cl::Kernel& residual_kernel, cl::Buffer& x, cl::Buffer& temporary_x, const cl::Buffer& b, Scalar& residual);
+	void enqueueRedBlackKernel(cl::CommandQueue& cmd_queue, cl::Kernel& kernel) const;
+	void enqueueLevelKernel(cl::CommandQueue& cmd_queue, const cl::Kernel& kernel, const MultigridLevel& level) const;
+	bool residual_check_enabled() const;
+	bool residual_check_due(int iteration) const;
+	void enqueueReductionKernel(cl::CommandQueue& cmd_queue, const cl::Kernel& kernel) const;
+	void enqueueReduceSum(cl::CommandQueue& cmd_queue, cl_uint result_index);
+	Scalar read_reduction_result(cl_uint result_index);
+	Scalar calculate_residual(cl::Kernel& residual_kernel, const cl::Buffer& x, const cl::Buffer& b);
 	void calculate_advection();
 	void calculate_diffusion();
 	void calculate_divergence_w();
 	void zero_fill_vector_field(cl::Buffer& field);
-	void zero_fill_scalar_field(cl::Buffer& field);
+	void zero_fill_scalar_field(cl::Buffer& field, cl_uint field_cell_count);
 	void calculate_p();
-	void apply_scalar_boundary_conditions(cl::Buffer& buffer);
-	void apply_vector_boundary_conditions(cl::Buffer& buffer);
+	void calculate_p_relaxation();
+	void calculate_p_multigrid();
+	void calculate_p_conjugate_gradient();
+	void multigrid_v_cycle(size_t level, cl::Buffer& x, cl::Buffer& temporary_x, const cl::Buffer& b);
+	void multigrid_smooth(size_t level, cl::Buffer& x, cl::Buffer& temporary_x, const cl::Buffer& b, int iterations);
+	void apply_multigrid_boundary_conditions(cl::Buffer& buffer, const MultigridLevel& level);
+	void apply_scalar_boundary_conditions(cl::Buffer& buffer, bool exchange_halo = true);
+	void apply_vector_boundary_conditions(cl::Buffer& buffer, bool exchange_halo = true);
 	void calculate_gradient_p();
 	void calculate_u();
 	void advect_dye();
-	void apply_impulse(const Event& simulation_event);
-	void add_dye(const Event& simulation_event);
 	void apply_dye_boundary_conditions();
 	void apply_gravity();
 	void apply_vorticity();
+	void inject_sources(Event::Type type);
+	void advect_velocity_and_dye();
+	void apply_vorticity_confinement();
+	void subtract_pressure_gradient();
+	void read_back_frame();
+	void end_phase(Phase phase);
+	void deliver_readback(Readback& readback);
+	std::vector<StateField> state_fields();
+	void start_checkpoint(const std::string& path);
+	void finish_checkpoint();
+	void record_fields();
+	void release_recording_slot(RecordingSlot& slot);
+	void verify_checksums(const std::vector<FieldChecksum>& expected);
 };
 #endif //SIMULATION_H
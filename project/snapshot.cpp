@@ -0,0 +1,263 @@
+/**
+ * FluidSim - a free and open-source interactive fluid flow simulator
+ * Copyright (C) 2015  Damian Jarek <damian.jarek93@gmail.com>
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License along
+ * with this program; if not, write to the Free Software Foundation, Inc.,
+ * 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+ */
+
+#include "snapshot.h"
+#include <algorithm>
+#include <cstdio>
+#include <cstring>
+#include <fcntl.h>
+#include <fstream>
+#include <stdexcept>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+static const char snapshot_magic[8] = {'F', 'L', 'U', 'I', 'D', 'S', 'N', 'P'};
+
+//On-disk layout, in the host's byte order
+struct SnapshotHeader {
+	char magic[8];
+	cl_uint version;
+	cl_uint field_count;
+	cl_ulong step;
+	cl_uint cells_x;
+	cl_uint cells_y;
+	cl_uint storage;
+	Scalar time_step;
+	Scalar dx;
+	Scalar viscosity;
+	Scalar velocity_dissipation;
+	Scalar dye_dissipation;
+	Scalar vorticity_scale;
+	cl_uint reserved;
+};
+
+struct SnapshotTableEntry {
+	char name[16];
+	cl_ulong offset;
+	cl_ulong size;
+};
+
+static size_t align(size_t offset)
+{
+	return (offset + snapshot_alignment - 1) / snapshot_alignment * snapshot_alignment;
+}
+
+Snapshot::Snapshot(const std::string& path)
+{
+	const int file = open(path.c_str(), O_RDONLY);
+	if (file < 0) {
+		throw std::runtime_error{"can't open " + path};
+	}
+	struct stat status;
+	if (fstat(file, &status) != 0 or static_cast<size_t>(status.st_size) < sizeof(SnapshotHeader)) {
+		close(file);
+		throw std::runtime_error{path + " isn't a snapshot"};
+	}
+	mapping_size = status.st_size;
+	mapping = mmap(nullptr, mapping_size, PROT_READ, MAP_PRIVATE, file, 0);
+	close(file);
+	if (mapping == MAP_FAILED) {
+		mapping = nullptr;
+		throw std::runtime_error{"can't map " + path};
+	}
+	// The fields are read once, front to back, when they're uploaded
+	madvise(mapping, mapping_size, MADV_SEQUENTIAL);
+
+	const auto bytes = static_cast<const char*>(mapping);
+	SnapshotHeader header;
+	std::memcpy(&header, bytes, sizeof(header));
+	const size_t table_end = sizeof(header) + header.field_count * sizeof(SnapshotTableEntry);
+	if (std::memcmp(header.magic, snapshot_magic, sizeof(snapshot_magic)) != 0 or header.version != snapshot_version
+	    or header.storage > static_cast<cl_uint>(FieldStorage::BFLOAT16) or table_end > mapping_size) {
+		munmap(mapping, mapping_size);
+		throw std::runtime_error{path + " isn't a version " + std::to_string(snapshot_version) + " snapshot"};
+	}
+
+	simulation_parameters.cells_x = header.cells_x;
+	simulation_parameters.cells_y = header.cells_y;
+	simulation_parameters.time_step = header.time_step;
+	simulation_parameters.dx = header.dx;
+	simulation_parameters.viscosity = header.viscosity;
+	simulation_parameters.velocity_dissipation = header.velocity_dissipation;
+	simulation_parameters.dye_dissipation = header.dye_dissipation;
+	simulation_parameters.vorticity_scale = header.vorticity_scale;
+	simulation_parameters.storage = static_cast<FieldStorage>(header.storage);
+	update_count = header.step;
+
+	for (cl_uint i = 0; i < header.field_count; ++i) {
+		SnapshotTableEntry entry;
+		std::memcpy(&entry, bytes + sizeof(header) + i * sizeof(entry), sizeof(entry));
+		if (entry.offset > mapping_size or entry.size > mapping_size - entry.offset) {
+			munmap(mapping, mapping_size);
+			throw std::runtime_error{path + " is truncated"};
+		}
+		const std::string name {entry.name, strnlen(entry.name, sizeof(entry.name))};
+		fields.push_back(SnapshotField{name, bytes + entry.offset, entry.size});
+	}
+}
+
+Snapshot::~Snapshot()
+{
+	munmap(mapping, mapping_size);
+}
+
+const SimulationParameters& Snapshot::parameters() const
+{
+	return simulation_parameters;
+}
+
+cl_ulong Snapshot::step() const
+{
+	return update_count;
+}
+
+const void* Snapshot::field(const std::string& name, size_t size) const
+{
+	const auto field = std::find_if(fields.begin(), fields.end(), [&](const SnapshotField& field) { return field.name == name; });
+	if (field == fields.end()) {
+		throw std::invalid_argument{"the snapshot has no " + name + " field"};
+	}
+	if (field->size != size) {
+		throw std::invalid_argument{"the snapshot's " + name + " field doesn't match the grid"};
+	}
+	return field->data;
+}
+
+static void write_snapshot(const SnapshotWriter::Job& job)
+{
+	SnapshotHeader header {};
+	std::memcpy(header.magic, snapshot_magic, sizeof(snapshot_magic));
+	header.version = snapshot_version;
+	header.field_count = job.fields.size();
+	header.step = job.step;
+	header.cells_x = job.parameters.cells_x;
+	header.cells_y = job.parameters.cells_y;
+	header.storage = static_cast<cl_uint>(job.parameters.storage);
+	header.time_step = job.parameters.time_step;
+	header.dx = job.parameters.dx;
+	header.viscosity = job.parameters.viscosity;
+	header.velocity_dissipation = job.parameters.velocity_dissipation;
+	header.dye_dissipation = job.parameters.dye_dissipation;
+	header.vorticity_scale = job.parameters.vorticity_scale;
+
+	std::vector<SnapshotTableEntry> table(job.fields.size());
+	size_t offset = align(sizeof(header) + table.size() * sizeof(SnapshotTableEntry));
+	for (size_t i = 0; i < table.size(); ++i) {
+		std::memset(&table[i], 0, sizeof(table[i]));
+		job.fields[i].name.copy(table[i].name, sizeof(table[i].name) - 1);
+		table[i].offset = offset;
+		table[i].size = job.fields[i].size;
+		offset = align(offset + job.fields[i].size);
+	}
+
+	// Written to a temporary file first, so that a failed write never replaces the previous snapshot
+	const auto temporary_path = job.path + '.' + std::to_string(getpid()) + ".tmp";
+	{
+		std::ofstream file{temporary_path, std::ios::binary};
+		file.write(reinterpret_cast<const char*>(&header), sizeof(header));
+		file.write(reinterpret_cast<const char*>(table.data()), table.size() * sizeof(SnapshotTableEntry));
+		const std::vector<char> padding(snapshot_alignment, '\0');
+		size_t position = sizeof(header) + table.size() * sizeof(SnapshotTableEntry);
+		for (size_t i = 0; i < table.size(); ++i) {
+			file.write(padding.data(), table[i].offset - position);
+			file.write(static_cast<const char*>(job.fields[i].data), job.fields[i].size);
+			position = table[i].offset + table[i].size;
+		}
+		if (not file) {
+			std::remove(temporary_path.c_str());
+			throw std::runtime_error{"can't write " + temporary_path};
+		}
+	}
+	if (std::rename(temporary_path.c_str(), job.path.c_str()) != 0) {
+		std::remove(temporary_path.c_str());
+		throw std::runtime_error{"can't rename " + temporary_path + " to " + job.path};
+	}
+}
+
+SnapshotWriter::SnapshotWriter():
+	thread(&SnapshotWriter::run, this)
+{
+}
+
+SnapshotWriter::~SnapshotWriter()
+{
+	{
+		std::lock_guard<std::mutex> lock{mutex};
+		stopping = true;
+	}
+	condition.notify_all();
+	thread.join();
+}
+
+void SnapshotWriter::submit(Job job)
+{
+	{
+		std::lock_guard<std::mutex> lock{mutex};
+		this->job = std::move(job);
+		pending = true;
+		failure = nullptr;
+	}
+	condition.notify_all();
+}
+
+bool SnapshotWriter::busy()
+{
+	std::lock_guard<std::mutex> lock{mutex};
+	return pending;
+}
+
+void SnapshotWriter::wait()
+{
+	std::unique_lock<std::mutex> lock{mutex};
+	condition.wait(lock, [&] { return not pending; });
+	if (failure) {
+		auto error = failure;
+		failure = nullptr;
+		std::rethrow_exception(error);
+	}
+}
+
+//A snapshot submitted before the writer is destroyed is still written
+void SnapshotWriter::run()
+{
+	std::unique_lock<std::mutex> lock{mutex};
+	while (true) {
+		condition.wait(lock, [&] { return pending or stopping; });
+		if (not pending) {
+			return;
+		}
+
+		lock.unlock();
+		std::exception_ptr error;
+		try {
+			if (not job.ready.empty()) {
+				cl::Event::waitForEvents(job.ready);
+			}
+			write_snapshot(job);
+		} catch (...) {
+			error = std::current_exception();
+		}
+		lock.lock();
+
+		failure = error;
+		pending = false;
+		condition.notify_all();
+	}
+}
@@ -0,0 +1,103 @@
+/**
+ * FluidSim - a free and open-source interactive fluid flow simulator
+ * Copyright (C) 2015  Damian Jarek <damian.jarek93@gmail.com>
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License along
+ * with this program; if not, write to the Free Software Foundation, Inc.,
+ * 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+ */
+
+#ifndef SNAPSHOT_H
+#define SNAPSHOT_H
+
+#define __CL_ENABLE_EXCEPTIONS
+
+#include <CL/cl.hpp>
+
+#include "simulation.h"
+
+#include <condition_variable>
+#include <exception>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <vector>
+
+//Snapshot files hold the state of a simulation: its parameters, the number of updates it made and the fields
+//which carry over between updates, in the device's storage format. A header and a table of the fields are followed
+//by the fields' data at page aligned offsets, so that a mapped file can be uploaded straight from the mapping.
+constexpr cl_uint snapshot_version = 1;
+constexpr size_t snapshot_alignment = 4096;
+
+struct SnapshotField {
+	std::string name;
+	const void* data;
+	size_t size; //in bytes
+};
+
+//A snapshot file mapped into memory, the fields point into the mapping. Throws std::runtime_error if the file
+//can't be mapped or isn't a snapshot of this version.
+class Snapshot
+{
+	void* mapping {nullptr};
+	size_t mapping_size {0};
+	SimulationParameters simulation_parameters;
+	cl_ulong update_count {0};
+	std::vector<SnapshotField> fields;
+public:
+	explicit Snapshot(const std::string& path);
+	~Snapshot();
+	Snapshot(const Snapshot&) = delete;
+	Snapshot& operator=(const Snapshot&) = delete;
+
+	const SimulationParameters& parameters() const;
+	cl_ulong step() const;
+	//Throws std::invalid_argument if the snapshot has no such field or it's of a different size
+	const void* field(const std::string& name, size_t size) const;
+};
+
+//Writes snapshots on a background thread, one at a time. The data of a submitted snapshot has to stay valid until
+//it's written, the writer waits for the events first, so the fields can still be on their way from the device.
+//Files are written to a temporary file and renamed, a crash while writing leaves the previous snapshot intact.
+class SnapshotWriter
+{
+public:
+	struct Job {
+		std::string path;
+		SimulationParameters parameters;
+		cl_ulong step;
+		std::vector<SnapshotField> fields;
+		std::vector<cl::Event> ready;
+	};
+private:
+	std::mutex mutex;
+	std::condition_variable condition;
+	Job job;
+	bool pending {false};
+	bool stopping {false};
+	std::exception_ptr failure;
+	std::thread thread;
+public:
+	SnapshotWriter();
+	~SnapshotWriter();
+
+	//The previous snapshot has to be written, see busy
+	void submit(Job job);
+	bool busy();
+	//Blocks until the submitted snapshot is written and rethrows the exception it failed with
+	void wait();
+private:
+	void run();
+};
+
+#endif //SNAPSHOT_H
@@ -0,0 +1,145 @@
+/**
+ * FluidSim - a free and open-source interactive fluid flow simulator
+ * Copyright (C) 2015  Damian Jarek <damian.jarek93@gmail.com>
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License along
+ * with this program; if not, write to the Free Software Foundation, Inc.,
+ * 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+ */
+
+#include "threadpool.h"
+#include <algorithm>
+
+ThreadPool::ThreadPool(size_t thread_count):
+	thread_count(thread_count != 0 ? thread_count : std::max(1u, std::thread::hardware_concurrency()))
+{
+	shares.reset(new Share[this->thread_count]);
+	for (size_t i = 1; i < this->thread_count; ++i) {
+		threads.emplace_back(&ThreadPool::run_thread, this, i);
+	}
+}
+
+ThreadPool::~ThreadPool()
+{
+	{
+		std::lock_guard<std::mutex> lock{mutex};
+		stopping = true;
+	}
+	start_condition.notify_all();
+	for (auto& thread : threads) {
+		thread.join();
+	}
+}
+
+size_t ThreadPool::size() const
+{
+	return thread_count;
+}
+
+void ThreadPool::parallel_for(size_t begin, size_t end, size_t grain, const std::function<void(size_t, size_t)>& body)
+{
+	if (begin >= end) {
+		return;
+	}
+	const size_t block_count = (end - begin + grain - 1) / grain;
+	if (block_count == 1 or thread_count == 1) {
+		body(begin, end);
+		return;
+	}
+
+	// The pool threads only look at the shares after they're woken up, and the previous loop is over
+	for (size_t i = 0; i < thread_count; ++i) {
+		shares[i].next = i * block_count / thread_count;
+		shares[i].end = (i + 1) * block_count / thread_count;
+	}
+	{
+		std::lock_guard<std::mutex> lock{mutex};
+		this->body = &body;
+		this->range_begin = begin;
+		this->range_end = end;
+		this->grain = grain;
+		failure = nullptr;
+		active = threads.size();
+		++generation;
+	}
+	start_condition.notify_all();
+
+	work(0);
+
+	std::unique_lock<std::mutex> lock{mutex};
+	done_condition.wait(lock, [&] { return active == 0; });
+	if (failure) {
+		std::rethrow_exception(failure);
+	}
+}
+
+void ThreadPool::run_thread(size_t index)
+{
+	unsigned long seen_generation = 0;
+	for (;;) {
+		{
+			std::unique_lock<std::mutex> lock{mutex};
+			start_condition.wait(lock, [&] { return generation != seen_generation or stopping; });
+			if (stopping) {
+				return;
+			}
+			seen_generation = generation;
+		}
+
+		work(index);
+
+		std::lock_guard<std::mutex> lock{mutex};
+		if (--active == 0) {
+			done_condition.notify_one();
+		}
+	}
+}
+
+void ThreadPool::work(size_t index)
+{
+	size_t block;
+	while (take_block(index, block)) {
+		const size_t block_begin = range_begin + block * grain;
+		try {
+			(*body)(block_begin, std::min(block_begin + grain, range_end));
+		} catch (...) {
+			std::lock_guard<std::mutex> lock{mutex};
+			if (not failure) {
+				failure = std::current_exception();
+			}
+		}
+	}
+}
+
+bool ThreadPool::take_block(size_t index, size_t& block)
+{
+	{
+		auto& own = shares[index];
+		std::lock_guard<std::mutex> lock{own.mutex};
+		if (own.next != own.end) {
+			block = own.next++;
+			return true;
+		}
+	}
+
+	// Steal from the back, so that the owner keeps walking through its rows in order
+	for (size_t i = 1; i < thread_count; ++i) {
+		auto& victim = shares[(index + i) % thread_count];
+		std::lock_guard<std::mutex> lock{victim.mutex};
+		if (victim.next != victim.end) {
+			block = --victim.end;
+			return true;
+		}
+	}
+	return false;
+}
@@ -0,0 +1,78 @@
+/**
+ * FluidSim - a free and open-source interactive fluid flow simulator
+ * Copyright (C) 2015  Damian Jarek <damian.jarek93@gmail.com>
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License along
+ * with this program; if not, write to the Free Software Foundation, Inc.,
+ * 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+ */
+
+#ifndef THREADPOOL_H
+#define THREADPOOL_H
+
+#include "channel.h"
+
+#include <condition_variable>
+#include <cstddef>
+#include <exception>
+#include <functional>
+#include <memory>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+//Fixed set of threads running parallel loops over ranges of rows. Each thread starts with an even share of the
+//range's blocks and takes them from the front, once its share runs out it steals blocks from the back of the
+//other threads' shares. The calling thread takes part in the loops.
+class ThreadPool
+{
+	//Blocks [next, end) of one thread's share, padded so that the shares don't share cache lines
+	struct Share {
+		std::mutex mutex;
+		size_t next {0};
+		size_t end {0};
+		char padding[cache_line_size];
+	};
+
+	std::vector<std::thread> threads;
+	std::unique_ptr<Share[]> shares;
+	const size_t thread_count;
+
+	std::mutex mutex;
+	std::condition_variable start_condition;
+	std::condition_variable done_condition;
+	unsigned long generation {0};
+	size_t active {0}; //pool threads still working on the current loop
+	bool stopping {false};
+	std::exception_ptr failure;
+
+	const std::function<void(size_t, size_t)>* body {nullptr};
+	size_t range_begin {0};
+	size_t range_end {0};
+	size_t grain {1};
+public:
+	//A thread count of 0 uses all hardware threads
+	explicit ThreadPool(size_t thread_count = 0);
+	~ThreadPool();
+
+	size_t size() const;
+	//Calls body(block_begin, block_end) for blocks of at most grain items covering [begin, end) and returns once
+	//all of them are done. The first exception thrown by the body is rethrown.
+	void parallel_for(size_t begin, size_t end, size_t grain, const std::function<void(size_t, size_t)>& body);
+private:
+	void run_thread(size_t index);
+	void work(size_t index);
+	bool take_block(size_t index, size_t& block);
+};
+
+#endif //THREADPOOL_H
@@ -0,0 +1,150 @@
+/**
+ * FluidSim - a free and open-source interactive fluid flow simulator
+ * Copyright (C) 2015  Damian Jarek <damian.jarek93@gmail.com>
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License along
+ * with this program; if not, write to the Free Software Foundation, Inc.,
+ * 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+ */
+
+#include "trace.h"
+#include <algorithm>
+#include <iomanip>
+#include <limits>
+#include <sstream>
+#include <stdexcept>
+
+static const std::string trace_magic = "FluidSim event trace";
+
+std::string setting_text(Scalar value)
+{
+	std::ostringstream text;
+	text << std::setprecision(std::numeric_limits<Scalar>::max_digits10) << value;
+	return text.str();
+}
+
+EventTraceWriter::EventTraceWriter(const std::string& path, const TraceSettings& settings):
+	file(path)
+{
+	if (not file) {
+		throw std::runtime_error{"can't create " + path};
+	}
+	// max_digits10 digits read back as the same float
+	file << std::setprecision(std::numeric_limits<Scalar>::max_digits10);
+	file << trace_magic << ' ' << event_trace_version << '\n';
+	for (const auto& setting : settings) {
+		file << "setting " << setting.first << ' ' << setting.second << '\n';
+	}
+}
+
+void EventTraceWriter::record(cl_ulong step, const std::vector<Event>& events)
+{
+	for (const auto& event : events) {
+		if (event.type == Event::Type::ADD_DYE) {
+			file << step << " add_dye " << event.point.s[0] << ' ' << event.point.s[1] << ' ' << event.value.as_scalar << '\n';
+		} else if (event.type == Event::Type::APPLY_FORCE) {
+			file << step << " apply_force " << event.point.s[0] << ' ' << event.point.s[1] << ' '
+			     << event.value.as_vector.s[0] << ' ' << event.value.as_vector.s[1] << '\n';
+		}
+	}
+}
+
+void EventTraceWriter::record(cl_ulong step, const std::vector<FieldChecksum>& checksums)
+{
+	for (const auto& checksum : checksums) {
+		file << step << " checksum " << checksum.field << ' ' << std::hex << checksum.checksum << std::dec << '\n';
+	}
+	// Checksums are rare, flushing here keeps most of an interrupted run's trace
+	file.flush();
+}
+
+EventTrace::EventTrace(const std::string& path)
+{
+	std::ifstream file{path};
+	if (not file) {
+		throw std::runtime_error{"can't open " + path};
+	}
+
+	std::string line;
+	cl_uint version = 0;
+	if (not std::getline(file, line) or line.compare(0, trace_magic.size(), trace_magic) != 0
+	    or not (std::istringstream{line.substr(trace_magic.size())} >> version) or version != event_trace_version) {
+		throw std::runtime_error{path + " isn't a version " + std::to_string(event_trace_version) + " event trace"};
+	}
+
+	for (int line_number = 2; std::getline(file, line); ++line_number) {
+		if (line.empty()) {
+			continue;
+		}
+
+		std::istringstream fields{line};
+		if (line.compare(0, 8, "setting ") == 0) {
+			std::string name;
+			std::string value;
+			if (not (fields >> name >> name >> value)) {
+				throw std::runtime_error{path + ":" + std::to_string(line_number) + ": malformed trace line"};
+			}
+			trace_settings[name] = value;
+			continue;
+		}
+
+		cl_ulong step = 0;
+		std::string type;
+		Event event;
+		bool valid = static_cast<bool>(fields >> step >> type);
+		if (valid and type == "add_dye") {
+			event.type = Event::Type::ADD_DYE;
+			valid = static_cast<bool>(fields >> event.point.s[0] >> event.point.s[1] >> event.value.as_scalar);
+			step_events[step].push_back(event);
+		} else if (valid and type == "apply_force") {
+			event.type = Event::Type::APPLY_FORCE;
+			valid = static_cast<bool>(fields >> event.point.s[0] >> event.point.s[1]
+						  >> event.value.as_vector.s[0] >> event.value.as_vector.s[1]);
+			step_events[step].push_back(event);
+		} else if (valid and type == "checksum") {
+			FieldChecksum checksum;
+			valid = static_cast<bool>(fields >> checksum.field >> std::hex >> checksum.checksum);
+			step_checksums[step].push_back(checksum);
+		} else {
+			valid = false;
+		}
+		if (not valid) {
+			throw std::runtime_error{path + ":" + std::to_string(line_number) + ": malformed trace line"};
+		}
+		last = std::max(last, step);
+	}
+}
+
+const TraceSettings& EventTrace::settings() const
+{
+	return trace_settings;
+}
+
+cl_ulong EventTrace::last_step() const
+{
+	return last;
+}
+
+const std::vector<Event>& EventTrace::events(cl_ulong step) const
+{
+	static const std::vector<Event> none;
+	const auto events = step_events.find(step);
+	return events == step_events.end() ? none : events->second;
+}
+
+const std::vector<FieldChecksum>& EventTrace::checksums(cl_ulong step) const
+{
+	static const std::vector<FieldChecksum> none;
+	const auto checksums = step_checksums.find(step);
+	return checksums == step_checksums.end() ? none : checksums->second;
+}
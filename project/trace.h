@@ -0,0 +1,81 @@
+/**
+ * FluidSim - a free and open-source interactive fluid flow simulator
+ * Copyright (C) 2015  Damian Jarek <damian.jarek93@gmail.com>
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License along
+ * with this program; if not, write to the Free Software Foundation, Inc.,
+ * 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+ */
+
+#ifndef TRACE_H
+#define TRACE_H
+
+#include "typedefs.h"
+
+#include <fstream>
+#include <map>
+#include <string>
+#include <vector>
+
+//Event traces hold the settings of a simulation, the events it received, stamped with the number of the update
+//they were applied in, and checksums of its fields after some of the updates. Replaying a trace into a simulation
+//with the same settings reproduces the run bit for bit on the same device and build, the checksums verify it.
+//Traces are text, a "FluidSim event trace 2" line is followed by lines of
+//	setting NAME VALUE
+//	STEP add_dye X Y AMOUNT
+//	STEP apply_force X Y FORCE_X FORCE_Y
+//	STEP checksum FIELD HEX
+constexpr cl_uint event_trace_version = 2;
+
+//Settings of a simulation which change its fields, by name, the values are text without spaces
+using TraceSettings = std::map<std::string, std::string>;
+
+//Scalars with max_digits10 digits, which read back as the same value
+std::string setting_text(Scalar value);
+
+struct FieldChecksum {
+	std::string field;
+	cl_ulong checksum; //fnv1a_hash of the field's bytes in the storage format
+};
+
+class EventTraceWriter
+{
+	std::ofstream file;
+public:
+	//Throws std::runtime_error if the file can't be created
+	EventTraceWriter(const std::string& path, const TraceSettings& settings);
+
+	//Profile dumps aren't recorded, they don't change the simulation
+	void record(cl_ulong step, const std::vector<Event>& events);
+	void record(cl_ulong step, const std::vector<FieldChecksum>& checksums);
+};
+
+//A trace read into memory, throws std::runtime_error if the file can't be read or a line is malformed
+class EventTrace
+{
+	TraceSettings trace_settings;
+	std::map<cl_ulong, std::vector<Event>> step_events;
+	std::map<cl_ulong, std::vector<FieldChecksum>> step_checksums;
+	cl_ulong last {0};
+public:
+	explicit EventTrace(const std::string& path);
+
+	const TraceSettings& settings() const;
+	//Last update with events or checksums, 0 for an empty trace
+	cl_ulong last_step() const;
+	//Empty if the update has none
+	const std::vector<Event>& events(cl_ulong step) const;
+	const std::vector<FieldChecksum>& checksums(cl_ulong step) const;
+};
+
+#endif //TRACE_H
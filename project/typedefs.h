@@ -21,6 +21,7 @@
 #define TYPEDEFS_H
 
 #include <CL/opencl.h>
+#include <vector>
 
 using Scalar = cl_float;
 using Vector = cl_float2;
@@ -28,11 +29,29 @@ using Point  = cl_int2;
 using Offset = Point;
 using ScalarField = std::vector<Scalar>;
 using VectorField = std::vector<Vector>;
+using Pixel = cl_uint; //packed ARGB8888
+using PixelField = std::vector<Pixel>;
+
+//Format of the fields in device memory, the arithmetic is done in float either way. The 16-bit formats halve
+//the memory traffic of the stencils at the cost of precision: half keeps 11 bits of mantissa and a range
+//of 65504, bfloat16 keeps 8 bits of mantissa and the range of a float.
+enum class FieldStorage {
+	FLOAT,
+	HALF,
+	BFLOAT16
+};
+
+//Bytes per scalar of a field, a vector takes twice as much
+inline size_t stored_scalar_size(FieldStorage storage)
+{
+	return storage == FieldStorage::FLOAT ? sizeof(Scalar) : sizeof(cl_half);
+}
 
 struct Event {
 	enum class Type {
 		ADD_DYE,
-		APPLY_FORCE
+		APPLY_FORCE,
+		DUMP_PROFILE
 	};
 
 	Type type {Type::ADD_DYE};
@@ -43,4 +62,12 @@ struct Event {
 	} value;
 };
 
+//A point source injected into the simulation with a gaussian falloff, has the same layout as Source in kernels.cl
+struct Source {
+	Point position;
+	Vector force;
+	Scalar dye;
+	Scalar range;
+};
+
 #endif //TYPEDEFS_H